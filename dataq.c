@@ -25,44 +25,227 @@
 #include <signal.h>
 #include <sysexits.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
+#ifdef __linux__
+  #include <linux/net_tstamp.h>
+#endif
+#include <poll.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
 
 // Include forward declarations so compiler detects if out-of-sync
 #include "dataq.h"
+#include "dataq_private.h"
 
-// Error message printing
-#ifdef EPRINT
-  #define eprintf(...) fprintf(stderr, __VA_ARGS__)
-#else
-  #define eprintf(...) ((void)0)
-#endif
-
-// Debug message printing
-#ifdef DPRINT
-  #define dprintf(...) fprintf(stderr, __VA_ARGS__)
-#else
-  #define dprintf(...) ((void)0)
-#endif
-
-// Signal handling
+// Signal handling, for receives without a stop handle (dataq_recv())
+// Signal dispositions are per process anyway, so this is the one bit of state
+// shared between devices; dataq_ctx and the rest use stop handles instead
 typedef void (*sighandler_t)(int);  // Defn stolen from signal.h
-int signalled = 0;
+static volatile sig_atomic_t signalled = 0;
 static void trap(int sig)
 {
   signalled = sig;
 }
 
+// Receive from socket, as recv(), and if kts != NULL, set it to the kernel's
+// receive timestamp (if it gave one; see SO_TIMESTAMPING in dataq_sockopts)
+static ssize_t recv_stamped(int sockfd, void *buf, size_t len, int flags,
+                            struct timeval *kts)
+{
+  if (kts == NULL)
+    return recv(sockfd, buf, len, flags);
+
+  struct iovec iov = {.iov_base = buf,.iov_len = len };
+  union {
+    char buf[CMSG_SPACE(3 * sizeof(struct timespec))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg = {
+    .msg_iov = &iov,.msg_iovlen = 1,
+    .msg_control = control.buf,.msg_controllen = sizeof(control.buf),
+  };
+  ssize_t n = recvmsg(sockfd, &msg, flags);
+
+#ifdef SO_TIMESTAMPING
+  struct cmsghdr *cmsg;
+  for (cmsg = CMSG_FIRSTHDR(&msg); n > 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+      struct timespec ts[3];  // Software, (deprecated), hardware
+      memcpy(ts, CMSG_DATA(cmsg), sizeof(ts));
+      kts->tv_sec = ts[0].tv_sec;
+      kts->tv_usec = ts[0].tv_nsec / 1000;
+    }
+#endif
+  return n;
+}
+
+// Receive from socket, catching common signals so we can abort cleanly
+static ssize_t recv_trapped(int sockfd, void *buf, size_t len, int flags,
+                            struct timeval *kts)
+{
+  sighandler_t sigint = signal(SIGINT, &trap);
+  sighandler_t sighup = signal(SIGHUP, &trap);
+  sighandler_t sigterm = signal(SIGTERM, &trap);
+  ssize_t n = recv_stamped(sockfd, buf, len, flags, kts);
+  signal(SIGINT, sigint);
+  signal(SIGHUP, sighup);
+  signal(SIGTERM, sigterm);
+  return n;
+}
+
+/*
+ *  Stop handles
+ */
+
+// Create a stop handle (self-pipe), initially unsignalled
+int dataq_stop_init(struct dataq_stop *stop)
+{
+  if (pipe(stop->fds) == -1) {
+    eprintf("Error creating stop pipe\n");
+    return -EX_OSERR;
+  }
+
+  int i;
+  for (i = 0; i < 2; i++) {
+    fcntl(stop->fds[i], F_SETFD, FD_CLOEXEC);
+    fcntl(stop->fds[i], F_SETFL, fcntl(stop->fds[i], F_GETFL) | O_NONBLOCK);
+  }
+  return EX_OK;
+}
+
+// Signal a stop handle, waking any receive that is waiting on it
+// NOTE async-signal-safe, so may be called from a signal handler
+void dataq_stop_signal(const struct dataq_stop *stop)
+{
+  // Once signalled the pipe stays readable, so a full pipe is fine
+  if (write(stop->fds[1], "", 1) == -1) {
+    // Ignore errors
+  }
+}
+
+// Check whether a stop handle has been signalled, without blocking
+int dataq_stop_pending(const struct dataq_stop *stop)
+{
+  struct pollfd pfd = {.fd = stop->fds[0],.events = POLLIN };
+  return poll(&pfd, 1, 0) > 0;
+}
+
+void dataq_stop_close(struct dataq_stop *stop)
+{
+  close(stop->fds[0]);
+  close(stop->fds[1]);
+  stop->fds[0] = stop->fds[1] = -1;
+}
+
 /*
  *  DATAQ interface
  */
 
-#define BUFSIZE 512   // Size of receive buffer
-#define MAXCHAN 32    // Maximum number of channels
+#define MAXCHAN DATAQ_MAXCHAN  // Maximum number of channels
+#define TIMEOUT_MS 1000  // Receive timeout, same as SO_RCVTIMEO
+
+// Receive from socket, polling it together with the stop handle
+// The socket's own timeout doesn't apply to poll(), so we impose the same one
+// Returns like recv(), with errno == ECANCELED if stopped
+static ssize_t recv_polled(int sockfd, void *buf, size_t len, int flags,
+                           const struct dataq_stop *stop, struct timeval *kts)
+{
+  size_t got = 0;
+
+  do {
+    struct pollfd pfds[2] = {
+      {.fd = sockfd,.events = POLLIN },
+      {.fd = stop->fds[0],.events = POLLIN },
+    };
+    int r = poll(pfds, 2, TIMEOUT_MS);
+    if (r < 0 && errno != EINTR)
+      return -1;
+    if (pfds[1].revents) {
+      errno = ECANCELED;
+      return -1;
+    }
+    if (r == 0) {
+      if (got == 0) {
+        errno = EAGAIN;
+        return -1;
+      }
+      break;
+    }
+    if (r < 0)
+      continue;
+
+    ssize_t n = recv_stamped(sockfd, (uint8_t *) buf + got, len - got,
+                             MSG_DONTWAIT, kts);
+    if (n == 0)
+      break;
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        continue;
+      return got ? (ssize_t) got : -1;
+    }
+    got += n;
+  } while ((flags & MSG_WAITALL) && got < len);
+
+  return got;
+}
+
+// Receive some data, either catching signals (stop == NULL) or polling stop,
+// or with MSG_DONTWAIT in flags, just what's there already
+// kts is as for recv_stamped()
+// Returns number of bytes received (> 0), or a negated EX_ code
+// (-EX_TEMPFAIL if nothing arrived before the timeout)
+int dataq_recv_data(int sockfd, void *buf, size_t len, int flags,
+                     const struct dataq_stop *stop, struct timeval *kts)
+{
+  ssize_t n;
+
+  if (flags & MSG_DONTWAIT) {
+    n = recv_stamped(sockfd, buf, len, flags, kts);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+      return -EX_TEMPFAIL;  // Nothing yet, which is no cause for complaint
+  }
+  else if (stop == NULL) {
+    n = recv_trapped(sockfd, buf, len, flags, kts);
+
+    // If we caught the signal, let the original handler run and then abort
+    if (signalled) {
+      raise(signalled);
+      eprintf("Caught %s signal during receive\n", strsignal(signalled));
+      return -EX_UNAVAILABLE;
+    }
+  }
+  else {
+    n = recv_polled(sockfd, buf, len, flags, stop, kts);
+    if (n < 0 && errno == ECANCELED) {
+      dprintf("Receive stopped\n");
+      return -EX_UNAVAILABLE;
+    }
+  }
+
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    eprintf("Timeout reading from socket\n");
+    return -EX_TEMPFAIL;
+  }
+  if (n < 0) {
+    eprintf("Error reading from socket\n");
+    return -EX_IOERR;
+  }
+  if (n == 0) {
+    eprintf("EOF reading from socket\n");
+    return -EX_UNAVAILABLE;
+  }
+  return n;
+}
 
 // Send an ASCII command to the device and check for correct echo response
 int dataq_cmd(int sockfd, const char *fmt, ...)
@@ -116,20 +299,234 @@ int dataq_cmd(int sockfd, const char *fmt, ...)
                          if (res != EX_OK) return res; \
                        } while (0)
 
-// Connect to and initialize a DATAQ device, and start streaming
-// On success, returns socket fd
-int dataq_connect(const char *hostname, const uint16_t portno,
-                  const int timerscaler, const int rate_divisor,
-                  const char *scanlist, const int n_chans)
+#define QUIET_MS 20    // Least silence that means the stream has stopped...
+#define DRAIN_MS 500   // ...but give up waiting for it after this long
+#define UNKNOWN_MS 222 // Silence to wait for at first if the scan rate's unknown
+
+static int64_t ms_now(void)
 {
-  // Sanity check parameters
-  if (n_chans > MAXCHAN) {
-    eprintf("Requested %d channels exceeds maximum %d channels\n", n_chans, MAXCHAN);
-    return -EX_DATAERR;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Read and discard whatever arrives until the socket goes quiet
+// Quiet means no data for QUIET_MS or two scan periods (period seconds, or 0
+// if unknown, when UNKNOWN_MS), or twice the longest gap seen so far if that's
+// more, so a slow stream isn't mistaken for a stopped one
+static void drain(int sockfd, const double period)
+{
+  uint8_t buf[16384];
+  const int64_t start = ms_now();
+  int64_t last = start;
+  int quiet = period > 0 ? (int) (2000 * period) + 1 : UNKNOWN_MS;
+  if (quiet < QUIET_MS)
+    quiet = QUIET_MS;
+  const int limit = DRAIN_MS > 2 * quiet ? DRAIN_MS : 2 * quiet;
+  long long total = 0;
+
+  for (;;) {
+    const int64_t now = ms_now();
+    int wait = quiet - (now - last);
+    if (wait > limit - (now - start))
+      wait = limit - (now - start);
+    if (wait <= 0)
+      break;
+
+    struct pollfd pfd = {.fd = sockfd,.events = POLLIN };
+    int r = poll(&pfd, 1, wait);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      break;
+
+    ssize_t n = recv(sockfd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+      break;
+    if (n < 0)
+      continue;
+    total += n;
+
+    const int64_t t = ms_now();
+    if (2 * (t - last) > quiet)
+      quiet = 2 * (t - last);
+    last = t;
+  }
+
+  if (total > 0)
+    dprintf("Flushed %lld bytes in %d ms\n", total, (int) (ms_now() - start));
+}
+
+// Tell DAQ to stop streaming, then flush the buffer (might contain unwanted spam)
+// period is the stream's scan period in seconds, or 0 if unknown
+static int stop_stream(int sockfd, const double period)
+{
+  if (send(sockfd, "\0T0", 3, MSG_NOSIGNAL) == -1) {  // The device may be gone
+    eprintf("Error stopping socket stream\n");
+    return -EX_IOERR;
+  }
+  drain(sockfd, period);
+  return EX_OK;
+}
+
+#define N_INIT 5  // Commands in the initialization sequence
+
+// Send all the commands in one writev(), then check the echoes all together
+// cmds[] are as for dataq_cmd(), but already formatted with the leading null
+static int cmds_pipelined(int sockfd, char cmds[][256], const int n_cmds)
+{
+  struct iovec iov[N_INIT];
+  char expect[N_INIT * 256];
+  size_t total = 0, len = 0;
+  int i;
+
+  for (i = 0; i < n_cmds; i++) {
+    const size_t n = strlen(&cmds[i][1]);
+    iov[i].iov_base = cmds[i];
+    iov[i].iov_len = 1 + n;
+    total += 1 + n;
+    memcpy(&expect[len], &cmds[i][1], n);  // Echoes don't have the leading null
+    len += n;
+  }
+
+  ssize_t n = writev(sockfd, iov, n_cmds);
+  if (n < 0) {
+    eprintf("Error writing to socket\n");
+    return -EX_IOERR;
+  }
+  if ((size_t) n != total) {
+    eprintf("Short write to socket\n");
+    return -EX_PROTOCOL;
+  }
+
+  char resp[N_INIT * 256];
+  n = recv(sockfd, resp, len, MSG_WAITALL);
+  if (n < 0) {
+    eprintf("Error reading from socket\n");
+    return -EX_IOERR;
   }
+  if ((size_t) n != len || memcmp(expect, resp, len)) {
+    dprintf("Pipelined echo mismatch, got '%.*s'\n", (int) n, resp);
+    return -EX_PROTOCOL;
+  }
+
+  for (i = 0; i < n_cmds; i++)
+    dprintf("CMD: %s\n", &cmds[i][1]);
+  return EX_OK;
+}
+
+// Stop any stream left over from before, and send the initialization sequence
+// The commands normally go all at once, trying them one at a time, each
+// waiting for its echo, only if that doesn't work out
+static int start_device(int sockfd, const int timerscaler,
+                        const int rate_divisor, const char *scanlist,
+                        const int n_chans)
+{
+  // Anything left over is most likely from these same settings, before a
+  // reconnect
+  const double period = dataq_scan_period(timerscaler, rate_divisor, n_chans);
+  int ret = stop_stream(sockfd, period);
+  if (ret < 0)
+    return ret;
+
+  // Initialization sequence
+  char cmds[N_INIT][256] = { { 0 } };
+  snprintf(&cmds[0][1], 255, "X%02X", timerscaler);   // Division from main 14400 Hz timer
+  snprintf(&cmds[1][1], 255, "M%04X", rate_divisor);  // Further division on output rate
+  snprintf(&cmds[2][1], 255, "L00%s", scanlist);      // Which channels to scan, and options
+  snprintf(&cmds[3][1], 255, "C%02X", n_chans);       // Scan first N channels in scanlist
+  snprintf(&cmds[4][1], 255, "S3");                   // Start streaming
+
+  if ((ret = cmds_pipelined(sockfd, cmds, N_INIT)) != -EX_PROTOCOL)
+    return ret;
+
+  // Start again, in lock-step
+  eprintf("Pipelined init failed, retrying one command at a time\n");
+  if ((ret = stop_stream(sockfd, period)) < 0)
+    return ret;
+  int i;
+  for (i = 0; i < N_INIT; i++)
+    do_cmd(sockfd, "%s", &cmds[i][1]);
+
+  return EX_OK;
+}
 
-  // Create the socket
-  int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+// Set an optional socket option, warning (but carrying on) if it can't be
+static void set_opt(int sockfd, int level, int name, const char *what, int value)
+{
+  if (setsockopt(sockfd, level, name, &value, sizeof(value)) == -1)
+    eprintf("Can't set %s: %s\n", what, strerror(errno));
+}
+
+// Apply the options that have to be set before connecting
+static void set_sockopts(int sockfd, const struct dataq_sockopts *opts)
+{
+  if (opts == NULL)
+    return;
+
+  // Before connect(), so the window scale is negotiated to match
+  if (opts->rcvbuf > 0)
+    set_opt(sockfd, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF", opts->rcvbuf);
+  if (opts->nodelay)
+    set_opt(sockfd, IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY", 1);
+  if (opts->busy_poll_us > 0) {
+#ifdef SO_BUSY_POLL
+    set_opt(sockfd, SOL_SOCKET, SO_BUSY_POLL, "SO_BUSY_POLL", opts->busy_poll_us);
+#else
+    eprintf("Can't set SO_BUSY_POLL: not supported here\n");
+#endif
+  }
+  if (opts->timestamping) {
+#ifdef SO_TIMESTAMPING
+    set_opt(sockfd, SOL_SOCKET, SO_TIMESTAMPING, "SO_TIMESTAMPING",
+            SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE);
+#else
+    eprintf("Can't set SO_TIMESTAMPING: not supported here\n");
+#endif
+  }
+}
+
+#define CONNECT_MS 5000  // Longest to wait for a connection
+
+// Wait for a non-blocking connect() to finish, or for stop (if not NULL)
+// Returns 0 once connected, or -1 with errno set (ECANCELED if stopped)
+static int wait_connect(int sockfd, const struct dataq_stop *stop)
+{
+  struct pollfd pfds[2] = {
+    {.fd = sockfd,.events = POLLOUT },
+    {.fd = stop != NULL ? stop->fds[0] : -1,.events = POLLIN },
+  };
+  const int64_t deadline = ms_now() + CONNECT_MS;
+  int r;
+  do {
+    const int64_t wait = deadline - ms_now();
+    r = poll(pfds, 2, wait > 0 ? (int) wait : 0);
+  } while (r < 0 && errno == EINTR);
+  if (r < 0)
+    return -1;
+  if (pfds[1].revents) {
+    errno = ECANCELED;
+    return -1;
+  }
+  if (r == 0) {
+    errno = ETIMEDOUT;
+    return -1;
+  }
+
+  int err;
+  socklen_t len = sizeof(err);
+  if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+    return -1;
+  errno = err;
+  return err ? -1 : 0;
+}
+
+// Create a socket and connect it to addr, complaining if it fails and last
+// On success, returns socket fd
+static int open_socket(const struct sockaddr_storage *addr, const socklen_t len,
+                       const int last, const struct dataq_sockopts *opts)
+{
+  int sockfd = socket(addr->ss_family, SOCK_STREAM, 0);
   if (sockfd < 0) {
     eprintf("Error creating socket\n");
     return -EX_UNAVAILABLE;
@@ -139,62 +536,251 @@ int dataq_connect(const char *hostname, const uint16_t portno,
   const struct timeval tv = {.tv_sec = 1,.tv_usec = 0 };
   if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1) {
     eprintf("Error setting socket timeout\n");
+    close(sockfd);
     return -EX_UNAVAILABLE;
   }
+  set_sockopts(sockfd, opts);
 
-  // DNS lookup
-  struct hostent *server;
-  server = gethostbyname(hostname);
-  if (server == NULL) {
-    eprintf("DNS lookup for %s failed, is it plugged in?\n", hostname);
-    return -EX_NOHOST;
-  }
-  struct sockaddr_in serveraddr;
-  memset(&serveraddr, 0, sizeof(serveraddr));
-  serveraddr.sin_family = AF_INET;
-  serveraddr.sin_port = htons(portno);
-  memcpy(&serveraddr.sin_addr.s_addr, server->h_addr, server->h_length);
-
-  // Open TCP connection
-  if (connect(sockfd, (const struct sockaddr *) &serveraddr,
-              sizeof(serveraddr)) < 0) {
-    if (errno == EHOSTUNREACH)
+  // Not blocking while connecting, so as to give up in time, or when stopped
+  const int flags = fcntl(sockfd, F_GETFL);
+  fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+  int r = connect(sockfd, (const struct sockaddr *) addr, len);
+  if (r < 0 && errno == EINPROGRESS)
+    r = wait_connect(sockfd, opts != NULL ? opts->stop : NULL);
+  if (r < 0) {
+    // Not worth mentioning if stopped, or there are other addresses to try
+    if (errno == ECANCELED || !last)
+      ;
+    else if (errno == EHOSTUNREACH || errno == ENETUNREACH || errno == ETIMEDOUT)
       eprintf("Error connecting, is it plugged in?\n");
     else
       eprintf("Error connecting, is someone else using it?\n");
+    close(sockfd);
     return -EX_UNAVAILABLE;
   }
+  fcntl(sockfd, F_SETFL, flags);
+  return sockfd;
+}
 
-  // Tell DAQ to stop streaming, then flush the buffer (might contain unwanted spam)
-  if (write(sockfd, "\0T0", 3) == -1) {
-    eprintf("Error stopping socket stream\n");
-    return -EX_IOERR;
+// Connect to and initialize a DATAQ device, and start streaming
+// On success, returns socket fd
+int dataq_connect(const char *hostname, const uint16_t portno,
+                  const int timerscaler, const int rate_divisor,
+                  const char *scanlist, const int n_chans)
+{
+  return dataq_connect_opts(hostname, portno, timerscaler, rate_divisor,
+                            scanlist, n_chans, NULL);
+}
+
+// As dataq_connect(), setting socket options from opts (if not NULL)
+int dataq_connect_opts(const char *hostname, const uint16_t portno,
+                       const int timerscaler, const int rate_divisor,
+                       const char *scanlist, const int n_chans,
+                       const struct dataq_sockopts *opts)
+{
+  // Sanity check parameters
+  if (n_chans > MAXCHAN) {
+    eprintf("Requested %d channels exceeds maximum %d channels\n", n_chans, MAXCHAN);
+    return -EX_DATAERR;
   }
-  usleep(222222);
-  uint16_t buf[16];
-  while (recv(sockfd, buf, sizeof(buf), MSG_DONTWAIT) > 0);
 
-  // Initialization sequence
-  do_cmd(sockfd, "X%02X", timerscaler);   // Division from main 14400 Hz timer
-  do_cmd(sockfd, "M%04X", rate_divisor);  // Further division on output rate
-  do_cmd(sockfd, "L00%s", scanlist);      // Which channels to scan, and options
-  do_cmd(sockfd, "C%02X", n_chans);       // Scan first N channels in scanlist
-  do_cmd(sockfd, "S3");                   // Start streaming
+  // DNS lookup
+  struct dataq_addrs addrs;
+  int ret = dataq_resolve(hostname, portno, &addrs);
+  if (ret < 0)
+    return ret;
+
+  // Open TCP connection, to the first address that works
+  const struct dataq_stop *stop = opts != NULL ? opts->stop : NULL;
+  int a, sockfd = -1;
+  for (a = 0; a < addrs.n && sockfd < 0; a++) {
+    if (stop != NULL && dataq_stop_pending(stop))
+      return -EX_UNAVAILABLE;
+    sockfd = open_socket(&addrs.addr[a], addrs.len[a], a == addrs.n - 1, opts);
+  }
+  if (sockfd < 0) {
+    if (stop != NULL && dataq_stop_pending(stop))
+      return -EX_UNAVAILABLE;
+    dataq_resolve_forget(hostname, portno);  // Perhaps it's moved
+    return sockfd;
+  }
+
+  if ((ret = start_device(sockfd, timerscaler, rate_divisor, scanlist, n_chans)) < 0) {
+    close(sockfd);
+    return ret;
+  }
+
+  // Only now, so as not to hold up the command echoes
+  if (opts != NULL && opts->rcvlowat_scans > 0)
+    set_opt(sockfd, SOL_SOCKET, SO_RCVLOWAT, "SO_RCVLOWAT",
+            opts->rcvlowat_scans * 2 * n_chans);
 
   return sockfd;
 }
 
+// One device being connected by dataq_connect_many()
+struct connect_job {
+  pthread_t thread;
+  const char *hostname;
+  uint16_t portno;
+  int timerscaler, rate_divisor;
+  const char *scanlist;
+  int n_chans;
+  const struct dataq_sockopts *opts;
+  int sockfd;
+};
+
+static void *connect_thread(void *arg)
+{
+  struct connect_job *job = arg;
+  job->sockfd = dataq_connect_opts(job->hostname, job->portno, job->timerscaler,
+                                   job->rate_divisor, job->scanlist,
+                                   job->n_chans, job->opts);
+  return NULL;
+}
+
+// Connect to and start n_devs devices at once, as dataq_connect_opts() on
+// each, so all of them are up in about the time it takes for one
+// Fills in sockfds[] with each one's socket fd, or negated EX_ code on failure
+// Returns EX_OK if all succeeded, or else the first failure (the devices that
+// did connect are left streaming, for the caller to use or close)
+int dataq_connect_many(int sockfds[], const int n_devs,
+                       const char *const hostnames[], const uint16_t portno,
+                       const int timerscaler, const int rate_divisor,
+                       const char *scanlist, const int n_chans,
+                       const struct dataq_sockopts *opts)
+{
+  struct connect_job *jobs = calloc(n_devs, sizeof(*jobs));
+  if (jobs == NULL)
+    return -EX_OSERR;
+
+  int d;
+  for (d = 0; d < n_devs; d++) {
+    struct connect_job *job = &jobs[d];
+    job->hostname = hostnames[d];
+    job->portno = portno;
+    job->timerscaler = timerscaler;
+    job->rate_divisor = rate_divisor;
+    job->scanlist = scanlist;
+    job->n_chans = n_chans;
+    job->opts = opts;
+    job->sockfd = -EX_OSERR;
+    if (pthread_create(&job->thread, NULL, connect_thread, job) != 0) {
+      eprintf("Error starting connect thread\n");
+      job->hostname = NULL;  // Not started
+    }
+  }
+
+  int ret = EX_OK;
+  for (d = 0; d < n_devs; d++) {
+    if (jobs[d].hostname != NULL)
+      pthread_join(jobs[d].thread, NULL);
+    sockfds[d] = jobs[d].sockfd;
+    if (sockfds[d] < 0 && ret == EX_OK)
+      ret = sockfds[d];
+  }
+
+  free(jobs);
+  return ret;
+}
+
+// Stop streaming and disconnect from a DATAQ device streaming scans every
+// period seconds (see dataq_scan_period()), which bounds the flush
+void dataq_close_period(int sockfd, const double period)
+{
+  // Close cleanly by stopping the stream and flushing
+  stop_stream(sockfd, period);  // Ignore errors on close
+  close(sockfd);
+}
+
 // Stop streaming and disconnect from a DATAQ device
+// Not knowing the scan rate, the flush waits as long as for a slow one; use
+// dataq_close_period() where the rate is known
 void dataq_close(int sockfd)
 {
-  // Close cleanly by stopping the stream and flushing
-  if (write(sockfd, "\0T0", 3) == -1) {
-    // Ignore errors on close
+  dataq_close_period(sockfd, 0);
+}
+
+// Check for expected sync flags in least significant bits of one scan
+static int check_sync(const uint16_t buf[], const int n_chans)
+{
+  uint8_t c;
+  for (c = 0; c < n_chans; c++) {
+    uint16_t v = buf[c];
+    uint16_t lsbs = v & 0x0101;
+    if ((c == 0 && lsbs != 0x0100)
+        || (c != 0 && lsbs != 0x0101)) {
+      eprintf("LSB mismatch @ %d: %04X\n", c, v);
+      return -EX_PROTOCOL;
+    }
   }
-  usleep(222222);
-  uint16_t buf[16];
-  while (recv(sockfd, buf, sizeof(buf), MSG_DONTWAIT) > 0);
-  close(sockfd);
+  return EX_OK;
+}
+
+// Extract 14-bit unsigned value from a raw word
+static inline uint16_t code14(uint16_t v)
+{
+  return ((v & 0xFE00) >> 2) | ((v & 0x00FE) >> 1);
+}
+
+/*
+ *  Sample conversion
+ */
+
+// Build lookup tables mapping 14-bit codes to engineering units, per channel:
+//   units = fudge * fullscale * (code / 8192 - 1) + offset
+// fudge[] and offset[] may be NULL (meaning 1.0 and 0.0 respectively)
+// Channels with identical calibration share a table
+int dataq_conv_init(struct dataq_conv *conv, const int n_chans,
+                    const float fullscale[], const float fudge[],
+                    const float offset[])
+{
+  if (n_chans < 1 || n_chans > MAXCHAN)
+    return -EX_DATAERR;
+
+  // Work out calibrations, and which channels can reuse an earlier table
+  int c, owner[MAXCHAN], n_tables = 0;
+  for (c = 0; c < n_chans; c++) {
+    conv->gain[c] = (fudge ? fudge[c] : 1.0f) * fullscale[c];
+    conv->offset[c] = offset ? offset[c] : 0.0f;
+
+    for (owner[c] = 0; owner[c] < c; owner[c]++)
+      if (conv->gain[owner[c]] == conv->gain[c]
+          && conv->offset[owner[c]] == conv->offset[c])
+        break;
+    if (owner[c] == c)
+      n_tables++;
+  }
+
+  float *tables = malloc(n_tables * DATAQ_CODES * sizeof(float));
+  if (tables == NULL)
+    return -EX_OSERR;
+
+  float *lut = tables;
+  for (c = 0; c < n_chans; c++) {
+    if (owner[c] != c) {
+      conv->lut[c] = conv->lut[owner[c]];
+      continue;
+    }
+
+    int v14;
+    for (v14 = 0; v14 < DATAQ_CODES; v14++)
+      lut[v14] = conv->gain[c] * (((1.0 * v14) / (1 << 13)) - 1) + conv->offset[c];
+    conv->lut[c] = lut;
+    lut += DATAQ_CODES;
+  }
+
+  conv->tables = tables;
+  conv->n_chans = n_chans;
+
+  return EX_OK;
+}
+
+void dataq_conv_free(struct dataq_conv *conv)
+{
+  free(conv->tables);
+  conv->tables = NULL;
+  conv->n_chans = 0;
 }
 
 // Receive and parse data from a DATAQ device
@@ -203,76 +789,236 @@ void dataq_close(int sockfd)
 int dataq_recv(int sockfd, float values[], const int n_chans,
                const float fullscale, const float fudge, struct timeval *tv)
 {
-  static uint16_t buf[BUFSIZE];
+  return dataq_recv_stoppable(sockfd, NULL, values, n_chans, fullscale, fudge, tv);
+}
+
+// As dataq_recv(), but if stop != NULL, signal dispositions are left alone and
+// the receive is instead cancelled (returning -EX_UNAVAILABLE) by dataq_stop_signal()
+int dataq_recv_stoppable(int sockfd, const struct dataq_stop *stop,
+                         float values[], const int n_chans,
+                         const float fullscale, const float fudge,
+                         struct timeval *tv)
+{
+  uint16_t buf[MAXCHAN];
 
   int n_bytes = 2 * n_chans;  // How many bytes per recv()
+  if (n_chans > MAXCHAN)
+    return -EX_DATAERR;
 
   // Receive some data
-  // NOTE catching common signals so we can abort cleanly
-  sighandler_t sigint = signal(SIGINT, &trap);
-  sighandler_t sighup = signal(SIGHUP, &trap);
-  sighandler_t sigterm = signal(SIGTERM, &trap);
-  int n = recv(sockfd, buf, n_bytes, MSG_WAITALL);
-  signal(SIGINT, sigint);
-  signal(SIGHUP, sighup);
-  signal(SIGTERM, sigterm);
-
-  // If we caught the signal, let the original handler run and then abort
-  if (signalled) {
-    raise(signalled);
-    eprintf("Caught %s signal during receive\n", strsignal(signalled));
-    return -EX_UNAVAILABLE;
-  }
+  int n = dataq_recv_data(sockfd, buf, n_bytes, MSG_WAITALL, stop, NULL);
+  if (n < 0)
+    return n;
 
   if (tv != NULL)
     gettimeofday(tv, NULL);
 
-  if (n < 0) {
-    eprintf("Error reading from socket\n");
-    return -EX_IOERR;
-  }
-  if (n == 0) {
-    eprintf("EOF reading from socket\n");
-    return -EX_UNAVAILABLE;
-  }
   if (n != n_bytes) {
     eprintf("Expected %d bytes, read %d bytes\n", n_bytes, n);
     return -EX_PROTOCOL;
   }
 
+  int ret = check_sync(buf, n_chans);
+  if (ret != EX_OK)
+    return ret;
+
   uint8_t c;
   for (c = 0; c < n_chans; c++) {
-    uint16_t v = buf[c];
+    // Scale to floating point in desired units
+    float conv = fudge * fullscale * (((1.0 * code14(buf[c])) / (1 << 13)) - 1);
 
-    // Check for expected sync flags in least significant bits
-    uint16_t lsbs = v & 0x0101;
-    if ((c == 0 && lsbs != 0x0100)
-        || (c != 0 && lsbs != 0x0101)) {
-      eprintf("LSB mismatch @ %d: %04X\n", c, v);
-      return -EX_PROTOCOL;
+    values[c] = conv;
+  }
+
+  return EX_OK;
+}
+
+// Set up receive state for dataq_recv_batch() on a connected socket
+// NOTE conv is used in place, so must outlive rx
+void dataq_rx_init(struct dataq_rx *rx, int sockfd,
+                   const struct dataq_conv *conv)
+{
+  rx->sockfd = sockfd;
+  rx->n_chans = conv->n_chans;
+  rx->conv = conv;
+  rx->stop = NULL;
+  rx->nonblock = 0;
+  rx->timestamping = 0;
+  rx->len = 0;
+  rx->hunting = 0;
+  rx->resyncs = 0;
+  rx->skipped = 0;
+  rx->recvs = 0;
+  rx->partials = 0;
+}
+
+// Look for where the next good scan starts, after the bad one at the head of
+// bytes[]: a channel 0 word then n_chans - 1 others with the right sync flags,
+// confirmed by the following channel 0 word when we have it
+// Returns the byte offset, or -1 if there isn't one in the first len bytes
+int dataq_find_sync(const uint8_t bytes[], const int len, const int n_chans)
+{
+  const int scan_bytes = 2 * n_chans;
+  int o;
+
+  for (o = 1; o + scan_bytes <= len; o++) {
+    // Include the next channel 0 word if we have it
+    const int n_words = (o + scan_bytes + 2 <= len) ? n_chans + 1 : n_chans;
+    int c;
+    for (c = 0; c < n_words; c++) {
+      uint16_t v;
+      memcpy(&v, &bytes[o + 2 * c], sizeof(v));
+      uint16_t lsbs = v & 0x0101;
+      if (lsbs != ((c % n_chans) ? 0x0101 : 0x0100))
+        break;
     }
+    if (c == n_words)
+      return o;
+  }
+  return -1;
+}
 
-    // Extract 14-bit unsigned value
-    uint16_t v14 = ((v & 0xFE00) >> 2) | ((v & 0x00FE) >> 1);
+// Drop bytes from the head of the receive buffer
+static void rx_discard(struct dataq_rx *rx, const int n_bytes)
+{
+  uint8_t *bytes = (uint8_t *) rx->buf;
+  rx->len -= n_bytes;
+  memmove(bytes, bytes + n_bytes, rx->len);
+}
 
-    // Scale to floating point in desired units
-    float conv = fudge * fullscale * (((1.0 * v14) / (1 << 13)) - 1);
+// Check, unpack and convert the whole scans held in rx->buf, up to limit of
+// them, into values[], as dataq_recv_batch(), or if cols != NULL, into
+// cols[c] for each channel c, as dataq_recv_columns()
+// Returns the number of scans, or 0 if more bytes are needed first
+int dataq_rx_parse(struct dataq_rx *rx, float values[], float *const cols[],
+                   const int limit)
+{
+  uint8_t *bytes = (uint8_t *) rx->buf;
+  const int n_chans = rx->n_chans;
+  const int scan_bytes = 2 * n_chans;
+  int s = 0;
 
-    values[c] = conv;
+  while (rx->len >= scan_bytes) {
+    // Check and unpack whole scans in one go, stopping short of a bad one
+    int n_scans = rx->len / scan_bytes;
+    if (n_scans > limit)
+      n_scans = limit;
+    size_t good = dataq_decode(rx->buf, rx->codes, n_scans, n_chans);
+    s = good / n_chans;
+    if (s > 0)
+      break;
+
+    // Bad scan first in line, so we've lost sync: hunt for the next good one
+    if (!rx->hunting) {
+      eprintf("LSB mismatch @ %d: %04X, resynchronizing\n",
+              (int) good, rx->buf[good]);
+      rx->hunting = 1;
+      rx->hunted = 0;
+    }
+    int o = dataq_find_sync(bytes, rx->len, n_chans);
+    if (o < 0)
+      o = rx->len - scan_bytes + 1;  // Keep what could be the start of a scan
+    rx_discard(rx, o);
+    rx->hunted += o;
+    rx->skipped += o;
   }
+  if (s == 0)
+    return 0;
 
-  return EX_OK;
+  if (rx->hunting) {
+    rx->hunting = 0;
+    rx->resyncs++;
+    eprintf("Resynchronized after skipping %lld bytes (~%lld scans)\n",
+            rx->hunted, (rx->hunted + scan_bytes / 2) / scan_bytes);
+  }
+
+  // Scale to floating point in desired units, transposing on the way if
+  // columns are wanted: the table lookups cost the same either way
+  int i;
+  uint8_t c;
+  if (cols != NULL)
+    for (c = 0; c < n_chans; c++) {
+      const float *lut = rx->conv->lut[c];
+      const uint16_t *src = &rx->codes[c];
+      float *dst = cols[c];
+      for (i = 0; i < s; i++)
+        dst[i] = lut[src[i * n_chans]];
+    }
+  else
+    for (i = 0; i < s * n_chans; i += n_chans)
+      for (c = 0; c < n_chans; c++)
+        values[i + c] = rx->conv->lut[c][rx->codes[i + c]];
+
+  // Keep leftovers (a partial scan, or scans after a bad one) for next time
+  rx_discard(rx, s * scan_bytes);
+
+  return s;
 }
 
-// Discover a DATAQ device
-const char *dataq_autodiscover(void)
+static int recv_batch(struct dataq_rx *rx, float values[], float *const cols[],
+                      const int max_scans, struct timeval *tv)
 {
-  fprintf(stderr, "Sorry, autodiscovery unimplemented.\n"
-          "If you're at Kitty Hawk, just specify 'di718b' as the hostname and let the DHCP\n"
-          "server do the work.  Otherwise, you can use the 'DATAQ Instruments Hardware Manager'\n"
-          "utility provided with WinDAQ, or check your DHCP logs for MAC addresses starting with\n"
-          "00:80:A3, or implement http://wiki.lantronix.com/developer/Lantronix_Discovery_Protocol\n");
-  return NULL;
+  uint8_t *bytes = (uint8_t *) rx->buf;
+  const int n_chans = rx->n_chans;
+  const int scan_bytes = 2 * n_chans;
+
+  if (n_chans < 1 || n_chans > MAXCHAN || max_scans < 1)
+    return -EX_DATAERR;
+
+  // Don't read more than will fit in the buffer or in values[]
+  int limit = sizeof(rx->buf) / scan_bytes;
+  if (limit > max_scans)
+    limit = max_scans;
+  const int want = limit * scan_bytes;
+  struct timeval kts = { 0 };
+
+  // Receive until there is at least one whole good scan; take whatever else
+  // is ready
+  int s;
+  while ((s = dataq_rx_parse(rx, values, cols, limit)) == 0) {
+    int n = dataq_recv_data(rx->sockfd, bytes + rx->len, want - rx->len,
+                            rx->nonblock ? MSG_DONTWAIT : 0, rx->stop,
+                            rx->timestamping ? &kts : NULL);
+    if (n < 0)
+      return n;
+    rx->len += n;
+    rx->recvs++;
+    if (rx->len % scan_bytes)
+      rx->partials++;
+  }
+
+  if (tv != NULL && rx->timestamping && kts.tv_sec)
+    *tv = kts;
+  else if (tv != NULL)
+    gettimeofday(tv, NULL);
+
+  return s;
+}
+
+// Receive and parse as many whole scans as are available, up to max_scans
+// Assumes values[] is of length >= max_scans * n_chans, filled scan after scan
+// Any trailing partial scan is kept in rx and completed by the next call
+// If the stream loses sync (e.g. a dropped byte), skips ahead to the next good
+// scan, counting rx->resyncs and the rx->skipped bytes
+// Set rx->stop to receive without touching signals, as dataq_recv_stoppable(),
+// or rx->nonblock to return -EX_TEMPFAIL at once if no whole scan is ready
+// NOTE if tv != NULL, will populate from gettimeofday() after the last recv(),
+// or with rx->timestamping, the kernel's timestamp for it
+// On success, returns the number of scans parsed (always >= 1)
+int dataq_recv_batch(struct dataq_rx *rx, float values[], const int max_scans,
+                     struct timeval *tv)
+{
+  return recv_batch(rx, values, NULL, max_scans, tv);
+}
+
+// As dataq_recv_batch(), but channel-major: channel c's values go to cols[c],
+// each of length >= max_scans, scan s at cols[c][s]
+// For vectorized processing afterwards the columns are best aligned, e.g. from
+// aligned_alloc(64, ...), and max_scans a multiple of 16
+int dataq_recv_columns(struct dataq_rx *rx, float *const cols[],
+                       const int max_scans, struct timeval *tv)
+{
+  return recv_batch(rx, NULL, cols, max_scans, tv);
 }
 
 /*
@@ -289,58 +1035,707 @@ const int rate_divisor = 0;
 const char scanlist[] = "E000E001E002E003E004E005E006E007";
 const float fudge = 1.0;        // Converted values don't seem to quite agree with WinDAQ... Try 1.018 here??
 
+#define RING_SCANS 65536  // Scans buffered between receive thread and output
+#define BATCH 256         // Scans printed per pop
+
+static struct dataq_sockopts sockopts;  // From -S
+static int stats_secs;                  // From -s
+static int decim_factors[DATAQ_DECIM_LEVELS];  // From -D
+static int n_decim;
+static struct dataq_filter_spec filter;         // From -L, for every channel
+static const char *publish[DATAQ_FANOUT_DESTS]; // From -P
+static struct dataq_rt_opts rt;                 // From -R
+static int n_publish;
+
+// Signals stop the session's receive thread, the multi-device loop, or a raw
+// capture
+static struct dataq_session *sess;
+static struct dataq_multi *multi;
+static struct dataq_stop stop;
+static void trap_stop(int sig)
+{
+  signalled = sig;
+  if (sess != NULL)
+    dataq_session_stop(sess);
+  else if (multi != NULL)
+    dataq_multi_stop(multi);
+  else
+    dataq_stop_signal(&stop);
+}
+
+// Print a line of text per scan
+static void print_scans(FILE *out, const float values[],
+                        const struct timeval tv[], const int n_scans)
+{
+  int s;
+  for (s = 0; s < n_scans; s++) {
+    fprintf(out, "%llu.%06llu", (unsigned long long int)tv[s].tv_sec,
+                                (unsigned long long int)tv[s].tv_usec);
+
+    uint8_t c;
+    for (c = 0; c < n_chans; c++)
+      fprintf(out, " %.3f", values[s * n_chans + c]);
+    fprintf(out, "\n");
+  }
+}
+
+// Print a gap as a comment line: its start and end times, and scans lost
+static void print_gap(FILE *out, const struct dataq_gap *gap)
+{
+  fprintf(out, "# gap %llu.%06llu %llu.%06llu %lld\n",
+          (unsigned long long int)gap->start.tv_sec,
+          (unsigned long long int)gap->start.tv_usec,
+          (unsigned long long int)gap->end.tv_sec,
+          (unsigned long long int)gap->end.tv_usec, gap->lost);
+}
+
+// Print scans from one of several devices, prefixed by its number
+static int print_dev(void *arg, int dev, const float values[],
+                     const uint16_t codes[], const struct timeval tv[],
+                     int n_scans)
+{
+  (void) codes;  // Only the values are printed, as for one device
+  FILE *out = arg;
+  int s;
+  for (s = 0; s < n_scans; s++) {
+    fprintf(out, "%d %llu.%06llu", dev, (unsigned long long int)tv[s].tv_sec,
+                                        (unsigned long long int)tv[s].tv_usec);
+
+    uint8_t c;
+    for (c = 0; c < n_chans; c++)
+      fprintf(out, " %.3f", values[s * n_chans + c]);
+    fprintf(out, "\n");
+  }
+  return 0;
+}
+
+// Print merged frames, one per line
+static int print_frames(void *arg, const float frames[], int width,
+                        const struct timeval tv[], int n_frames)
+{
+  FILE *out = arg;
+  int f;
+  for (f = 0; f < n_frames; f++) {
+    fprintf(out, "%llu.%06llu", (unsigned long long int)tv[f].tv_sec,
+                                (unsigned long long int)tv[f].tv_usec);
+
+    int c;
+    for (c = 0; c < width; c++)
+      fprintf(out, " %.3f", frames[f * width + c]);
+    fprintf(out, "\n");
+  }
+  return 0;
+}
+
+// Print a decimated point: time, factor and scans, then each channel's
+// mean:min:max
+static int print_point(void *arg, const struct dataq_decim_point *pt)
+{
+  FILE *out = arg;
+  fprintf(out, "%llu.%06llu %d %d", (unsigned long long int)(pt->t_ns / 1000000000),
+          (unsigned long long int)(pt->t_ns % 1000000000 / 1000), pt->factor, pt->n);
+  int c;
+  for (c = 0; c < pt->n_chans; c++)
+    fprintf(out, " %.3f:%.3f:%.3f", pt->mean[c], pt->min[c], pt->max[c]);
+  fprintf(out, "\n");
+  return 0;
+}
+
+static void print_hist(const char *name, const struct dataq_hist *h)
+{
+  fprintf(stderr, " %s p50/p99/p99.9/max %.3f/%.3f/%.3f/%.3f ms", name,
+          dataq_hist_percentile(h, 50) / 1e6, dataq_hist_percentile(h, 99) / 1e6,
+          dataq_hist_percentile(h, 99.9) / 1e6, h->max_ns / 1e6);
+}
+
+// Print the session's statistics to stderr, for the last interval of
+// stats_secs (histograms) and in all (counters)
+static void print_stats(struct dataq_session *sess)
+{
+  static struct dataq_session_stats before;
+  static struct dataq_hist deliver_before, jitter_before;
+  static struct dataq_hist deliver, jitter, interval;
+  struct dataq_session_stats stats;
+
+  dataq_session_stats(sess, &stats);
+  dataq_session_latency(sess, &deliver, &jitter);
+  fprintf(stderr, "# stats %.0f scans/s, %llu scans in %llu batches, "
+          "%llu overruns, %llu resyncs, %llu partial recvs, %llu timeouts, "
+          "%llu reconnects\n#",
+          (double) (stats.scans - before.scans) / stats_secs, stats.scans,
+          stats.batches, stats.overruns, stats.resyncs, stats.partials,
+          stats.timeouts, stats.reconnects);
+  dataq_hist_diff(&interval, &deliver, &deliver_before);
+  print_hist("latency", &interval);
+  dataq_hist_diff(&interval, &jitter, &jitter_before);
+  print_hist("jitter", &interval);
+  fprintf(stderr, "\n");
+
+  before = stats;
+  deliver_before = deliver;
+  jitter_before = jitter;
+}
+
+// Acquire from several devices at once, all from this thread, either line by
+// line as each device's scans arrive or merged into frames across them all
+static int acquire_multi(char **hostnames, const int n_hosts, const int merged,
+                         FILE *out, const struct dataq_conv *conv)
+{
+  const struct dataq_session_opts opts = {
+    .timestamps = DATAQ_TS_REALTIME,
+    .sock = sockopts,
+  };
+  struct dataq_merge *merge = NULL;
+  int ret;
+
+  if (merged) {
+    int chans[n_hosts], h;
+    for (h = 0; h < n_hosts; h++)
+      chans[h] = n_chans;
+    if ((ret = dataq_merge_open(&merge, n_hosts, chans, RING_SCANS,
+                                print_frames, out)) < 0)
+      return ret;
+    ret = dataq_multi_open(&multi, &opts, dataq_merge_push, merge);
+  }
+  else
+    ret = dataq_multi_open(&multi, &opts, print_dev, out);
+  if (ret < 0) {
+    if (merge != NULL)
+      dataq_merge_close(merge);
+    return ret;
+  }
+
+  if ((ret = dataq_multi_add_many(multi, n_hosts, (const char *const *) hostnames,
+                                  portno, timerscaler, rate_divisor, scanlist,
+                                  conv)) < 0)
+    goto done;
+
+  signal(SIGINT, &trap_stop);
+  signal(SIGHUP, &trap_stop);
+  signal(SIGTERM, &trap_stop);
+  ret = dataq_multi_run(multi);
+
+done:
+  dataq_multi_close(multi);
+  if (merge != NULL) {
+    if (dataq_merge_dropped(merge))
+      eprintf("Dropped %llu scans: units too far apart in time\n",
+              dataq_merge_dropped(merge));
+    dataq_merge_close(merge);
+  }
+  return ret;
+}
+
+// Capture raw bytes from the device, with an index alongside if to a file
+static int capture(const char *hostname, const char *output, int outfd,
+                   const struct dataq_conv *conv)
+{
+  int index_fd = -1;
+  if (output != NULL) {
+    char index[PATH_MAX];
+    snprintf(index, sizeof(index), "%s.idx", output);
+    if ((index_fd = open(index, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+      eprintf("Error opening %s: %s\n", index, strerror(errno));
+      return -EX_CANTCREAT;
+    }
+  }
+
+  int ret, sockfd;
+  if ((ret = dataq_stop_init(&stop)) < 0)
+    goto done;
+  if ((sockfd = dataq_connect_opts(hostname, portno, timerscaler,
+                                   rate_divisor, scanlist, n_chans,
+                                   &sockopts)) < 0) {
+    ret = sockfd;
+    goto stopped;
+  }
+
+  signal(SIGINT, &trap_stop);
+  signal(SIGHUP, &trap_stop);
+  signal(SIGTERM, &trap_stop);
+
+  struct dataq_log_header hdr;
+  dataq_log_header_init(&hdr, DATAQ_LOG_RAW, conv, timerscaler, rate_divisor, scanlist);
+  long long total;
+  ret = dataq_capture(sockfd, outfd, index_fd, &hdr, &stop, &total);
+  dprintf("Captured %lld bytes\n", total);
+
+  dataq_close_period(sockfd, hdr.period);
+stopped:
+  dataq_stop_close(&stop);
+done:
+  if (index_fd >= 0)
+    close(index_fd);
+  return ret;
+}
+
+// Parse -D's factors, comma separated
+static int parse_factors(char *list)
+{
+  char *tok;
+  for (n_decim = 0; (tok = strsep(&list, ",")) != NULL; n_decim++)
+    if (n_decim == DATAQ_DECIM_LEVELS || (decim_factors[n_decim] = atoi(tok)) < 1)
+      return -EX_USAGE;
+  return EX_OK;
+}
+
+// Parse -L's filter stages, comma separated: TYPE=FREQ[:Q]
+static int parse_filter(char *subopts, struct dataq_filter_spec *spec)
+{
+  char *const tokens[] = { "lowpass", "highpass", "notch", NULL };
+  static const enum dataq_filter_type types[] = {
+    DATAQ_FILTER_LOWPASS, DATAQ_FILTER_HIGHPASS, DATAQ_FILTER_NOTCH
+  };
+  char *value;
+  while (*subopts) {
+    const int which = getsubopt(&subopts, tokens, &value);
+    if (which < 0 || value == NULL || spec->n_stages == DATAQ_FILTER_STAGES)
+      return -EX_USAGE;
+    struct dataq_filter_stage *st = &spec->stages[spec->n_stages++];
+    char *end;
+    st->type = types[which];
+    st->freq = strtod(value, &end);
+    if (*end == ':')
+      st->q = strtod(end + 1, &end);
+    if (*end != '\0' || st->freq <= 0 || st->q < 0)
+      return -EX_USAGE;
+  }
+  return EX_OK;
+}
+
+// Parse -S's suboptions into opts
+static int parse_sockopts(char *subopts, struct dataq_sockopts *opts)
+{
+  enum { RCVBUF, NODELAY, RCVLOWAT, BUSY_POLL };
+  char *const tokens[] = {
+    [RCVBUF] = "rcvbuf",[NODELAY] = "nodelay",[RCVLOWAT] = "rcvlowat",
+    [BUSY_POLL] = "busy_poll", NULL
+  };
+  char *value;
+  while (*subopts) {
+    const int which = getsubopt(&subopts, tokens, &value);
+    if (which == NODELAY) {
+      opts->nodelay = 1;
+      continue;
+    }
+    if (which < 0 || value == NULL || atoi(value) <= 0)
+      return -EX_USAGE;
+    if (which == RCVBUF)
+      opts->rcvbuf = atoi(value);
+    else if (which == RCVLOWAT)
+      opts->rcvlowat_scans = atoi(value);
+    else
+      opts->busy_poll_us = atoi(value);
+  }
+  return EX_OK;
+}
+
+// Parse -R's suboptions into rt
+static int parse_rt(char *subopts, struct dataq_rt_opts *rt)
+{
+  enum { CPU, FIFO, LOCK, BUSY };
+  char *const tokens[] = {
+    [CPU] = "cpu",[FIFO] = "fifo",[LOCK] = "lock",[BUSY] = "busy", NULL
+  };
+  char *value;
+  while (*subopts) {
+    const int which = getsubopt(&subopts, tokens, &value);
+    if (which == LOCK || which == BUSY) {
+      if (which == LOCK)
+        rt->lock = 1;
+      else
+        rt->busy_poll = 1;
+      continue;
+    }
+    if (which < 0 || value == NULL)
+      return -EX_USAGE;
+    char *end;
+    const long n = strtol(value, &end, 10);
+    if (end == value || *end || n < (which == CPU ? 0 : 1) || n > INT_MAX)
+      return -EX_USAGE;
+    if (which == CPU) {
+      rt->pin = 1;
+      rt->cpu = n;
+    }
+    else
+      rt->fifo_prio = n;
+  }
+  return EX_OK;
+}
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr,
+          "Simple client for DATAQ DI-718B-E(S) laboratory data acquisition system\n"
+          "Usage:\n"
+          "    %s [OPTIONS] <HOST>...\n"
+          "    %s [OPTIONS] -a, --auto\n"
+          "where HOST is the hostname or IP address of the DAQ unit, or '-a' to autodiscover\n"
+          "(all the units on the network, remembering them for a day).\n"
+          "With several HOSTs, each line of text starts with the unit's number.\n"
+          "Options:\n"
+          "    -o, --output FILE    Write to FILE instead of stdout\n"
+          "    -F, --format FORMAT  'text' (default), or a binary log of 14-bit 'codes',\n"
+          "                         the same 'packed' losslessly (smaller, the more so\n"
+          "                         the quieter the signal), or 'float' values; see\n"
+          "                         dataq_dump.  Or 'raw' to capture the undecoded\n"
+          "                         stream, indexed in FILE.idx, or 'store' for a\n"
+          "                         chunked column store (needs -o)\n"
+          "    -m, --merge          With several HOSTs, line up their scans in time and\n"
+          "                         print one line for all of them per scan of the first\n"
+          "    -S, --socket OPTS    Socket options, comma separated: rcvbuf=BYTES,\n"
+          "                         nodelay, rcvlowat=SCANS, busy_poll=USECS (Linux)\n"
+          "    -s, --stats SECS     Every SECS, print throughput, error counts and\n"
+          "                         latency percentiles to stderr\n"
+          "    -R, --realtime OPTS  Receive thread settings, comma separated: cpu=N\n"
+          "                         to pin it, fifo=PRIO for SCHED_FIFO, lock to\n"
+          "                         mlockall(), busy to spin rather than sleep\n"
+          "    -L, --filter F,...   Filter every channel through stages F, each\n"
+          "                         lowpass, highpass or notch=HZ[:Q] (filtered\n"
+          "                         values only, not codes or raw captures)\n"
+          "    -D, --decimate N,... Also reduce every N scans (for each N, each a\n"
+          "                         multiple of the last) to each channel's\n"
+          "                         mean:min:max, printed instead of text scans\n"
+          "                         (or to stdout, with a binary log or store)\n"
+          "    -d, --decimated FILE Write those to FILE, and carry on with the scans\n"
+          "    -P, --publish DEST   Serve the scans to others, to DEST udp:HOST:PORT[:TTL]\n"
+          "                         (e.g. a multicast group) or shm:NAME (shared\n"
+          "                         memory), as often as needed; printed too only\n"
+          "                         with -o.  See dataq_dump -l\n",
+          argv0, argv0);
+  exit(EX_USAGE);
+}
+
 int main(int argc, char **argv)
 {
-  if (argc != 2 || !strcmp(argv[1], "-h") || !strcmp(argv[1], "--help")) {
-    fprintf(stderr,
-            "Simple client for DATAQ DI-718B-E(S) laboratory data acquisition system\n"
-            "Usage:\n"
-            "    %s <HOST>\n"
-            "    %s -a, --auto\n"
-            "where HOST is the hostname or IP address of the DAQ unit, or '-a' to autodiscover.\n",
-            argv[0], argv[0]);
-    exit(EX_USAGE);
+  static const struct option longopts[] = {
+    { "auto", no_argument, NULL, 'a' },
+    { "output", required_argument, NULL, 'o' },
+    { "format", required_argument, NULL, 'F' },
+    { "merge", no_argument, NULL, 'm' },
+    { "socket", required_argument, NULL, 'S' },
+    { "stats", required_argument, NULL, 's' },
+    { "realtime", required_argument, NULL, 'R' },
+    { "filter", required_argument, NULL, 'L' },
+    { "decimate", required_argument, NULL, 'D' },
+    { "decimated", required_argument, NULL, 'd' },
+    { "publish", required_argument, NULL, 'P' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
+  int autodiscover = 0;
+  const char *output = NULL;
+  int format = 0;  // Text, or an enum dataq_log_format
+  int store = 0;   // Or a dataq_store instead
+  int merged = 0;
+  const char *decimated = NULL;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "ao:F:mS:s:R:L:D:d:P:h", longopts, NULL)) != -1) {
+    switch (opt) {
+    case 'a':
+      autodiscover = 1;
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    case 'F':
+      if (!strcmp(optarg, "text"))
+        format = 0;
+      else if (!strcmp(optarg, "codes"))
+        format = DATAQ_LOG_CODES;
+      else if (!strcmp(optarg, "packed"))
+        format = DATAQ_LOG_PACKED;
+      else if (!strcmp(optarg, "float"))
+        format = DATAQ_LOG_FLOAT;
+      else if (!strcmp(optarg, "raw"))
+        format = DATAQ_LOG_RAW;
+      else if (!strcmp(optarg, "store"))
+        store = 1;
+      else
+        usage(argv[0]);
+      break;
+    case 'm':
+      merged = 1;
+      break;
+    case 'S':
+      if (parse_sockopts(optarg, &sockopts) < 0)
+        usage(argv[0]);
+      break;
+    case 's':
+      if ((stats_secs = atoi(optarg)) <= 0)
+        usage(argv[0]);
+      break;
+    case 'R':
+      if (parse_rt(optarg, &rt) < 0)
+        usage(argv[0]);
+      break;
+    case 'L':
+      if (parse_filter(optarg, &filter) < 0)
+        usage(argv[0]);
+      break;
+    case 'D':
+      if (parse_factors(optarg) < 0)
+        usage(argv[0]);
+      break;
+    case 'd':
+      decimated = optarg;
+      break;
+    case 'P':
+      if (n_publish == DATAQ_FANOUT_DESTS)
+        usage(argv[0]);
+      publish[n_publish++] = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
   }
+  const int n_hosts = argc - optind;
+  if (autodiscover ? n_hosts != 0 : n_hosts < 1)
+    usage(argv[0]);
+  if (n_hosts > 1 && (format || store))
+    usage(argv[0]);  // Logs are one device apiece
+  if (store && output == NULL)
+    usage(argv[0]);  // Stores are mapped, so can't be a pipe
+  if (filter.n_stages && (n_hosts > 1 || format == DATAQ_LOG_RAW))
+    usage(argv[0]);
+  if ((n_publish || rt.pin || rt.fifo_prio || rt.lock || rt.busy_poll)
+      && (n_hosts > 1 || format == DATAQ_LOG_RAW))
+    usage(argv[0]);
+  if ((n_decim || decimated) && (n_hosts > 1 || format == DATAQ_LOG_RAW
+                                 || (decimated && !n_decim)))
+    usage(argv[0]);
 
-  const char *hostname;
-  if (!strcmp(argv[1], "-a") || !strcmp(argv[1], "--auto")) {
-    hostname = dataq_autodiscover();
-    if (hostname == NULL)
+  // Discovery may find several units, which are then all used
+  char **hostnames = &argv[optind];
+  int n_units = n_hosts;
+  if (autodiscover) {
+    static struct dataq_unit units[DATAQ_MAX_UNITS];
+    static char *addrs[DATAQ_MAX_UNITS];
+    n_units = dataq_discover(units, DATAQ_MAX_UNITS, DATAQ_DISCOVER_MS, dataq_discover_cache());
+    if (n_units <= 0)
       exit(EX_UNAVAILABLE);
+    int u;
+    for (u = 0; u < n_units; u++)
+      addrs[u] = units[u].addr;
+    hostnames = addrs;
+    if (n_units > 1 && (format || store || n_decim || filter.n_stages || n_publish
+                        || rt.pin || rt.fifo_prio || rt.lock || rt.busy_poll))
+      usage(argv[0]);
   }
-  else
-    hostname = argv[1];
+  const char *hostname = hostnames[0];
 
-  int sockfd;
-  if ((sockfd = dataq_connect(hostname, portno, timerscaler,
-                              rate_divisor, scanlist, n_chans)) < 0)
-    exit(-sockfd);
+  int outfd = STDOUT_FILENO;
+  if (output != NULL && !store && (outfd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+    eprintf("Error opening %s: %s\n", output, strerror(errno));
+    exit(EX_CANTCREAT);
+  }
+  FILE *out = fdopen(outfd, "w");
+
+  // Same scaling on every channel
+  float fullscales[MAXCHAN], fudges[MAXCHAN];
+  uint8_t c;
+  for (c = 0; c < n_chans; c++) {
+    fullscales[c] = fullscale;
+    fudges[c] = fudge;
+  }
+  struct dataq_conv conv;
+  int ret;
+  if ((ret = dataq_conv_init(&conv, n_chans, fullscales, fudges, NULL)) < 0)
+    exit(-ret);
+
+  if (n_units > 1) {
+    ret = acquire_multi(hostnames, n_units, merged, out, &conv);
+    fclose(out);
+    dataq_conv_free(&conv);
+    return ret < 0 ? -ret : 0;
+  }
+
+  if (format == DATAQ_LOG_RAW) {
+    ret = capture(hostname, output, outfd, &conv);
+    close(outfd);
+    dataq_conv_free(&conv);
+    return ret < 0 ? -ret : 0;
+  }
+
+  struct dataq_log *log = NULL;
+  if (format) {
+    struct dataq_log_header hdr;
+    dataq_log_header_init(&hdr, format, &conv, timerscaler, rate_divisor, scanlist);
+    if ((ret = dataq_log_open(&log, outfd, &hdr)) < 0)
+      exit(-ret);
+  }
 
-  signal(SIGINT, &trap);
-  signal(SIGHUP, &trap);
-  signal(SIGTERM, &trap);
+  // Decimated points go to their own file, or else take the place of text
+  // scans, or go to stdout if that's not taken by a binary log
+  struct dataq_decim *decim = NULL;
+  FILE *decim_out = NULL;
+  int print = !format && !store && (!n_publish || output != NULL);
+  if (n_decim) {
+    if (decimated != NULL) {
+      if ((decim_out = fopen(decimated, "w")) == NULL) {
+        eprintf("Error opening %s: %s\n", decimated, strerror(errno));
+        exit(EX_CANTCREAT);
+      }
+    }
+    else if (print) {
+      decim_out = out;
+      print = 0;
+    }
+    else if (output != NULL || n_publish)
+      decim_out = stdout;
+    else
+      usage(argv[0]);  // Not amongst a binary log
+    if ((ret = dataq_decim_open(&decim, n_chans, decim_factors, n_decim,
+                                print_point, decim_out)) < 0)
+      exit(-ret);
+  }
 
-  while (!signalled) {
-    float values[MAXCHAN];
-    struct timeval tv;
+  struct dataq_store *st = NULL;
+  if (store) {
+    struct dataq_log_header hdr;
+    dataq_log_header_init(&hdr, DATAQ_LOG_CODES, &conv, timerscaler, rate_divisor,
+                          scanlist);
+    if ((ret = dataq_store_create(&st, output, &hdr, 0, 0)) < 0)
+      exit(-ret);
+  }
+
+  // Serving the scans to subscribers, who may come and go
+  struct dataq_fanout *fanout = NULL;
+  if (n_publish) {
+    struct dataq_log_header hdr;
+    dataq_log_header_init(&hdr, DATAQ_LOG_CODES, &conv, timerscaler, rate_divisor,
+                          scanlist);
+    if ((ret = dataq_fanout_open(&fanout, &hdr)) < 0)
+      exit(-ret);
+    int i;
+    for (i = 0; i < n_publish; i++)
+      if ((ret = dataq_fanout_add(fanout, publish[i])) < 0)
+        exit(-ret);
+  }
+
+  // Receive in the background, so slow output doesn't hold up the device,
+  // and timestamp from the sample clock rather than as scans happen to arrive
+  // If the device goes away, keep trying to get it back
+  static struct dataq_filter_spec filters[MAXCHAN];
+  for (c = 0; c < n_chans; c++)
+    filters[c] = filter;
+  const struct dataq_session_opts opts = {
+    .timestamps = DATAQ_TS_REALTIME,
+    .sock = sockopts,
+    .reconnect = 1,
+    .filter = filter.n_stages ? filters : NULL,
+    .rt = rt,
+  };
+  if ((ret = dataq_session_open(&sess, hostname, portno, timerscaler,
+                                rate_divisor, scanlist, &conv, RING_SCANS,
+                                &opts)) < 0)
+    exit(-ret);
+
+  signal(SIGINT, &trap_stop);
+  signal(SIGHUP, &trap_stop);
+  signal(SIGTERM, &trap_stop);
+
+  struct timespec next_stats;
+  clock_gettime(CLOCK_MONOTONIC, &next_stats);
+  next_stats.tv_sec += stats_secs;
+  int werr = 0;  // The first error writing out, to exit with
+  while (!signalled && werr == 0) {
+    static float values[BATCH * MAXCHAN];
+    static uint16_t codes[BATCH * MAXCHAN];
+    struct timeval tv[BATCH];
+
+    // Wake up in time for the next statistics, if they're wanted
+    int timeout_ms = -1;
+    if (stats_secs) {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      timeout_ms = (next_stats.tv_sec - now.tv_sec) * 1000
+                   + (next_stats.tv_nsec - now.tv_nsec) / 1000000;
+      if (timeout_ms <= 0) {
+        print_stats(sess);
+        next_stats.tv_sec += stats_secs;
+        continue;
+      }
+    }
 
-    int ret = dataq_recv(sockfd, values, n_chans, fullscale, fudge, &tv);
-    if (signalled)
+    // And for the next header to subscribers, even while the unit is away
+    if (fanout != NULL && (timeout_ms < 0 || timeout_ms > DATAQ_FANOUT_HEADER_MS))
+      timeout_ms = DATAQ_FANOUT_HEADER_MS;
+
+    ret = dataq_session_pop(sess, values, codes, tv, BATCH, timeout_ms);
+    if (signalled || ret < 0)
       break;
-    if (ret < 0)
-      continue;
 
-    printf("%llu.%06llu", (unsigned long long int)tv.tv_sec,
-                          (unsigned long long int)tv.tv_usec);
+    if (log != NULL) {
+      if ((werr = dataq_log_write(log, values, codes, tv, ret)) < 0)
+        break;
+    }
+    else if (st != NULL) {
+      if ((werr = dataq_store_write(st, codes, tv, ret)) < 0)
+        break;
+    }
+    else if (print)
+      print_scans(out, values, tv, ret);
+    if (decim != NULL)
+      dataq_decim_push(decim, values, tv, ret);
+    if (fanout != NULL)
+      dataq_fanout_send(fanout, codes, tv, ret);
 
-    uint8_t c;
-    for (c = 0; c < n_chans; c++)
-      printf(" %.3f", values[c]);
-    printf("\n");
+    struct dataq_gap gap;
+    while (werr == 0 && dataq_session_gap(sess, &gap)) {
+      if (log != NULL)
+        werr = dataq_log_gap(log, &gap);
+      else if (st != NULL)
+        werr = dataq_store_gap(st, &gap);
+      else if (print)
+        print_gap(out, &gap);
+      if (decim != NULL) {
+        dataq_decim_flush(decim);
+        print_gap(decim_out, &gap);
+      }
+      if (fanout != NULL)
+        dataq_fanout_gap(fanout, &gap);
+    }
   }
 
-  dataq_close(sockfd);
-  return 0;
+
+  struct dataq_session_stats stats;
+  dataq_session_stats(sess, &stats);
+  if (stats.overruns)
+    eprintf("Dropped %llu of %llu scans: output too slow\n",
+            stats.overruns, stats.scans);
+  if (stats.reconnects)
+    eprintf("Reconnected %llu times, losing ~%llu scans\n",
+            stats.reconnects, stats.lost);
+
+  dataq_session_close(sess);
+  if (log != NULL && (ret = dataq_log_close(log)) < 0 && werr == 0)
+    werr = ret;
+  if (st != NULL && (ret = dataq_store_close(st)) < 0 && werr == 0)
+    werr = ret;
+  if (fanout != NULL) {
+    struct dataq_fanout_stats fstats;
+    dataq_fanout_stats(fanout, &fstats);
+    if (fstats.dropped)
+      eprintf("Dropped %llu of %llu datagrams: network too slow\n",
+              fstats.dropped, fstats.datagrams);
+    dataq_fanout_close(fanout);
+  }
+  if (decim != NULL) {
+    dataq_decim_flush(decim);
+    dataq_decim_close(decim);
+    if (decimated != NULL)
+      fclose(decim_out);
+    else
+      fflush(decim_out);
+  }
+  const int out_err = ferror(out);
+  if ((fclose(out) == EOF || out_err) && werr == 0) {
+    eprintf("Error writing output\n");
+    werr = -EX_IOERR;
+  }
+  dataq_conv_free(&conv);
+  return -werr;
 }
 
 #endif // USE_MAIN
@@ -1,17 +1,678 @@
 #ifndef __DATAQ_H__
 #define __DATAQ_H__
 
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/time.h>
+
+#define DATAQ_MAXCHAN 32      // Maximum number of channels
+#define DATAQ_RXBUF 8192      // Size of dataq_recv_batch() buffer, in words
+#define DATAQ_CODES (1 << 14)  // Number of distinct 14-bit sample values
+
+// Per-channel conversion from sample values to engineering units
+struct dataq_conv {
+  int n_chans;
+  float gain[DATAQ_MAXCHAN];         // fudge * fullscale
+  float offset[DATAQ_MAXCHAN];
+  const float *lut[DATAQ_MAXCHAN];   // DATAQ_CODES entries each
+  float *tables;                     // Storage behind lut[]
+};
+
+// Stop handle for cancelling receives without signals (a self-pipe)
+struct dataq_stop {
+  int fds[2];
+};
+
+// Receive state for dataq_recv_batch(), one per connected device
+struct dataq_rx {
+  int sockfd;
+  int n_chans;
+  const struct dataq_conv *conv;
+  const struct dataq_stop *stop;  // If non-NULL, poll this rather than trap signals
+  int nonblock;                   // Don't wait for data, e.g. in an event loop
+  int timestamping;               // Use kernel timestamps, see dataq_sockopts
+  int len;                        // Bytes held over from the previous call
+  int hunting;                    // Lost sync, looking for the next good scan
+  long long hunted;               // Bytes skipped so far while hunting
+  long long resyncs;              // Times sync was lost and found again
+  long long skipped;              // Total bytes skipped to regain sync
+  long long recvs;                // recv() calls that got data
+  long long partials;             // ...and of those, how many ended mid-scan
+  uint16_t buf[DATAQ_RXBUF];
+  uint16_t codes[DATAQ_RXBUF];    // buf[] after dataq_decode()
+};
+
+// Zero-copy receive, see dataq_stream.c
+#define DATAQ_STREAM_BUFS 8       // Default buffers in the pool
+#define DATAQ_STREAM_SCANS 4096   // Default scans per buffer
+
+struct dataq_stream;
+
+struct dataq_stream_opts {
+  int n_bufs;            // Buffers in the pool (default DATAQ_STREAM_BUFS)
+  int buf_scans;         // Scans each can hold (default DATAQ_STREAM_SCANS)
+  int raw;               // Keep the words as received, in view->words
+  int values;            // Convert to engineering units, in view->values
+  int timestamping;      // Kernel timestamps, see dataq_sockopts
+};
+
+// A batch of scans lent out of the pool, read-only, all interleaved by channel
+struct dataq_view {
+  const uint16_t *words; // As received, if opts.raw (else NULL)
+  const uint16_t *codes; // 14-bit codes
+  const float *values;   // Engineering units, if opts.values (else NULL)
+  int n_scans;
+  int n_chans;
+  struct timeval tv;     // Arrival of the last of them
+  int buf;               // Which buffer, for dataq_view_hold()
+};
+
+// Called with each view; it's only valid during the call, unless held
+// Return nonzero to make dataq_stream_run() return it
+typedef int (*dataq_view_fn)(void *arg, const struct dataq_view *view);
+
+// Timestamps from the sample clock, for dataq_clock_stamp()
+// All times are in nanoseconds
+struct dataq_clock {
+  clockid_t clock;
+  double nominal;        // Nominal scan period
+  double period;         // Slope of the line in use
+  long long window;      // Scans between drift corrections
+  long long count;       // Scans stamped (or skipped) so far
+  int started;
+  long long k_anchor;    // A point on the line in use
+  int64_t t_anchor;
+  long long win_start;   // Least-lagged arrival in the current window
+  int64_t best_lag;
+  long long best_k;
+  int64_t best_t;
+  int have_ref;          // Least-lagged arrival in the first window
+  long long ref_k;
+  int64_t ref_t;
+  int warned;
+};
+
+// How dataq_session_pop() timestamps scans
+enum dataq_timestamps {
+  DATAQ_TS_ARRIVAL,      // gettimeofday() after each recv(), as dataq_recv()
+                         // (or the kernel's, with opts.sock.timestamping)
+  DATAQ_TS_REALTIME,     // From the sample clock, anchored to CLOCK_REALTIME
+  DATAQ_TS_MONOTONIC,    // From the sample clock, anchored to CLOCK_MONOTONIC
+};
+
+// Socket options for dataq_connect_opts(); zeroed means system defaults
+struct dataq_sockopts {
+  int rcvbuf;            // SO_RCVBUF, bytes: room to ride out consumer stalls
+  int nodelay;           // TCP_NODELAY, so commands go out straight away
+  int rcvlowat_scans;    // SO_RCVLOWAT, in scans: don't wake for fewer
+  int busy_poll_us;      // SO_BUSY_POLL (Linux): spin this long for packets
+  int timestamping;      // SO_TIMESTAMPING (Linux): kernel receive timestamps,
+                         // for dataq_recv_batch() with rx->timestamping
+  const struct dataq_stop *stop;  // If not NULL, cancels connecting
+};
+
+// Per-channel streaming filters, see dataq_filter.c
+#define DATAQ_FILTER_STAGES 4  // Most stages per channel
+
+enum dataq_filter_type {
+  DATAQ_FILTER_NONE,
+  DATAQ_FILTER_LOWPASS,  // Biquads, from freq (Hz) and q
+  DATAQ_FILTER_HIGHPASS,
+  DATAQ_FILTER_NOTCH,
+  DATAQ_FILTER_FIR,      // n_taps taps[], taps[0] for the newest sample
+};
+
+struct dataq_filter_stage {
+  enum dataq_filter_type type;
+  double freq;           // Cutoff or centre, Hz
+  double q;              // 0 for the default: 0.7071 (Butterworth), notch 30
+  const float *taps;     // FIR; copied when the filter is set up
+  int n_taps;
+};
+
+// A channel's filter: its stages in turn (none for no filtering)
+struct dataq_filter_spec {
+  int n_stages;
+  struct dataq_filter_stage stages[DATAQ_FILTER_STAGES];
+};
+
+struct dataq_filter;
+
+// Device context: one connected device with everything needed to read it,
+// see dataq_ctx.c
+struct dataq_ctx;
+
+struct dataq_ctx_config {
+  const char *hostname;
+  uint16_t portno;
+  int timerscaler;
+  int rate_divisor;
+  const char *scanlist;
+  int n_chans;
+  const float *fullscale;  // n_chans each
+  const float *fudge;      // May be NULL, for 1.0
+  const struct dataq_filter_spec *filter;  // n_chans, or NULL for none
+  struct dataq_sockopts sock;
+};
+
+struct dataq_ctx_stats {
+  unsigned long long scans;     // Scans received
+  unsigned long long batches;   // Calls that returned scans
+  unsigned long long resyncs;   // Times sync was lost and found again
+  unsigned long long skipped;   // Bytes skipped to regain sync
+};
+
+// Session options; zeroed means defaults
+// Real-time settings for a session's receive thread, see dataq_session.c
+struct dataq_rt_opts {
+  int pin;               // Pin the thread to CPU cpu (Linux)
+  int cpu;
+  int fifo_prio;         // SCHED_FIFO at this priority (1-99), or 0 to leave be
+  int lock;              // mlockall() the process, faulting everything in
+  int busy_poll;         // Spin on the socket rather than sleep in poll()
+};
+
+struct dataq_session_opts {
+  enum dataq_timestamps timestamps;
+  struct dataq_sockopts sock;
+  int reconnect;         // If the device goes away or stalls, connect again
+  int stall_ms;          // How long without data is a stall (default 3000)
+  const struct dataq_filter_spec *filter;  // Per channel (n_chans), or NULL:
+                                           // values are filtered, codes not
+  struct dataq_rt_opts rt;
+};
+
+// Where scans were lost, e.g. while reconnecting
+struct dataq_gap {
+  struct timeval start;  // Last scan before
+  struct timeval end;    // First scan after
+  long long lost;        // Scans that should have been in between, roughly
+};
+
+// Binary log files, see dataq_log.c
+#define DATAQ_LOG_MAGIC "DQLG"
+#define DATAQ_LOG_VERSION 1
+#define DATAQ_LOG_MAXBLOCK 4096  // Most scans in a block
+
+enum dataq_log_format {
+  DATAQ_LOG_CODES = 1,   // 14-bit codes as uint16_t
+  DATAQ_LOG_FLOAT = 2,   // Engineering units as float
+  DATAQ_LOG_RAW = 3,     // Bytes as received, see dataq_capture()
+  DATAQ_LOG_PACKED = 4,  // Codes, delta and bit-packed, see dataq_pack.c
+};
+
+struct dataq_log_header {
+  char magic[4];
+  uint16_t version;
+  uint8_t format;
+  uint8_t n_chans;
+  int32_t timerscaler;
+  int32_t rate_divisor;
+  double period;                     // Nominal scan period, seconds
+  char scanlist[136];
+  float gain[DATAQ_MAXCHAN];         // As struct dataq_conv
+  float offset[DATAQ_MAXCHAN];
+};
+
+struct dataq_log_block {
+  int64_t t_ns;          // Timestamp of the first scan, ns since the epoch
+  double period_ns;      // Spacing of the following scans' timestamps
+  uint32_t n_scans;
+  uint32_t flags;
+};
+
+#define DATAQ_LOG_GAP 1  // Block flag: a gap, period_ns long, with no scans
+
+// Most bytes dataq_pack() can make of n_scans scans of n_chans channels
+#define DATAQ_PACK_BOUND(n_scans, n_chans) \
+  ((size_t) (n_chans) * (2 * (size_t) (n_scans) + (n_scans) / 64 \
+                         + 4 * ((n_scans) / DATAQ_LOG_MAXBLOCK + 1)))
+
+struct dataq_log;
+
+// Chunked column store, see dataq_store.c
+#define DATAQ_STORE_MAGIC "DQST"
+#define DATAQ_STORE_VERSION 2
+#define DATAQ_STORE_SCANS 8192        // Default scans per chunk
+#define DATAQ_STORE_CHUNKS (1 << 20)  // Default most chunks in a store
+
+struct dataq_store_header {
+  char magic[4];
+  uint32_t version;
+  uint32_t chunk_scans;              // Rows per chunk, a multiple of 64
+  uint32_t max_chunks;               // Room in the index
+  uint64_t n_chunks;                 // Chunks written, the last maybe partly
+  uint64_t index_at;                 // File offsets of the index...
+  uint64_t data_at;                  // ...and of the first chunk
+  struct dataq_log_header acq;       // The acquisition, samples as codes
+};
+
+// Index entry per chunk: its scans lie on the line t_ns + s * period_ns
+struct dataq_store_chunk {
+  int64_t t_ns;                      // Timestamp of the first scan
+  double period_ns;
+  uint32_t n_scans;
+  uint32_t flags;
+  int64_t gap_start_ns;              // With DATAQ_STORE_GAP: last scan before,
+  int64_t gap_end_ns;                // first after, and scans lost between
+  int64_t gap_lost;                  // (as in struct dataq_gap)
+  uint16_t min[DATAQ_MAXCHAN];       // Codes, per channel
+  uint16_t max[DATAQ_MAXCHAN];
+};
+
+#define DATAQ_STORE_GAP 1  // Chunk flag: scans were lost just before it
+
+struct dataq_store;
+
+// Replay of a raw capture or pcap, see dataq_replay.c
+struct dataq_replay;
+
+// Raw capture index entry: when the capture reached offset bytes
+struct dataq_index_record {
+  int64_t t_ns;          // Realtime, ns since the epoch
+  uint64_t offset;
+};
+
+// Fan-out of an acquisition to subscribers, see dataq_fanout.c
+#define DATAQ_FANOUT_MAGIC "DQFO"
+#define DATAQ_FANOUT_DESTS 8          // Most destinations per publisher
+#define DATAQ_FANOUT_SCANS 256        // Most scans per batch
+#define DATAQ_FANOUT_SLOTS 1024       // Batches in a shared-memory ring
+#define DATAQ_FANOUT_MTU 1400         // Most bytes per datagram
+#define DATAQ_FANOUT_HEADER_MS 1000   // How often the header is sent
+
+// Datagram: a block of packed codes follows, or for DATAQ_FANOUT_HEADER a
+// struct dataq_log_header
+struct dataq_fanout_msg {
+  char magic[4];
+  uint32_t seq;          // One more each datagram
+  struct dataq_log_block blk;
+};
+
+#define DATAQ_FANOUT_HEADER 0x100  // Block flag: the acquisition's header
+#define DATAQ_FANOUT_END 0x200     // Block flag: the publisher has finished
+
+struct dataq_fanout_stats {
+  unsigned long long scans;      // Scans published
+  unsigned long long datagrams;  // Datagrams sent or attempted...
+  unsigned long long dropped;    // ...and dropped, for lack of room
+};
+
+struct dataq_fanout;
+struct dataq_fanout_sub;
+
+// A unit found by dataq_discover()
+struct dataq_unit {
+  char addr[64];         // IP address, as text
+  uint8_t mac[6];
+};
+
+#define DATAQ_DISCOVER_MS 1000  // How long dataq_autodiscover() waits for replies
+#define DATAQ_MAX_UNITS 64      // Most units dataq_discover() caches
+
+// Acquisition session: a receive thread filling a ring of decoded scans
+struct dataq_session;
+
+struct dataq_session_stats {
+  unsigned long long scans;     // Scans received from the device
+  unsigned long long overruns;  // Scans dropped because the ring was full
+  unsigned long long resyncs;   // Times sync was lost and found again
+  unsigned long long skipped;   // Bytes skipped to regain sync
+  unsigned long long reconnects;
+  unsigned long long lost;      // Scans estimated lost to reconnects
+  unsigned long long batches;   // Batches received
+  unsigned long long timeouts;  // Seconds the device sent nothing
+  unsigned long long recvs;     // recv() calls that got data
+  unsigned long long partials;  // ...and ended mid-scan
+};
+
+// Latency histogram, see dataq_hist.c: counts[] of nanosecond values, in
+// buckets DATAQ_HIST_SUB to each power of two (so to within about 6%)
+#define DATAQ_HIST_SUB 16
+#define DATAQ_HIST_BITS 40     // Up to 2^40 ns, about 18 minutes
+#define DATAQ_HIST_BUCKETS (DATAQ_HIST_SUB * (DATAQ_HIST_BITS - 3))
+
+struct dataq_hist {
+  unsigned long long n;
+  unsigned long long sum_ns;
+  unsigned long long max_ns;
+  unsigned long long counts[DATAQ_HIST_BUCKETS];
+};
+
+// Multi-device manager: one event loop serving many devices
+struct dataq_multi;
+
+// Called with each batch of n_scans scans from device dev, as from
+// dataq_recv_batch() (values[] interleaved, codes[] the same unconverted) with
+// their timestamps tv[]; the arrays are only valid during the call
+// If the device has gone, n_scans is instead the negated EX_ code (and the
+// arrays are NULL)
+// Return nonzero to make dataq_multi_run() return it
+typedef int (*dataq_multi_fn)(void *arg, int dev, const float values[],
+                              const uint16_t codes[], const struct timeval tv[],
+                              int n_scans);
+
+// Merge of several devices' scans into frames aligned in time, see dataq_merge.c
+struct dataq_merge;
+
+// Called with n_frames frames of width values each (every device's channels in
+// turn), and their timestamps tv[] (those of the first device's scans)
+// Return nonzero to stop, as dataq_multi_fn
+typedef int (*dataq_merge_fn)(void *arg, const float frames[], int width,
+                              const struct timeval tv[], int n_frames);
+
+// Decimation into min/max pyramids, see dataq_decim.c
+#define DATAQ_DECIM_LEVELS 8   // Most decimation levels
+
+struct dataq_decim;
+
+// One reduced point: n scans' worth of each channel's mean, min and max
+struct dataq_decim_point {
+  int level;             // Index into the factors given to dataq_decim_open()
+  int factor;            // Scans per point at this level
+  int n;                 // Scans in this one: factor, or fewer if cut short
+  int n_chans;
+  int64_t t_ns;          // Timestamp of the first scan
+  const float *mean, *min, *max;  // n_chans each
+};
+
+// Called with each point as it completes, finest level first; return nonzero
+// to make dataq_decim_push() return it
+typedef int (*dataq_decim_fn)(void *arg, const struct dataq_decim_point *pt);
+
+int dataq_stop_init(struct dataq_stop *stop);
+
+void dataq_stop_signal(const struct dataq_stop *stop);
+
+int dataq_stop_pending(const struct dataq_stop *stop);
+
+void dataq_stop_close(struct dataq_stop *stop);
+
 int dataq_cmd(int sockfd, const char *fmt, ...);
 
 int dataq_connect(const char *hostname, const uint16_t portno,
                   const int timerscaler, const int rate_divisor,
                   const char *scanlist, const int n_chans);
 
+int dataq_connect_opts(const char *hostname, const uint16_t portno,
+                       const int timerscaler, const int rate_divisor,
+                       const char *scanlist, const int n_chans,
+                       const struct dataq_sockopts *opts);
+
+int dataq_connect_many(int sockfds[], const int n_devs,
+                       const char *const hostnames[], const uint16_t portno,
+                       const int timerscaler, const int rate_divisor,
+                       const char *scanlist, const int n_chans,
+                       const struct dataq_sockopts *opts);
+
 void dataq_close(int sockfd);
 
+void dataq_close_period(int sockfd, const double period);
+
 int dataq_recv(int sockfd, float values[], const int n_chans,
                const float fullscale, const float fudge, struct timeval *tv);
 
+int dataq_recv_stoppable(int sockfd, const struct dataq_stop *stop,
+                         float values[], const int n_chans,
+                         const float fullscale, const float fudge,
+                         struct timeval *tv);
+
+int dataq_conv_init(struct dataq_conv *conv, const int n_chans,
+                    const float fullscale[], const float fudge[],
+                    const float offset[]);
+
+void dataq_conv_free(struct dataq_conv *conv);
+
+size_t dataq_decode(const uint16_t words[], uint16_t codes[],
+                    const size_t n_scans, const int n_chans);
+
+const char *dataq_decode_kernel(void);
+
+int dataq_decode_select(const char *name);
+
+void dataq_rx_init(struct dataq_rx *rx, int sockfd,
+                   const struct dataq_conv *conv);
+
+int dataq_recv_batch(struct dataq_rx *rx, float values[], const int max_scans,
+                     struct timeval *tv);
+
+int dataq_recv_columns(struct dataq_rx *rx, float *const cols[],
+                       const int max_scans, struct timeval *tv);
+
+int dataq_ctx_open(struct dataq_ctx **ctxp,
+                   const struct dataq_ctx_config *config);
+
+int dataq_ctx_recv(struct dataq_ctx *ctx, float values[], uint16_t codes[],
+                   const int max_scans, struct timeval *tv);
+
+const struct dataq_conv *dataq_ctx_conv(const struct dataq_ctx *ctx);
+
+void dataq_ctx_log_header(const struct dataq_ctx *ctx,
+                          const enum dataq_log_format format,
+                          struct dataq_log_header *hdr);
+
+int dataq_ctx_fd(const struct dataq_ctx *ctx);
+
+void dataq_ctx_stats(const struct dataq_ctx *ctx, struct dataq_ctx_stats *stats);
+
+void dataq_ctx_stop(struct dataq_ctx *ctx);
+
+void dataq_ctx_close(struct dataq_ctx *ctx);
+
+int dataq_stream_open(struct dataq_stream **sp, int sockfd,
+                      const struct dataq_conv *conv,
+                      const struct dataq_stream_opts *opts);
+
+int dataq_stream_run(struct dataq_stream *s, dataq_view_fn fn, void *arg);
+
+void dataq_view_hold(struct dataq_stream *s, const struct dataq_view *view);
+
+void dataq_view_release(struct dataq_stream *s, const struct dataq_view *view);
+
+void dataq_stream_stop(struct dataq_stream *s);
+
+void dataq_stream_close(struct dataq_stream *s);
+
+int dataq_discover(struct dataq_unit units[], const int max_units,
+                   const int timeout_ms, const char *cache);
+
+const char *dataq_discover_cache(void);
+
 const char *dataq_autodiscover(void);
 
+double dataq_scan_period(const int timerscaler, const int rate_divisor,
+                         const int n_chans);
+
+void dataq_clock_init(struct dataq_clock *clk, clockid_t clock, double period);
+
+void dataq_clock_skip(struct dataq_clock *clk, const long long n_scans);
+
+void dataq_clock_stamp(struct dataq_clock *clk, const int n_scans,
+                       struct timeval tv[]);
+
+int dataq_session_open(struct dataq_session **sessp, const char *hostname,
+                       const uint16_t portno, const int timerscaler,
+                       const int rate_divisor, const char *scanlist,
+                       const struct dataq_conv *conv, const int ring_scans,
+                       const struct dataq_session_opts *opts);
+
+int dataq_session_pop(struct dataq_session *sess, float values[],
+                      uint16_t codes[], struct timeval tv[],
+                      const int max_scans, const int timeout_ms);
+
+int dataq_session_gap(struct dataq_session *sess, struct dataq_gap *gap);
+
+void dataq_session_stop(struct dataq_session *sess);
+
+void dataq_session_stats(struct dataq_session *sess,
+                         struct dataq_session_stats *stats);
+
+void dataq_session_latency(struct dataq_session *sess,
+                           struct dataq_hist *deliver, struct dataq_hist *jitter);
+
+void dataq_session_close(struct dataq_session *sess);
+
+void dataq_hist_diff(struct dataq_hist *out, const struct dataq_hist *now,
+                     const struct dataq_hist *before);
+
+long long dataq_hist_percentile(const struct dataq_hist *h, const double pct);
+
+int dataq_multi_open(struct dataq_multi **mp,
+                     const struct dataq_session_opts *opts,
+                     dataq_multi_fn fn, void *arg);
+
+int dataq_multi_add(struct dataq_multi *m, const char *hostname,
+                    const uint16_t portno, const int timerscaler,
+                    const int rate_divisor, const char *scanlist,
+                    const struct dataq_conv *conv);
+
+int dataq_multi_attach(struct dataq_multi *m, int sockfd,
+                       const int timerscaler, const int rate_divisor,
+                       const struct dataq_conv *conv);
+
+int dataq_multi_add_many(struct dataq_multi *m, const int n_devs,
+                         const char *const hostnames[], const uint16_t portno,
+                         const int timerscaler, const int rate_divisor,
+                         const char *scanlist, const struct dataq_conv *conv);
+
+int dataq_multi_run(struct dataq_multi *m);
+
+void dataq_multi_stop(struct dataq_multi *m);
+
+void dataq_multi_close(struct dataq_multi *m);
+
+int dataq_merge_open(struct dataq_merge **mp, const int n_devs,
+                     const int n_chans[], const int ring_scans,
+                     dataq_merge_fn fn, void *arg);
+
+int dataq_merge_push(void *arg, int dev, const float values[],
+                     const uint16_t codes[], const struct timeval tv[],
+                     int n_scans);
+
+unsigned long long dataq_merge_dropped(const struct dataq_merge *m);
+
+void dataq_merge_close(struct dataq_merge *m);
+
+int dataq_filter_open(struct dataq_filter **fp, const int n_chans,
+                      const struct dataq_filter_spec specs[], const double rate);
+
+void dataq_filter_run(struct dataq_filter *f, float values[], const int n_scans);
+
+void dataq_filter_columns(struct dataq_filter *f, float *const cols[],
+                          const int n_scans);
+
+void dataq_filter_reset(struct dataq_filter *f);
+
+void dataq_filter_close(struct dataq_filter *f);
+
+int dataq_decim_open(struct dataq_decim **dp, const int n_chans,
+                     const int factors[], const int n_levels,
+                     dataq_decim_fn fn, void *arg);
+
+int dataq_decim_push(struct dataq_decim *d, const float values[],
+                     const struct timeval tv[], const int n_scans);
+
+int dataq_decim_flush(struct dataq_decim *d);
+
+void dataq_decim_close(struct dataq_decim *d);
+
+void dataq_log_header_init(struct dataq_log_header *hdr,
+                           const enum dataq_log_format format,
+                           const struct dataq_conv *conv,
+                           const int timerscaler, const int rate_divisor,
+                           const char *scanlist);
+
+int dataq_log_open(struct dataq_log **logp, int fd,
+                   const struct dataq_log_header *hdr);
+
+int dataq_log_write(struct dataq_log *log, const float values[],
+                    const uint16_t codes[], const struct timeval tv[],
+                    const int n_scans);
+
+int dataq_log_gap(struct dataq_log *log, const struct dataq_gap *gap);
+
+int dataq_log_flush(struct dataq_log *log);
+
+int dataq_log_close(struct dataq_log *log);
+
+int dataq_capture(int sockfd, int fd, int index_fd,
+                  const struct dataq_log_header *hdr,
+                  const struct dataq_stop *stop, long long *total);
+
+size_t dataq_pack(const uint16_t codes[], const int n_scans, const int n_chans,
+                  uint8_t out[]);
+
+size_t dataq_unpack(const uint8_t in[], const size_t len, const int n_scans,
+                    const int n_chans, uint16_t codes[]);
+
+int dataq_log_read_header(FILE *f, struct dataq_log_header *hdr);
+
+int dataq_log_read_block(FILE *f, const struct dataq_log_header *hdr,
+                         struct dataq_log_block *blk, float values[]);
+
+int dataq_store_create(struct dataq_store **stp, const char *path,
+                       const struct dataq_log_header *hdr,
+                       const int chunk_scans, const long long max_chunks);
+
+int dataq_store_write(struct dataq_store *st, const uint16_t codes[],
+                      const struct timeval tv[], const int n_scans);
+
+int dataq_store_gap(struct dataq_store *st, const struct dataq_gap *gap);
+
+int dataq_store_open(struct dataq_store **stp, const char *path);
+
+const struct dataq_store_header *dataq_store_header(const struct dataq_store *st);
+
+long long dataq_store_chunks(const struct dataq_store *st);
+
+const struct dataq_store_chunk *dataq_store_index(const struct dataq_store *st,
+                                                  const long long chunk);
+
+const uint16_t *dataq_store_column(const struct dataq_store *st,
+                                   const long long chunk, const int chan);
+
+long long dataq_store_find(const struct dataq_store *st, const int64_t t_ns);
+
+int dataq_store_close(struct dataq_store *st);
+
+int dataq_fanout_open(struct dataq_fanout **fop, const struct dataq_log_header *hdr);
+
+int dataq_fanout_add(struct dataq_fanout *fo, const char *dest);
+
+int dataq_fanout_send(struct dataq_fanout *fo, const uint16_t codes[],
+                      const struct timeval tv[], const int n_scans);
+
+int dataq_fanout_gap(struct dataq_fanout *fo, const struct dataq_gap *gap);
+
+void dataq_fanout_stats(const struct dataq_fanout *fo,
+                        struct dataq_fanout_stats *stats);
+
+void dataq_fanout_close(struct dataq_fanout *fo);
+
+int dataq_fanout_subscribe(struct dataq_fanout_sub **subp, const char *src);
+
+const struct dataq_log_header *dataq_fanout_header(const struct dataq_fanout_sub *sub);
+
+unsigned long long dataq_fanout_dropped(const struct dataq_fanout_sub *sub);
+
+int dataq_fanout_recv(struct dataq_fanout_sub *sub, struct dataq_log_block *blk,
+                      uint16_t codes[], const int max_scans, const int timeout_ms);
+
+void dataq_fanout_unsubscribe(struct dataq_fanout_sub *sub);
+
+int dataq_replay_open(struct dataq_replay **rp, const char *path,
+                      const uint16_t portno);
+
+const struct dataq_log_header *dataq_replay_header(const struct dataq_replay *r);
+
+int dataq_replay_recv(struct dataq_replay *r, struct dataq_rx *rx,
+                      float values[], const int max_scans, struct timeval *tv);
+
+void dataq_replay_progress(const struct dataq_replay *r, long long *done,
+                           long long *size);
+
+void dataq_replay_close(struct dataq_replay *r);
+
 #endif // __DATAQ_H__
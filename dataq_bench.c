@@ -0,0 +1,344 @@
+/* Benchmarks against a simulated device (see dataq_sim.c)
+ *
+ * Usage: dataq_bench [OPTIONS]  (or 'make bench')
+ *
+ * Measures the decode kernels on a buffer in memory, then dataq_recv(),
+ * dataq_recv_batch() and dataq_recv_columns() receiving from the simulator
+ * through a socketpair (or, with -l, TCP over loopback, connecting as
+ * dataq_connect() does), reporting scans/s, CPU time per scan (this thread's
+ * only, not the simulator's) and the time each call took.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "dataq.h"
+#include "dataq_private.h"
+#include "dataq_sim.h"
+
+#define PORT 0              // Loopback: any free port
+
+static int n_chans = 8;
+static double secs = 2;     // Per benchmark
+static int loopback = 0;
+static struct dataq_sim_opts sim_opts = {.rate = 0 };
+
+static int64_t clock_ns(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ *  Simulator, on the far end of a socketpair or a loopback connection
+ */
+
+struct device {
+  pthread_t thread;
+  int fd;                   // Simulator's end, or the listening socket
+  int listening;
+};
+
+static void *device_thread(void *arg)
+{
+  struct device *dev = arg;
+  int fd = dev->fd;
+  if (dev->listening) {
+    fd = accept(dev->fd, NULL, NULL);
+    close(dev->fd);
+    if (fd < 0)
+      return NULL;
+  }
+  dataq_sim_serve(fd, &sim_opts);
+  close(fd);
+  return NULL;
+}
+
+static const char *scanlist(void)
+{
+  static char list[4 * DATAQ_MAXCHAN + 1];
+  int c;
+  for (c = 0; c < n_chans; c++)
+    snprintf(&list[4 * c], 5, "E%03X", c & 0xFF);
+  return list;
+}
+
+// Start a simulated device streaming, returning our end of the connection
+static int device_open(struct device *dev)
+{
+  int sockfd;
+
+  if (loopback) {
+    struct sockaddr_in addr = {.sin_family = AF_INET,.sin_port = htons(PORT) };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    dev->fd = socket(AF_INET, SOCK_STREAM, 0);
+    dev->listening = 1;
+    if (dev->fd < 0 || bind(dev->fd, (struct sockaddr *) &addr, len) == -1
+        || listen(dev->fd, 1) == -1
+        || getsockname(dev->fd, (struct sockaddr *) &addr, &len) == -1) {
+      eprintf("Can't listen on loopback: %s\n", strerror(errno));
+      if (dev->fd >= 0)
+        close(dev->fd);
+      return -EX_OSERR;
+    }
+    if (pthread_create(&dev->thread, NULL, device_thread, dev) != 0) {
+      close(dev->fd);
+      return -EX_OSERR;
+    }
+    sockfd = dataq_connect("127.0.0.1", ntohs(addr.sin_port), 0, 0,
+                           scanlist(), n_chans);
+    if (sockfd < 0) {
+      // Our end is closed, which ends a simulator that got as far as
+      // serving; one still in accept() needs a connection to end on
+      const int fd = socket(AF_INET, SOCK_STREAM, 0);
+      if (fd >= 0) {
+        connect(fd, (struct sockaddr *) &addr, len);
+        close(fd);
+      }
+      pthread_join(dev->thread, NULL);
+    }
+    return sockfd;
+  }
+
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+    return -EX_OSERR;
+  dev->fd = fds[1];
+  dev->listening = 0;
+  if (pthread_create(&dev->thread, NULL, device_thread, dev) != 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return -EX_OSERR;
+  }
+
+  // As dataq_connect() would, bar the socket itself
+  sockfd = fds[0];
+  const struct timeval tv = {.tv_sec = 1,.tv_usec = 0 };
+  setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  int ret;
+  if ((ret = dataq_cmd(sockfd, "X%02X", 0)) < 0
+      || (ret = dataq_cmd(sockfd, "M%04X", 0)) < 0
+      || (ret = dataq_cmd(sockfd, "L00%s", scanlist())) < 0
+      || (ret = dataq_cmd(sockfd, "C%02X", n_chans)) < 0
+      || (ret = dataq_cmd(sockfd, "S3")) < 0) {
+    close(sockfd);
+    pthread_join(dev->thread, NULL);
+    return ret;
+  }
+  return sockfd;
+}
+
+static void device_close(struct device *dev, int sockfd)
+{
+  dataq_close(sockfd);
+  pthread_join(dev->thread, NULL);
+}
+
+/*
+ *  Reporting
+ */
+
+static void report(const char *name, const long long n_scans,
+                   const int64_t wall_ns, const int64_t cpu_ns,
+                   struct dataq_hist_live *calls)
+{
+  printf("%-14s %12.0f scans/s %9.1f ns CPU/scan", name,
+         n_scans / (wall_ns * 1e-9), (double) cpu_ns / n_scans);
+  if (calls != NULL) {
+    struct dataq_hist h;
+    dataq_hist_read(calls, &h);
+    printf("   call p50/p99/max %.1f/%.1f/%.1f us",
+           dataq_hist_percentile(&h, 50) / 1e3, dataq_hist_percentile(&h, 99) / 1e3,
+           h.max_ns / 1e3);
+  }
+  printf("\n");
+}
+
+/*
+ *  Benchmarks
+ */
+
+static void bench_decode(void)
+{
+  const size_t n_scans = (1 << 20) / n_chans;
+  uint16_t *words = malloc(n_scans * n_chans * sizeof(uint16_t));
+  uint16_t *codes = malloc(n_scans * n_chans * sizeof(uint16_t));
+  if (words == NULL || codes == NULL)
+    exit(EX_OSERR);
+  size_t i;
+  for (i = 0; i < n_scans * n_chans; i++) {
+    const int c = i % n_chans;
+    const uint16_t code = (i * 37) & 0x3FFF;
+    words[i] = ((code & 0x3F80) << 2) | ((code & 0x007F) << 1) | (c ? 0x0101 : 0x0100);
+  }
+
+  static const char *const names[] = { "scalar", "sse2", "avx2", "neon" };
+  const char *was = dataq_decode_kernel();
+  size_t k;
+  for (k = 0; k < sizeof(names) / sizeof(names[0]); k++) {
+    if (dataq_decode_select(names[k]) < 0)
+      continue;
+
+    long long done = 0;
+    const int64_t t0 = clock_ns(CLOCK_MONOTONIC), c0 = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    int64_t t;
+    do {
+      if (dataq_decode(words, codes, n_scans, n_chans) != n_scans * n_chans) {
+        eprintf("Decode failed\n");
+        exit(EX_SOFTWARE);
+      }
+      done += n_scans;
+    } while ((t = clock_ns(CLOCK_MONOTONIC)) - t0 < secs * 1e9);
+
+    char name[32];
+    snprintf(name, sizeof(name), "decode %s", names[k]);
+    report(name, done, t - t0, clock_ns(CLOCK_THREAD_CPUTIME_ID) - c0, NULL);
+  }
+  dataq_decode_select(was);
+  free(words);
+  free(codes);
+}
+
+static void bench_recv(void)
+{
+  struct device dev;
+  int sockfd = device_open(&dev);
+  if (sockfd < 0)
+    exit(-sockfd);
+
+  static struct dataq_hist_live calls;
+  float values[DATAQ_MAXCHAN];
+  long long done = 0;
+  const int64_t t0 = clock_ns(CLOCK_MONOTONIC), c0 = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+  int64_t t = t0;
+  do {
+    const int64_t before = t;
+    if (dataq_recv(sockfd, values, n_chans, 20.0, 1.0, NULL) < 0)
+      break;
+    done++;
+    t = clock_ns(CLOCK_MONOTONIC);
+    dataq_hist_record(&calls, t - before);
+  } while (t - t0 < secs * 1e9);
+
+  report("recv", done, t - t0, clock_ns(CLOCK_THREAD_CPUTIME_ID) - c0, &calls);
+  device_close(&dev, sockfd);
+}
+
+static void bench_batch(const struct dataq_conv *conv, const int columns)
+{
+  struct device dev;
+  int sockfd = device_open(&dev);
+  if (sockfd < 0)
+    exit(-sockfd);
+
+  static struct dataq_rx rx;
+  static struct dataq_hist_live calls;
+  static float values[DATAQ_RXBUF] __attribute__((aligned(64)));
+  float *cols[DATAQ_MAXCHAN];
+  const int max_scans = DATAQ_RXBUF / n_chans / 16 * 16;
+  int c;
+  for (c = 0; c < n_chans; c++)
+    cols[c] = &values[c * max_scans];
+  dataq_rx_init(&rx, sockfd, conv);
+  long long done = 0;
+  const int64_t t0 = clock_ns(CLOCK_MONOTONIC), c0 = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+  int64_t t = t0;
+  do {
+    const int64_t before = t;
+    int ret = columns ? dataq_recv_columns(&rx, cols, max_scans, NULL)
+                      : dataq_recv_batch(&rx, values, max_scans, NULL);
+    if (ret < 0)
+      break;
+    done += ret;
+    t = clock_ns(CLOCK_MONOTONIC);
+    dataq_hist_record(&calls, t - before);
+  } while (t - t0 < secs * 1e9);
+
+  report(columns ? "recv_columns" : "recv_batch", done, t - t0,
+         clock_ns(CLOCK_THREAD_CPUTIME_ID) - c0, &calls);
+  if (rx.resyncs)
+    printf("%-14s %lld resyncs, %lld bytes skipped\n", "", rx.resyncs, rx.skipped);
+  device_close(&dev, sockfd);
+}
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr,
+          "Benchmark decoding and receiving, against a simulated DI-718B\n"
+          "Usage:\n"
+          "    %s [OPTIONS]\n"
+          "Options:\n"
+          "    -c, --chans N        Channels per scan (default 8)\n"
+          "    -t, --time SECS      Time for each benchmark (default 2)\n"
+          "    -r, --rate HZ        Scans per second from the simulator (default 0,\n"
+          "                         as fast as possible)\n"
+          "    -l, --loopback       Connect over TCP on loopback, not a socketpair\n",
+          argv0);
+  exit(EX_USAGE);
+}
+
+int main(int argc, char **argv)
+{
+  static const struct option longopts[] = {
+    { "chans", required_argument, NULL, 'c' },
+    { "time", required_argument, NULL, 't' },
+    { "rate", required_argument, NULL, 'r' },
+    { "loopback", no_argument, NULL, 'l' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "c:t:r:lh", longopts, NULL)) != -1) {
+    switch (opt) {
+    case 'c':
+      n_chans = atoi(optarg);
+      break;
+    case 't':
+      secs = atof(optarg);
+      break;
+    case 'r':
+      sim_opts.rate = atof(optarg);
+      break;
+    case 'l':
+      loopback = 1;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc || n_chans < 1 || n_chans > DATAQ_MAXCHAN || secs <= 0
+      || sim_opts.rate < 0)
+    usage(argv[0]);
+
+  float fullscales[DATAQ_MAXCHAN];
+  int c;
+  for (c = 0; c < n_chans; c++)
+    fullscales[c] = 20.0;
+  struct dataq_conv conv;
+  int ret;
+  if ((ret = dataq_conv_init(&conv, n_chans, fullscales, NULL, NULL)) < 0)
+    exit(-ret);
+
+  printf("%d channels, %s, simulator at %s\n", n_chans,
+         loopback ? "TCP loopback" : "socketpair",
+         sim_opts.rate > 0 ? "a fixed rate" : "full speed");
+  bench_decode();
+  bench_recv();
+  bench_batch(&conv, 0);
+  bench_batch(&conv, 1);
+
+  dataq_conv_free(&conv);
+  return 0;
+}
@@ -0,0 +1,203 @@
+/* Raw capture: the device's byte stream, straight to disk
+ *
+ * For the highest rates, or when nothing must be lost, skip decoding during
+ * acquisition altogether and keep exactly what came off the wire, to be
+ * decoded later.  On Linux the bytes are moved with splice() from the socket
+ * through a pipe to the output, so they never pass through user space.
+ *
+ * Alongside the data, an index file gets a struct dataq_log_header (with
+ * format DATAQ_LOG_RAW) describing the acquisition, then struct
+ * dataq_index_record entries pairing arrival times with the number of bytes
+ * captured by then.
+ */
+
+#define _GNU_SOURCE  // splice()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "dataq.h"
+#include "dataq_private.h"
+
+#define CHUNK (1 << 16)            // Most bytes moved at once
+#define INDEX_NS 100000000         // Time between index records
+#define POLL_MS 1000
+
+static int64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Wait for the socket to have data, or the stop handle to be signalled
+// Returns 1 if there's data, 0 if stopped, or negative on error
+static int wait_data(int sockfd, const struct dataq_stop *stop)
+{
+  for (;;) {
+    struct pollfd pfds[2] = {
+      {.fd = sockfd,.events = POLLIN },
+      {.fd = stop ? stop->fds[0] : -1,.events = POLLIN },
+    };
+    int r = poll(pfds, 2, POLL_MS);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r < 0) {
+      eprintf("Error polling socket\n");
+      return -EX_IOERR;
+    }
+    if (pfds[1].revents)
+      return 0;
+    if (r > 0)
+      return 1;
+    eprintf("Timeout reading from socket\n");
+  }
+}
+
+#ifdef __linux__
+// Move up to CHUNK bytes from the socket to fd via the pipe, without copying
+// If fd turns out not to take splice(), copies out through buf and clears
+// *use_splice
+// Returns bytes moved, 0 at EOF, -2 if there was nothing after all, or
+// negative EX_ code on error
+static ssize_t move_splice(int sockfd, int fd, int pipefd[2], uint8_t buf[],
+                           int *use_splice)
+{
+  ssize_t n = splice(sockfd, NULL, pipefd[1], NULL, CHUNK,
+                     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (n < 0 && (errno == EAGAIN || errno == EINTR))
+    return -2;
+  if (n < 0) {
+    // Nothing's in the pipe yet, so just copy from here on
+    dprintf("Can't splice from socket (%s), copying instead\n", strerror(errno));
+    *use_splice = 0;
+    return -2;
+  }
+
+  ssize_t left = n;
+  while (left > 0) {
+    ssize_t m = splice(pipefd[0], NULL, fd, NULL, left, SPLICE_F_MOVE);
+    if (m < 0 && errno == EINTR)
+      continue;
+    if (m <= 0)
+      break;
+    left -= m;
+  }
+
+  if (left > 0) {
+    dprintf("Can't splice to output (%s), copying instead\n", strerror(errno));
+    *use_splice = 0;
+    while (left > 0) {
+      ssize_t m = read(pipefd[0], buf, left);
+      if (m <= 0)
+        return -EX_IOERR;
+      int ret = dataq_write_all(fd, buf, m);
+      if (ret < 0)
+        return ret;
+      left -= m;
+    }
+  }
+  return n;
+}
+#endif
+
+// Capture the raw stream from a connected, streaming device to fd until the
+// stop handle (may be NULL) is signalled or the device goes away, writing
+// index records to index_fd (or -1 for none) every 100 ms
+// The index starts with hdr, which should have format DATAQ_LOG_RAW
+// On success, returns EX_OK, with the total bytes captured in *total if non-NULL
+int dataq_capture(int sockfd, int fd, int index_fd,
+                  const struct dataq_log_header *hdr,
+                  const struct dataq_stop *stop, long long *total)
+{
+  uint64_t offset = 0;
+  int64_t next_index = 0;
+  int ret;
+
+  uint8_t *buf = malloc(CHUNK);
+  if (buf == NULL)
+    return -EX_OSERR;
+
+  if (index_fd >= 0 && (ret = dataq_write_all(index_fd, hdr, sizeof(*hdr))) < 0) {
+    free(buf);
+    return ret;
+  }
+
+  int pipefd[2] = { -1, -1 };
+  int use_splice = 0;
+#ifdef __linux__
+  if (pipe(pipefd) == 0) {
+    use_splice = 1;
+    fcntl(pipefd[1], F_SETPIPE_SZ, CHUNK);
+  }
+#endif
+
+  for (;;) {
+    if ((ret = wait_data(sockfd, stop)) <= 0)
+      break;
+
+    ssize_t n;
+#ifdef __linux__
+    if (use_splice) {
+      n = move_splice(sockfd, fd, pipefd, buf, &use_splice);
+      if (n == -2)
+        continue;
+      if (n < 0) {
+        ret = n;
+        break;
+      }
+    }
+    else
+#endif
+    {
+      n = recv(sockfd, buf, CHUNK, MSG_DONTWAIT);
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        continue;
+      if (n < 0) {
+        eprintf("Error reading from socket\n");
+        ret = -EX_IOERR;
+        break;
+      }
+      if (n > 0 && (ret = dataq_write_all(fd, buf, n)) < 0)
+        break;
+    }
+    if (n == 0) {
+      eprintf("EOF reading from socket\n");
+      ret = -EX_UNAVAILABLE;
+      break;
+    }
+    offset += n;
+
+    // Note when we got this far, now and then
+    const int64_t t = now_ns();
+    if (index_fd >= 0 && t >= next_index) {
+      const struct dataq_index_record rec = {.t_ns = t,.offset = offset };
+      if ((ret = dataq_write_all(index_fd, &rec, sizeof(rec))) < 0)
+        break;
+      next_index = t + INDEX_NS;
+    }
+  }
+
+  // Always note where it ended
+  if (index_fd >= 0 && offset > 0) {
+    const struct dataq_index_record rec = {.t_ns = now_ns(),.offset = offset };
+    dataq_write_all(index_fd, &rec, sizeof(rec));
+  }
+
+  if (pipefd[0] >= 0) {
+    close(pipefd[0]);
+    close(pipefd[1]);
+  }
+  free(buf);
+  if (total != NULL)
+    *total = offset;
+
+  return ret < 0 ? ret : EX_OK;
+}
@@ -0,0 +1,143 @@
+/* Scan timestamps derived from the device's sample clock
+ *
+ * Scans come off the device at a fixed rate, but arrive in bursts at the
+ * mercy of TCP and the scheduler, so timestamping each one as it's parsed
+ * records network jitter rather than when it was sampled.  Instead, number
+ * the scans and put them on a straight line, t(k) = t_anchor + k * period,
+ * reading the system clock just once per batch to keep the line honest.
+ *
+ * The arrival time of a batch is never earlier than the sample time of its
+ * last scan, so the batches with the least lag trace out the true sample
+ * clock plus the best-case latency.  Once per window the least-lagged arrival
+ * is compared against the first one to estimate the real scan period, and
+ * the line is steered (by slope only, so timestamps stay continuous and
+ * monotonic) to converge onto that estimate over the next window.
+ */
+
+#include <stdio.h>
+#include <sysexits.h>
+#include <time.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include "dataq.h"
+#include "dataq_private.h"
+
+#define BASE_HZ 14400.0     // Main timer of the DI-718B
+#define WINDOW_SEC 1.0      // How often to correct for drift
+#define MIN_WINDOW 64       // Scans per correction, at the least
+#define RATE_TOLERANCE 0.05 // Beyond this, warn that the nominal rate is off
+
+// Nominal scan period in seconds, for the given timer settings (X and M
+// commands), assuming the base rate is shared between the scanned channels
+double dataq_scan_period(const int timerscaler, const int rate_divisor,
+                         const int n_chans)
+{
+  const int x = timerscaler > 0 ? timerscaler : 1;
+  return (double) x * (rate_divisor + 1) * n_chans / BASE_HZ;
+}
+
+static int64_t now_ns(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Time of scan k on the line currently in use
+static int64_t line_ns(const struct dataq_clock *clk, long long k)
+{
+  return clk->t_anchor + (int64_t) llround((k - clk->k_anchor) * clk->period);
+}
+
+// Start timestamping a new stream from clock (CLOCK_REALTIME or
+// CLOCK_MONOTONIC), with scans nominally period seconds apart
+void dataq_clock_init(struct dataq_clock *clk, clockid_t clock, double period)
+{
+  clk->clock = clock;
+  clk->nominal = period * 1e9;
+  clk->period = clk->nominal;
+  clk->window = WINDOW_SEC / period;
+  if (clk->window < MIN_WINDOW)
+    clk->window = MIN_WINDOW;
+  clk->count = 0;
+  clk->started = 0;
+  clk->have_ref = 0;
+  clk->warned = 0;
+}
+
+// Account for scans that were lost (e.g. while resynchronizing), so later
+// scans are still stamped at their proper place on the line
+void dataq_clock_skip(struct dataq_clock *clk, const long long n_scans)
+{
+  clk->count += n_scans;
+}
+
+// Fill in tv[] for a batch of n_scans scans that has just arrived
+void dataq_clock_stamp(struct dataq_clock *clk, const int n_scans,
+                       struct timeval tv[])
+{
+  const int64_t now = now_ns(clk->clock);
+  const long long last = clk->count + n_scans - 1;
+
+  // First batch: assume the last scan was sampled just now
+  if (!clk->started) {
+    clk->started = 1;
+    clk->k_anchor = last;
+    clk->t_anchor = now;
+    clk->win_start = 0;
+    clk->best_lag = INT64_MAX;
+  }
+
+  // Keep track of the least-lagged arrival in this window
+  int64_t lag = now - line_ns(clk, last);
+  if (lag < clk->best_lag) {
+    clk->best_lag = lag;
+    clk->best_k = last;
+    clk->best_t = now;
+  }
+
+  int i;
+  for (i = 0; i < n_scans; i++) {
+    int64_t t = line_ns(clk, clk->count + i);
+    tv[i].tv_sec = t / 1000000000;
+    tv[i].tv_usec = (t % 1000000000) / 1000;
+  }
+  clk->count += n_scans;
+
+  if (clk->count - clk->win_start < clk->window)
+    return;
+
+  // End of a window: the first one becomes the reference point, after which
+  // each one gives an estimate of the period over a longer and longer baseline
+  if (!clk->have_ref) {
+    clk->have_ref = 1;
+    clk->ref_k = clk->best_k;
+    clk->ref_t = clk->best_t;
+  }
+  else if (clk->best_k > clk->ref_k) {
+    double estimate = (double) (clk->best_t - clk->ref_t) / (clk->best_k - clk->ref_k);
+    if (fabs(estimate / clk->nominal - 1) > RATE_TOLERANCE && !clk->warned) {
+      eprintf("Scan rate %.1f Hz differs from nominal %.1f Hz\n",
+              1e9 / estimate, 1e9 / clk->nominal);
+      clk->warned = 1;
+    }
+
+    // Steer to meet the estimated line by the end of the next window
+    const long long next = clk->count + clk->window;
+    const int64_t here = line_ns(clk, clk->count);
+    const double target = clk->ref_t + (next - clk->ref_k) * estimate;
+    double period = (target - here) / clk->window;
+    if (period < estimate / 2)
+      period = estimate / 2;
+    if (period > estimate * 2)
+      period = estimate * 2;
+
+    clk->k_anchor = clk->count;
+    clk->t_anchor = here;
+    clk->period = period;
+  }
+
+  clk->win_start = clk->count;
+  clk->best_lag = INT64_MAX;
+}
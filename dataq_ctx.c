@@ -0,0 +1,156 @@
+/* Device contexts: everything needed to read one device, in one handle
+ *
+ * A struct dataq_ctx owns a device's connection, its channel configuration
+ * (scan list, full scale and fudge factors, as conversion tables, and any
+ * filters), its receive buffers and its statistics.  Nothing is shared between contexts, and
+ * receives are cancelled with the context's own stop handle rather than by
+ * trapping signals, so each device can be read from its own thread.
+ *
+ * A context is used by one thread at a time (apart from dataq_ctx_stop(),
+ * which is safe from anywhere, signal handlers included).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+#include "dataq.h"
+#include "dataq_private.h"
+
+struct dataq_ctx {
+  int sockfd;
+  int timerscaler, rate_divisor;
+  char *scanlist;
+  struct dataq_conv conv;
+  struct dataq_filter *filter;
+  struct dataq_stop stop;
+  struct dataq_rx rx;
+  float values[DATAQ_RXBUF];  // For callers that only want codes
+  unsigned long long scans;
+  unsigned long long batches;
+};
+
+// Connect to and start the device described by config, ready to receive
+int dataq_ctx_open(struct dataq_ctx **ctxp,
+                   const struct dataq_ctx_config *config)
+{
+  struct dataq_ctx *ctx = calloc(1, sizeof(*ctx));
+  if (ctx == NULL)
+    return -EX_OSERR;
+  ctx->sockfd = -1;
+  ctx->stop.fds[0] = ctx->stop.fds[1] = -1;
+  ctx->timerscaler = config->timerscaler;
+  ctx->rate_divisor = config->rate_divisor;
+  ctx->scanlist = strdup(config->scanlist);
+
+  int ret = -EX_OSERR;
+  if (ctx->scanlist == NULL)
+    goto fail;
+  if ((ret = dataq_conv_init(&ctx->conv, config->n_chans, config->fullscale,
+                             config->fudge, NULL)) < 0)
+    goto fail;
+  if (config->filter != NULL
+      && (ret = dataq_filter_open(&ctx->filter, config->n_chans, config->filter,
+                                  1 / dataq_scan_period(ctx->timerscaler,
+                                                        ctx->rate_divisor,
+                                                        config->n_chans))) < 0)
+    goto fail;
+  if ((ret = dataq_stop_init(&ctx->stop)) < 0)
+    goto fail;
+
+  ctx->sockfd = dataq_connect_opts(config->hostname, config->portno,
+                                   ctx->timerscaler, ctx->rate_divisor,
+                                   ctx->scanlist, config->n_chans,
+                                   &config->sock);
+  if ((ret = ctx->sockfd) < 0)
+    goto fail;
+  dataq_rx_init(&ctx->rx, ctx->sockfd, &ctx->conv);
+  ctx->rx.stop = &ctx->stop;
+  ctx->rx.timestamping = config->sock.timestamping;
+
+  *ctxp = ctx;
+  return EX_OK;
+
+fail:
+  dataq_ctx_close(ctx);
+  return ret;
+}
+
+// Receive as many whole scans as are ready, up to max_scans, as
+// dataq_recv_batch(), into values[] and/or codes[] (either may be NULL);
+// values are filtered, if the config said so, codes not
+// Returns the number of scans, or -EX_UNAVAILABLE once dataq_ctx_stop()ped
+int dataq_ctx_recv(struct dataq_ctx *ctx, float values[], uint16_t codes[],
+                   const int max_scans, struct timeval *tv)
+{
+  const int n_chans = ctx->conv.n_chans;
+  int limit = max_scans;
+  if (values == NULL && limit > DATAQ_RXBUF / n_chans)
+    limit = DATAQ_RXBUF / n_chans;
+
+  float *dst = values ? values : ctx->values;
+  int ret = dataq_recv_batch(&ctx->rx, dst, limit, tv);
+  if (ret < 0)
+    return ret;
+  if (ctx->filter != NULL)
+    dataq_filter_run(ctx->filter, dst, ret);
+
+  if (codes != NULL)
+    memcpy(codes, ctx->rx.codes, ret * n_chans * sizeof(uint16_t));
+  ctx->scans += ret;
+  ctx->batches++;
+  return ret;
+}
+
+// The context's conversion, e.g. for dataq_log_header_init()
+const struct dataq_conv *dataq_ctx_conv(const struct dataq_ctx *ctx)
+{
+  return &ctx->conv;
+}
+
+// Fill in a log header for what the context is acquiring
+void dataq_ctx_log_header(const struct dataq_ctx *ctx,
+                          const enum dataq_log_format format,
+                          struct dataq_log_header *hdr)
+{
+  dataq_log_header_init(hdr, format, &ctx->conv, ctx->timerscaler,
+                        ctx->rate_divisor, ctx->scanlist);
+}
+
+// The device's socket, e.g. to poll() for it
+int dataq_ctx_fd(const struct dataq_ctx *ctx)
+{
+  return ctx->sockfd;
+}
+
+void dataq_ctx_stats(const struct dataq_ctx *ctx, struct dataq_ctx_stats *stats)
+{
+  stats->scans = ctx->scans;
+  stats->batches = ctx->batches;
+  stats->resyncs = ctx->rx.resyncs;
+  stats->skipped = ctx->rx.skipped;
+}
+
+// Cancel a dataq_ctx_recv() in progress, and any after it
+// NOTE async-signal-safe, so may be called from a signal handler
+void dataq_ctx_stop(struct dataq_ctx *ctx)
+{
+  dataq_stop_signal(&ctx->stop);
+}
+
+// Stop the device streaming, disconnect and free the context
+void dataq_ctx_close(struct dataq_ctx *ctx)
+{
+  if (ctx->sockfd >= 0)
+    dataq_close_period(ctx->sockfd, dataq_scan_period(ctx->timerscaler,
+                                                      ctx->rate_divisor,
+                                                      ctx->conv.n_chans));
+  if (ctx->stop.fds[0] >= 0)
+    dataq_stop_close(&ctx->stop);
+  if (ctx->filter != NULL)
+    dataq_filter_close(ctx->filter);
+  dataq_conv_free(&ctx->conv);
+  free(ctx->scanlist);
+  free(ctx);
+}
@@ -0,0 +1,208 @@
+/* Decimation: reduced-rate means and min/max envelopes, as scans arrive
+ *
+ * Each level reduces every factor scans to one point per channel, holding
+ * their mean, minimum and maximum, so that a plot at that resolution still
+ * shows every spike.  The levels form a pyramid: each factor is a multiple of
+ * the one before, and each level is built from the points of the level below
+ * rather than the scans themselves, so only the first level touches every
+ * scan, and adding levels costs next to nothing.
+ *
+ * Points go to a callback as they complete.  A gap in the scans (or the end)
+ * should be marked with dataq_decim_flush(), which hands over whatever each
+ * level has so far as a short point, so none straddle the gap.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+#include "dataq.h"
+#include "dataq_private.h"
+
+struct level {
+  int factor;            // Scans per point
+  int ratio;             // Inputs per point: points of the level below, or scans
+  int parts;             // Inputs so far...
+  int count;             // ...and the scans they cover
+  int64_t t_ns;          // First scan's timestamp
+  double *sum;           // n_chans each
+  float *min, *max, *mean;
+};
+
+struct dataq_decim {
+  int n_chans;
+  int n_levels;
+  struct level levels[DATAQ_DECIM_LEVELS];
+  dataq_decim_fn fn;
+  void *arg;
+  double *sums;          // Storage behind the levels' arrays
+  float *floats;
+};
+
+static int64_t tv_ns(const struct timeval *tv)
+{
+  return (int64_t) tv->tv_sec * 1000000000 + (int64_t) tv->tv_usec * 1000;
+}
+
+// Set up to decimate scans of n_chans channels by each of factors[] (at most
+// DATAQ_DECIM_LEVELS, increasing, each a multiple of the one before), handing
+// the points to fn, with arg
+int dataq_decim_open(struct dataq_decim **dp, const int n_chans,
+                     const int factors[], const int n_levels,
+                     dataq_decim_fn fn, void *arg)
+{
+  if (n_chans < 1 || n_chans > DATAQ_MAXCHAN || n_levels < 1
+      || n_levels > DATAQ_DECIM_LEVELS || factors[0] < 1)
+    return -EX_DATAERR;
+  int l;
+  for (l = 1; l < n_levels; l++)
+    if (factors[l] <= factors[l - 1] || factors[l] % factors[l - 1])
+      return -EX_DATAERR;
+
+  struct dataq_decim *d = calloc(1, sizeof(*d));
+  if (d == NULL)
+    return -EX_OSERR;
+  d->sums = malloc(n_levels * n_chans * sizeof(double));
+  d->floats = malloc(3 * n_levels * n_chans * sizeof(float));
+  if (d->sums == NULL || d->floats == NULL) {
+    dataq_decim_close(d);
+    return -EX_OSERR;
+  }
+
+  d->n_chans = n_chans;
+  d->n_levels = n_levels;
+  d->fn = fn;
+  d->arg = arg;
+  for (l = 0; l < n_levels; l++) {
+    struct level *lv = &d->levels[l];
+    lv->factor = factors[l];
+    lv->ratio = l ? factors[l] / factors[l - 1] : factors[0];
+    lv->sum = &d->sums[l * n_chans];
+    lv->min = &d->floats[3 * l * n_chans];
+    lv->max = lv->min + n_chans;
+    lv->mean = lv->max + n_chans;
+  }
+
+  *dp = d;
+  return EX_OK;
+}
+
+// Hand over level l's point, and fold it into the level above
+static int emit(struct dataq_decim *d, const int l)
+{
+  struct level *lv = &d->levels[l];
+  const int n_chans = d->n_chans;
+  int c;
+  for (c = 0; c < n_chans; c++)
+    lv->mean[c] = lv->sum[c] / lv->count;
+
+  const struct dataq_decim_point pt = {
+    .level = l,
+    .factor = lv->factor,
+    .n = lv->count,
+    .n_chans = n_chans,
+    .t_ns = lv->t_ns,
+    .mean = lv->mean,
+    .min = lv->min,
+    .max = lv->max,
+  };
+  int ret = d->fn ? d->fn(d->arg, &pt) : 0;
+
+  if (l + 1 < d->n_levels) {
+    struct level *up = &d->levels[l + 1];
+    if (up->parts == 0) {
+      up->t_ns = lv->t_ns;
+      memcpy(up->sum, lv->sum, n_chans * sizeof(double));
+      memcpy(up->min, lv->min, n_chans * sizeof(float));
+      memcpy(up->max, lv->max, n_chans * sizeof(float));
+    }
+    else
+      for (c = 0; c < n_chans; c++) {
+        up->sum[c] += lv->sum[c];
+        up->min[c] = lv->min[c] < up->min[c] ? lv->min[c] : up->min[c];
+        up->max[c] = lv->max[c] > up->max[c] ? lv->max[c] : up->max[c];
+      }
+    up->count += lv->count;
+    up->parts++;
+  }
+  lv->parts = lv->count = 0;
+
+  // Even if the callback failed, or the level above is left unable to finish
+  if (l + 1 < d->n_levels && d->levels[l + 1].parts == d->levels[l + 1].ratio) {
+    const int up_ret = emit(d, l + 1);
+    if (ret == 0)
+      ret = up_ret;
+  }
+  return ret;
+}
+
+// Take n_scans scans of values[], interleaved, with their timestamps tv[]
+// Returns 0, or whatever nonzero the callback returned
+int dataq_decim_push(struct dataq_decim *d, const float values[],
+                     const struct timeval tv[], const int n_scans)
+{
+  struct level *lv = &d->levels[0];
+  const int n_chans = d->n_chans;
+  int s = 0;
+
+  while (s < n_scans) {
+    // As many scans as finish this point, a channel at a time
+    int run = lv->ratio - lv->parts;
+    if (run > n_scans - s)
+      run = n_scans - s;
+    const float *v = &values[(size_t) s * n_chans];
+    int c, i = 0;
+    if (lv->parts == 0) {
+      lv->t_ns = tv_ns(&tv[s]);
+      for (c = 0; c < n_chans; c++)
+        lv->sum[c] = lv->min[c] = lv->max[c] = v[c];
+      i = 1;
+    }
+    for (c = 0; c < n_chans; c++) {
+      double sum = lv->sum[c];
+      float lo = lv->min[c], hi = lv->max[c];
+      int k;
+      for (k = i; k < run; k++) {
+        const float x = v[(size_t) k * n_chans + c];
+        sum += x;
+        lo = x < lo ? x : lo;
+        hi = x > hi ? x : hi;
+      }
+      lv->sum[c] = sum;
+      lv->min[c] = lo;
+      lv->max[c] = hi;
+    }
+    lv->parts += run;
+    lv->count += run;
+    s += run;
+
+    if (lv->parts == lv->ratio) {
+      int ret = emit(d, 0);
+      if (ret)
+        return ret;
+    }
+  }
+  return 0;
+}
+
+// Hand over every level's point so far, however few scans it has; for gaps,
+// and at the end
+int dataq_decim_flush(struct dataq_decim *d)
+{
+  int l, ret = 0;
+  for (l = 0; l < d->n_levels; l++)
+    if (d->levels[l].count > 0) {
+      const int l_ret = emit(d, l);
+      if (ret == 0)
+        ret = l_ret;
+    }
+  return ret;
+}
+
+void dataq_decim_close(struct dataq_decim *d)
+{
+  free(d->sums);
+  free(d->floats);
+  free(d);
+}
@@ -0,0 +1,237 @@
+/* Block decoding of DATAQ sample words: sync flag validation and 14-bit unpacking
+ *
+ * Each word carries one 14-bit sample split around two sync bits: bit 8 is
+ * always set, and bit 0 is clear for the first channel of a scan and set for
+ * the others.  Checking and unpacking are the same for every word bar that one
+ * bit, so blocks of scans are processed with SIMD where the CPU has it.
+ *
+ * Kernels are picked at runtime: AVX2 if the CPU supports it, else SSE2, on
+ * x86; NEON on AArch64; otherwise (or if asked) the scalar loop.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sysexits.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+  #include <immintrin.h>
+  #define HAVE_X86 1
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+  #include <arm_neon.h>
+  #define HAVE_NEON 1
+#endif
+
+#include "dataq.h"
+
+#define VEC_WORDS 16  // Words per iteration of the widest kernel
+
+typedef size_t (*decode_fn)(const uint16_t words[], uint16_t codes[],
+                            size_t n_words, const uint16_t pattern[], int period);
+
+// Build the repeating sync pattern for a scan of n_chans, with VEC_WORDS of
+// overhang so a vector can be loaded from any phase
+static void make_pattern(uint16_t pattern[], int n_chans)
+{
+  int i;
+  for (i = 0; i < n_chans + VEC_WORDS; i++)
+    pattern[i] = (i % n_chans) ? 0x0101 : 0x0100;
+}
+
+static inline uint16_t code14(uint16_t v)
+{
+  return ((v & 0xFE00) >> 2) | ((v & 0x00FE) >> 1);
+}
+
+// Check and unpack words from i onwards, starting at the given pattern phase
+static size_t decode_tail(const uint16_t words[], uint16_t codes[], size_t i,
+                          size_t n_words, const uint16_t pattern[], int period,
+                          int phase)
+{
+  for (; i < n_words; i++) {
+    if ((words[i] & 0x0101) != pattern[phase])
+      return i;
+    codes[i] = code14(words[i]);
+    if (++phase == period)
+      phase = 0;
+  }
+  return n_words;
+}
+
+// Scalar kernel; the vector kernels also finish off with decode_tail()
+static size_t decode_scalar(const uint16_t words[], uint16_t codes[],
+                            size_t n_words, const uint16_t pattern[], int period)
+{
+  return decode_tail(words, codes, 0, n_words, pattern, period, 0);
+}
+
+#ifdef HAVE_X86
+
+__attribute__((target("sse2")))
+static size_t decode_sse2(const uint16_t words[], uint16_t codes[],
+                          size_t n_words, const uint16_t pattern[], int period)
+{
+  const __m128i sync = _mm_set1_epi16(0x0101);
+  const __m128i hi = _mm_set1_epi16((short) 0xFE00);
+  const __m128i lo = _mm_set1_epi16(0x00FE);
+  size_t i = 0;
+  int phase = 0;
+
+  for (; i + 8 <= n_words; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i *) &words[i]);
+    __m128i want = _mm_loadu_si128((const __m128i *) &pattern[phase]);
+    __m128i ok = _mm_cmpeq_epi16(_mm_and_si128(v, sync), want);
+    if (_mm_movemask_epi8(ok) != 0xFFFF)
+      break;
+
+    __m128i code = _mm_or_si128(_mm_srli_epi16(_mm_and_si128(v, hi), 2),
+                                _mm_srli_epi16(_mm_and_si128(v, lo), 1));
+    _mm_storeu_si128((__m128i *) &codes[i], code);
+
+    phase += 8;
+    while (phase >= period)
+      phase -= period;
+  }
+  return decode_tail(words, codes, i, n_words, pattern, period, phase);
+}
+
+__attribute__((target("avx2")))
+static size_t decode_avx2(const uint16_t words[], uint16_t codes[],
+                          size_t n_words, const uint16_t pattern[], int period)
+{
+  const __m256i sync = _mm256_set1_epi16(0x0101);
+  const __m256i hi = _mm256_set1_epi16((short) 0xFE00);
+  const __m256i lo = _mm256_set1_epi16(0x00FE);
+  size_t i = 0;
+  int phase = 0;
+
+  for (; i + 16 <= n_words; i += 16) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) &words[i]);
+    __m256i want = _mm256_loadu_si256((const __m256i *) &pattern[phase]);
+    __m256i ok = _mm256_cmpeq_epi16(_mm256_and_si256(v, sync), want);
+    if (_mm256_movemask_epi8(ok) != -1)
+      break;
+
+    __m256i code = _mm256_or_si256(_mm256_srli_epi16(_mm256_and_si256(v, hi), 2),
+                                   _mm256_srli_epi16(_mm256_and_si256(v, lo), 1));
+    _mm256_storeu_si256((__m256i *) &codes[i], code);
+
+    phase += 16;
+    while (phase >= period)
+      phase -= period;
+  }
+  return decode_tail(words, codes, i, n_words, pattern, period, phase);
+}
+
+#endif // HAVE_X86
+
+#ifdef HAVE_NEON
+
+static size_t decode_neon(const uint16_t words[], uint16_t codes[],
+                          size_t n_words, const uint16_t pattern[], int period)
+{
+  const uint16x8_t sync = vdupq_n_u16(0x0101);
+  const uint16x8_t hi = vdupq_n_u16(0xFE00);
+  const uint16x8_t lo = vdupq_n_u16(0x00FE);
+  size_t i = 0;
+  int phase = 0;
+
+  for (; i + 8 <= n_words; i += 8) {
+    uint16x8_t v = vld1q_u16(&words[i]);
+    uint16x8_t want = vld1q_u16(&pattern[phase]);
+    uint16x8_t ok = vceqq_u16(vandq_u16(v, sync), want);
+    if (vminvq_u16(ok) != 0xFFFF)
+      break;
+
+    uint16x8_t code = vorrq_u16(vshrq_n_u16(vandq_u16(v, hi), 2),
+                                vshrq_n_u16(vandq_u16(v, lo), 1));
+    vst1q_u16(&codes[i], code);
+
+    phase += 8;
+    while (phase >= period)
+      phase -= period;
+  }
+  return decode_tail(words, codes, i, n_words, pattern, period, phase);
+}
+
+#endif // HAVE_NEON
+
+/*
+ *  Kernel selection
+ */
+
+static const struct {
+  const char *name;
+  decode_fn fn;
+} kernels[] = {
+#ifdef HAVE_X86
+  { "avx2", decode_avx2 },
+  { "sse2", decode_sse2 },
+#endif
+#ifdef HAVE_NEON
+  { "neon", decode_neon },
+#endif
+  { "scalar", decode_scalar },
+};
+#define N_KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+static int supported(const char *name)
+{
+#ifdef HAVE_X86
+  __builtin_cpu_init();
+  if (!strcmp(name, "avx2"))
+    return __builtin_cpu_supports("avx2");
+  if (!strcmp(name, "sse2"))
+    return __builtin_cpu_supports("sse2");
+#endif
+  return 1;
+}
+
+static size_t kernel;  // Index into kernels[]
+
+// Pick the fastest kernel this CPU supports, once at startup
+__attribute__((constructor))
+static void pick_kernel(void)
+{
+  size_t k;
+  for (k = 0; k < N_KERNELS; k++)
+    if (supported(kernels[k].name))
+      break;
+  kernel = k;
+}
+
+// Name of the decode kernel in use
+const char *dataq_decode_kernel(void)
+{
+  return kernels[kernel].name;
+}
+
+// Force a particular decode kernel by name (e.g. for benchmarking)
+// Returns -EX_UNAVAILABLE if not built in or not supported by this CPU
+int dataq_decode_select(const char *name)
+{
+  size_t k;
+  for (k = 0; k < N_KERNELS; k++)
+    if (!strcmp(kernels[k].name, name) && supported(name)) {
+      kernel = k;
+      return EX_OK;
+    }
+  return -EX_UNAVAILABLE;
+}
+
+// Check sync flags and extract the 14-bit codes for a block of whole scans
+// words[] and codes[] are n_scans * n_chans long; they may be the same array
+// Returns the offset of the first word with bad sync flags (codes[] is valid
+// up to there), or n_scans * n_chans if all are good
+size_t dataq_decode(const uint16_t words[], uint16_t codes[],
+                    const size_t n_scans, const int n_chans)
+{
+  uint16_t pattern[DATAQ_MAXCHAN + VEC_WORDS];
+
+  if (n_chans < 1 || n_chans > DATAQ_MAXCHAN)
+    return 0;
+  make_pattern(pattern, n_chans);
+
+  return kernels[kernel].fn(words, codes, n_scans * n_chans, pattern, n_chans);
+}
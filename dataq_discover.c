@@ -0,0 +1,263 @@
+/* Finding DATAQ units on the local network
+ *
+ * The DI-718B's Ethernet interface is a Lantronix device server, which
+ * answers the Lantronix discovery protocol: a 4-byte query (00 00 00 F6)
+ * broadcast to UDP port 30718 gets a reply (00 00 00 F7 ...) carrying the
+ * unit's MAC address, and the reply's source address is the unit's IP.
+ * DATAQ's units have MAC addresses starting 00:80:A3 (Lantronix's OUI).
+ *
+ * The query goes out on every IPv4 interface's broadcast address at once,
+ * and replies are gathered from all of them until a deadline.  Since units
+ * rarely move, what's found is cached in a file so the next startup can skip
+ * most of the wait: the cached units are queried directly, and only if they
+ * all answer is the list trusted without a broadcast.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+
+#include "dataq.h"
+#include "dataq_private.h"
+
+#define DISCOVERY_PORT 30718
+#define QUERY_REPEAT_MS 250        // Resend the query this often, in case of loss
+#define CACHE_MAX_AGE (24 * 3600)  // Seconds a cache file is trusted for
+#define MAC_OFFSET 24              // Where the MAC address is in a reply
+#define VERIFY_MS 300              // How long cached units get to answer
+
+static const uint8_t query[4] = { 0x00, 0x00, 0x00, 0xF6 };
+static const uint8_t dataq_oui[3] = { 0x00, 0x80, 0xA3 };
+
+static int64_t ms_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Send the query to each of targets[], or if there are none, to every
+// interface's broadcast address (and the all-ones one)
+static void send_queries(int sockfd, const struct dataq_unit targets[],
+                         const int n_targets)
+{
+  struct sockaddr_in to = {.sin_family = AF_INET,.sin_port = htons(DISCOVERY_PORT) };
+  int t;
+  for (t = 0; t < n_targets; t++)
+    if (inet_pton(AF_INET, targets[t].addr, &to.sin_addr) == 1)
+      sendto(sockfd, query, sizeof(query), 0, (struct sockaddr *) &to, sizeof(to));
+  if (n_targets > 0)
+    return;
+
+  to.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+  sendto(sockfd, query, sizeof(query), 0, (struct sockaddr *) &to, sizeof(to));
+
+  struct ifaddrs *ifs, *i;
+  if (getifaddrs(&ifs) == -1)
+    return;
+  for (i = ifs; i != NULL; i = i->ifa_next) {
+    if (i->ifa_addr == NULL || i->ifa_addr->sa_family != AF_INET
+        || !(i->ifa_flags & IFF_UP) || !(i->ifa_flags & IFF_BROADCAST)
+        || i->ifa_broadaddr == NULL)
+      continue;
+    memcpy(&to.sin_addr, &((struct sockaddr_in *) i->ifa_broadaddr)->sin_addr,
+           sizeof(to.sin_addr));
+    if (sendto(sockfd, query, sizeof(query), 0, (struct sockaddr *) &to, sizeof(to)) == -1)
+      dprintf("Can't query on %s: %s\n", i->ifa_name, strerror(errno));
+  }
+  freeifaddrs(ifs);
+}
+
+// Add a unit to the list, unless it's already there
+static int add_unit(struct dataq_unit units[], int n_units, const int max_units,
+                    const char *addr, const uint8_t mac[6])
+{
+  int u;
+  for (u = 0; u < n_units; u++)
+    if (!memcmp(units[u].mac, mac, 6))
+      return n_units;
+  if (n_units == max_units)
+    return n_units;
+
+  snprintf(units[n_units].addr, sizeof(units[n_units].addr), "%s", addr);
+  memcpy(units[n_units].mac, mac, 6);
+  dprintf("Found unit %02X:%02X:%02X:%02X:%02X:%02X at %s\n",
+          mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], addr);
+  return n_units + 1;
+}
+
+// Broadcast the query (or send it to each of targets[]) and gather replies
+// for timeout_ms, or until every target has answered
+static int probe(struct dataq_unit units[], const int max_units,
+                 const int timeout_ms, const struct dataq_unit targets[],
+                 const int n_targets)
+{
+  int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sockfd < 0) {
+    eprintf("Error creating discovery socket\n");
+    return -EX_OSERR;
+  }
+  const int on = 1;
+  if (setsockopt(sockfd, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on)) == -1) {
+    eprintf("Error enabling broadcast\n");
+    close(sockfd);
+    return -EX_OSERR;
+  }
+
+  const int64_t deadline = ms_now() + timeout_ms;
+  int64_t next_query = 0;
+  int n_units = 0;
+
+  for (;;) {
+    int64_t now = ms_now();
+    if (now >= deadline || (n_targets > 0 && n_units == n_targets))
+      break;
+    if (now >= next_query) {
+      send_queries(sockfd, targets, n_targets);
+      next_query = now + QUERY_REPEAT_MS;
+    }
+
+    int wait = (next_query < deadline ? next_query : deadline) - now;
+    struct pollfd pfd = {.fd = sockfd,.events = POLLIN };
+    if (poll(&pfd, 1, wait) <= 0)
+      continue;
+
+    uint8_t reply[512];
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof(from);
+    ssize_t n = recvfrom(sockfd, reply, sizeof(reply), MSG_DONTWAIT,
+                         (struct sockaddr *) &from, &from_len);
+    if (n < MAC_OFFSET + 6 || memcmp(reply, "\0\0\0\xF7", 4))
+      continue;  // Not a discovery reply (or our own query, looped back)
+
+    const uint8_t *mac = &reply[MAC_OFFSET];
+    if (memcmp(mac, dataq_oui, sizeof(dataq_oui)))
+      continue;  // Some other Lantronix device
+
+    char addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &from.sin_addr, addr, sizeof(addr));
+    n_units = add_unit(units, n_units, max_units, addr, mac);
+  }
+
+  close(sockfd);
+  return n_units;
+}
+
+// Read units from a cache file, if it's recent enough
+static int load_cache(const char *path, struct dataq_unit units[],
+                      const int max_units)
+{
+  struct stat st;
+  if (stat(path, &st) == -1 || time(NULL) - st.st_mtime > CACHE_MAX_AGE)
+    return 0;
+
+  FILE *f = fopen(path, "r");
+  if (f == NULL)
+    return 0;
+
+  int n_units = 0;
+  char addr[INET6_ADDRSTRLEN];
+  unsigned int m[6];
+  while (n_units < max_units
+         && fscanf(f, "%45s %x:%x:%x:%x:%x:%x", addr,
+                   &m[0], &m[1], &m[2], &m[3], &m[4], &m[5]) == 7) {
+    const uint8_t mac[6] = { m[0], m[1], m[2], m[3], m[4], m[5] };
+    n_units = add_unit(units, n_units, max_units, addr, mac);
+  }
+  fclose(f);
+  return n_units;
+}
+
+static void save_cache(const char *path, const struct dataq_unit units[],
+                       const int n_units)
+{
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    dprintf("Can't write discovery cache %s: %s\n", path, strerror(errno));
+    return;
+  }
+  int u;
+  for (u = 0; u < n_units; u++) {
+    const uint8_t *mac = units[u].mac;
+    fprintf(f, "%s %02X:%02X:%02X:%02X:%02X:%02X\n", units[u].addr,
+            mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+  }
+  fclose(f);
+}
+
+// Find the DATAQ units on the local network, waiting timeout_ms for replies
+// If cache isn't NULL, it names a file of units found before: if that is less
+// than a day old, lists any, and they all still answer, they're used without
+// a broadcast; otherwise, whatever the broadcast finds is written there
+// (unless it filled units[], and so may not be all of them)
+// Returns how many units were filled in to units[], up to max_units
+int dataq_discover(struct dataq_unit units[], const int max_units,
+                   const int timeout_ms, const char *cache)
+{
+  static struct dataq_unit cached[DATAQ_MAX_UNITS];
+  int n_units, n_cached;
+  if (cache != NULL && (n_cached = load_cache(cache, cached, DATAQ_MAX_UNITS)) > 0) {
+    n_units = probe(units, max_units, VERIFY_MS, cached,
+                    n_cached < max_units ? n_cached : max_units);
+    if (n_units > 0 && n_units == (n_cached < max_units ? n_cached : max_units)) {
+      dprintf("Using %d units from %s\n", n_units, cache);
+      return n_units;
+    }
+    dprintf("Not all the units in %s answered, looking again\n", cache);
+  }
+
+  n_units = probe(units, max_units, timeout_ms, NULL, 0);
+  if (n_units > 0 && n_units < max_units && cache != NULL)
+    save_cache(cache, units, n_units);
+  if (n_units == 0)
+    eprintf("No DATAQ units answered discovery.\n"
+            "If you're at Kitty Hawk, just specify 'di718b' as the hostname and let the DHCP\n"
+            "server do the work.  Otherwise, you can use the 'DATAQ Instruments Hardware Manager'\n"
+            "utility provided with WinDAQ, or check your DHCP logs for MAC addresses starting with\n"
+            "00:80:A3.\n");
+  return n_units;
+}
+
+// Where dataq_autodiscover() caches what it finds:
+// $XDG_CACHE_HOME/dataq_units, or ~/.cache/dataq_units
+// Returns NULL if there's nowhere
+const char *dataq_discover_cache(void)
+{
+  static char path[PATH_MAX];
+  const char *dir = getenv("XDG_CACHE_HOME");
+  if (dir != NULL && *dir)
+    snprintf(path, sizeof(path), "%s/dataq_units", dir);
+  else if ((dir = getenv("HOME")) != NULL && *dir) {
+    snprintf(path, sizeof(path), "%s/.cache", dir);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/.cache/dataq_units", dir);
+  }
+  else
+    return NULL;
+  return path;
+}
+
+// Discover a DATAQ device
+// Returns the address of the first one found (in static storage), or NULL
+const char *dataq_autodiscover(void)
+{
+  // Looking for all of them, so as to cache the lot for dataq -a
+  static struct dataq_unit units[DATAQ_MAX_UNITS];
+  if (dataq_discover(units, DATAQ_MAX_UNITS, DATAQ_DISCOVER_MS,
+                     dataq_discover_cache()) > 0)
+    return units[0].addr;
+  return NULL;
+}
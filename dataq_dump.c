@@ -0,0 +1,359 @@
+/* Convert dataq recordings back to text, in the same format as dataq
+ *
+ * Usage: dataq_dump [OPTIONS] [FILE]  (reads stdin if no FILE)
+ *
+ * Binary logs are printed as they are, and stores (dataq -F store) likewise,
+ * or just the part in a time range (-t), or an overview from their index (-O).
+ * Raw captures (dataq -F raw) and pcap files of a session are replayed through
+ * the decoder, see dataq_replay.c; with -q only decoded, as a benchmark or a
+ * check of a capture.  Or with -l, it subscribes to a running dataq -P and
+ * prints the scans as they come.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+
+#include "dataq.h"
+
+static float fullscale = 0;   // 0: as recorded, if known
+static float fudge = 0;
+static int n_chans = 0;
+static int portno = 10001;
+static int quiet = 0;
+static int64_t from_ns = 0, to_ns = INT64_MAX;
+static int overview = 0;
+static const char *listen_src = NULL;
+
+static void print_scan(const int64_t t, const float values[], const int n)
+{
+  int c;
+  printf("%llu.%06llu", (unsigned long long int)(t / 1000000000),
+                        (unsigned long long int)(t % 1000000000 / 1000));
+  for (c = 0; c < n; c++)
+    printf(" %.3f", values[c]);
+  printf("\n");
+}
+
+static int dump_log(FILE *f)
+{
+  struct dataq_log_header hdr;
+  int ret = dataq_log_read_header(f, &hdr);
+  if (ret < 0)
+    return ret;
+
+  static float values[DATAQ_LOG_MAXBLOCK * DATAQ_MAXCHAN];
+  struct dataq_log_block blk;
+  while ((ret = dataq_log_read_block(f, &hdr, &blk, values)) > 0
+         || (ret == 0 && (blk.flags & DATAQ_LOG_GAP))) {
+    // Gaps as the tool prints them: start, end, and roughly how many scans lost
+    if (blk.flags & DATAQ_LOG_GAP) {
+      const int64_t end = blk.t_ns + llround(blk.period_ns);
+      long long lost = llround(blk.period_ns / (hdr.period * 1e9)) - 1;
+      printf("# gap %llu.%06llu %llu.%06llu %lld\n",
+             (unsigned long long int)(blk.t_ns / 1000000000),
+             (unsigned long long int)(blk.t_ns % 1000000000 / 1000),
+             (unsigned long long int)(end / 1000000000),
+             (unsigned long long int)(end % 1000000000 / 1000),
+             lost < 0 ? 0 : lost);
+      continue;
+    }
+
+    int s;
+    for (s = 0; s < ret; s++)
+      print_scan(blk.t_ns + llround(s * blk.period_ns), &values[s * hdr.n_chans],
+                 hdr.n_chans);
+  }
+  return ret;
+}
+
+static int64_t seconds_ns(const char *s, char **end)
+{
+  return llround(strtod(s, end) * 1e9);
+}
+
+static float value(const struct dataq_log_header *hdr, const int c, const uint16_t code)
+{
+  return hdr->gain[c] * (((1.0 * code) / (1 << 13)) - 1) + hdr->offset[c];
+}
+
+static int dump_store(const char *path)
+{
+  struct dataq_store *st;
+  int ret = dataq_store_open(&st, path);
+  if (ret < 0)
+    return ret;
+  const struct dataq_log_header *hdr = &dataq_store_header(st)->acq;
+  const int n = hdr->n_chans;
+  const long long n_chunks = dataq_store_chunks(st);
+
+  // Only the chunks that might be in range
+  long long k;
+  for (k = dataq_store_find(st, from_ns); k < n_chunks; k++) {
+    const struct dataq_store_chunk *ch = dataq_store_index(st, k);
+    if (ch->t_ns > to_ns)
+      break;
+    if (ch->flags & DATAQ_STORE_GAP)
+      printf("# gap %llu.%06llu %llu.%06llu %lld\n",
+             (unsigned long long int)(ch->gap_start_ns / 1000000000),
+             (unsigned long long int)(ch->gap_start_ns % 1000000000 / 1000),
+             (unsigned long long int)(ch->gap_end_ns / 1000000000),
+             (unsigned long long int)(ch->gap_end_ns % 1000000000 / 1000),
+             (long long int)ch->gap_lost);
+
+    int c, s;
+    if (overview) {
+      // A line per chunk: its start, and each channel's range
+      printf("%llu.%06llu %u", (unsigned long long int)(ch->t_ns / 1000000000),
+             (unsigned long long int)(ch->t_ns % 1000000000 / 1000), ch->n_scans);
+      for (c = 0; c < n; c++)
+        printf(" %.3f:%.3f", value(hdr, c, ch->min[c]), value(hdr, c, ch->max[c]));
+      printf("\n");
+      continue;
+    }
+
+    const uint16_t *cols[DATAQ_MAXCHAN];
+    for (c = 0; c < n; c++)
+      cols[c] = dataq_store_column(st, k, c);
+    for (s = 0; s < (int) ch->n_scans; s++) {
+      const int64_t t = ch->t_ns + llround(s * ch->period_ns);
+      if (t < from_ns || t > to_ns)
+        continue;
+      float values[DATAQ_MAXCHAN];
+      for (c = 0; c < n; c++)
+        values[c] = value(hdr, c, cols[c][s]);
+      print_scan(t, values, n);
+    }
+  }
+  return dataq_store_close(st);
+}
+
+static int replay(const char *path)
+{
+  struct dataq_replay *r;
+  int ret = dataq_replay_open(&r, path, portno);
+  if (ret < 0)
+    return ret;
+
+  // Conversion as recorded unless told otherwise
+  const struct dataq_log_header *hdr = dataq_replay_header(r);
+  const int known = hdr->n_chans > 0 && hdr->gain[0] != 0;
+  if (n_chans == 0)
+    n_chans = hdr->n_chans;
+  if (n_chans < 1 || n_chans > DATAQ_MAXCHAN) {
+    fprintf(stderr, "Don't know how many channels are in %s; give -c\n", path);
+    dataq_replay_close(r);
+    return -EX_USAGE;
+  }
+  float gain[DATAQ_MAXCHAN], offset[DATAQ_MAXCHAN];
+  int c;
+  for (c = 0; c < n_chans; c++) {
+    gain[c] = (known && c < hdr->n_chans) ? hdr->gain[c] : 20.0;
+    offset[c] = (known && c < hdr->n_chans) ? hdr->offset[c] : 0;
+    if (fullscale > 0)
+      gain[c] = fullscale * (fudge > 0 ? fudge : 1);
+    else if (fudge > 0)
+      gain[c] *= fudge;
+  }
+  struct dataq_conv conv;
+  if ((ret = dataq_conv_init(&conv, n_chans, gain, NULL, offset)) < 0) {
+    dataq_replay_close(r);
+    return ret;
+  }
+
+  static struct dataq_rx rx;
+  static float values[DATAQ_RXBUF];
+  dataq_rx_init(&rx, -1, &conv);
+  long long n_scans = 0;
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  struct timeval tv;
+  while ((ret = dataq_replay_recv(r, &rx, values, DATAQ_RXBUF / n_chans, &tv)) > 0) {
+    n_scans += ret;
+    if (quiet)
+      continue;
+
+    // Without finer timing, the batch's scans are spread back from its end at
+    // the nominal period, as the tool does
+    const int64_t end = (int64_t) tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+    const double period_ns = hdr->period > 0 ? hdr->period * 1e9 : 0;
+    int s;
+    for (s = 0; s < ret; s++)
+      print_scan(end - llround((ret - 1 - s) * period_ns), &values[s * n_chans], n_chans);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  if (rx.resyncs)
+    fprintf(stderr, "%lld resyncs, %lld bytes skipped\n", rx.resyncs, rx.skipped);
+  if (quiet) {
+    long long done, size;
+    dataq_replay_progress(r, &done, &size);
+    const double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+    fprintf(stderr, "%lld scans of %d channels in %.3f s: %.0f scans/s, %.1f MB/s\n",
+            n_scans, n_chans, secs, n_scans / secs, size / secs / 1e6);
+  }
+  dataq_conv_free(&conv);
+  dataq_replay_close(r);
+  return ret;
+}
+
+// Print what a publisher sends, until it stops
+static int subscribe(const char *src)
+{
+  struct dataq_fanout_sub *sub;
+  int ret = dataq_fanout_subscribe(&sub, src);
+  if (ret < 0)
+    return ret;
+
+  static uint16_t codes[DATAQ_FANOUT_SCANS * DATAQ_MAXCHAN];
+  unsigned long long dropped = 0;
+  struct dataq_log_block blk;
+  while ((ret = dataq_fanout_recv(sub, &blk, codes, DATAQ_FANOUT_SCANS, -1)) >= 0) {
+    if (dataq_fanout_dropped(sub) != dropped) {
+      printf("# dropped %llu\n", dataq_fanout_dropped(sub) - dropped);
+      dropped = dataq_fanout_dropped(sub);
+    }
+    const struct dataq_log_header *hdr = dataq_fanout_header(sub);
+    if (blk.flags & DATAQ_LOG_GAP) {
+      const int64_t end = blk.t_ns + llround(blk.period_ns);
+      long long lost = hdr ? llround(blk.period_ns / (hdr->period * 1e9)) - 1 : 0;
+      printf("# gap %llu.%06llu %llu.%06llu %lld\n",
+             (unsigned long long int)(blk.t_ns / 1000000000),
+             (unsigned long long int)(blk.t_ns % 1000000000 / 1000),
+             (unsigned long long int)(end / 1000000000),
+             (unsigned long long int)(end % 1000000000 / 1000),
+             lost < 0 ? 0 : lost);
+    }
+
+    int s, c;
+    for (s = 0; s < ret; s++) {
+      float values[DATAQ_MAXCHAN];
+      for (c = 0; c < hdr->n_chans; c++)
+        values[c] = value(hdr, c, codes[s * hdr->n_chans + c]);
+      print_scan(blk.t_ns + llround(s * blk.period_ns), values, hdr->n_chans);
+    }
+    fflush(stdout);
+  }
+  dataq_fanout_unsubscribe(sub);
+  return ret == -EX_UNAVAILABLE ? EX_OK : ret;
+}
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr,
+          "Convert a dataq binary log, store, raw capture or pcap to text\n"
+          "Usage:\n"
+          "    %s [OPTIONS] [FILE]\n"
+          "    %s -l, --listen SRC\n"
+          "reading standard input if FILE isn't given (logs only), or else what\n"
+          "dataq -P publishes to SRC, udp:HOST:PORT or shm:NAME.\n"
+          "Options, for stores:\n"
+          "    -t, --time FROM[,TO] Only scans between these times (seconds since\n"
+          "                         the epoch)\n"
+          "    -O, --overview       One line per chunk: time, scans, and each\n"
+          "                         channel's MIN:MAX\n"
+          "Options, for captures:\n"
+          "    -c, --chans N        Channels per scan, if the capture doesn't say\n"
+          "    -s, --fullscale V    Full scale, instead of as recorded (or 20.0)\n"
+          "    -f, --fudge F        Fudge factor to apply as well\n"
+          "    -p, --port PORT      The device's port, in a pcap (default 10001)\n"
+          "    -q, --quiet          Only decode, reporting how fast to stderr\n",
+          argv0, argv0);
+  exit(EX_USAGE);
+}
+
+int main(int argc, char **argv)
+{
+  static const struct option longopts[] = {
+    { "chans", required_argument, NULL, 'c' },
+    { "fullscale", required_argument, NULL, 's' },
+    { "fudge", required_argument, NULL, 'f' },
+    { "port", required_argument, NULL, 'p' },
+    { "quiet", no_argument, NULL, 'q' },
+    { "time", required_argument, NULL, 't' },
+    { "overview", no_argument, NULL, 'O' },
+    { "listen", required_argument, NULL, 'l' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "c:s:f:p:qt:Ol:h", longopts, NULL)) != -1) {
+    switch (opt) {
+    case 'c':
+      n_chans = atoi(optarg);
+      break;
+    case 's':
+      fullscale = atof(optarg);
+      break;
+    case 'f':
+      fudge = atof(optarg);
+      break;
+    case 'p':
+      portno = atoi(optarg);
+      break;
+    case 'q':
+      quiet = 1;
+      break;
+    case 't': {
+      char *end;
+      from_ns = seconds_ns(optarg, &end);
+      if (*end == ',')
+        to_ns = seconds_ns(end + 1, &end);
+      if (*end != '\0')
+        usage(argv[0]);
+      break;
+    }
+    case 'O':
+      overview = 1;
+      break;
+    case 'l':
+      listen_src = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (argc - optind > 1 || n_chans < 0 || n_chans > DATAQ_MAXCHAN
+      || portno <= 0 || portno > 65535)
+    usage(argv[0]);
+
+  int ret;
+  if (listen_src != NULL) {
+    if (optind < argc)
+      usage(argv[0]);
+    ret = subscribe(listen_src);
+    return ret < 0 ? -ret : 0;
+  }
+
+  FILE *f = stdin;
+  const char *path = optind < argc ? argv[optind] : NULL;
+  if (path != NULL && (f = fopen(path, "rb")) == NULL) {
+    fprintf(stderr, "Can't open %s\n", path);
+    exit(EX_NOINPUT);
+  }
+
+  // A log or store starts with its magic; anything else is replayed
+  char magic[4];
+  if (path != NULL && fread(magic, 1, sizeof(magic), f) == sizeof(magic)
+      && !memcmp(magic, DATAQ_STORE_MAGIC, sizeof(magic))) {
+    fclose(f);
+    ret = dump_store(path);
+  }
+  else if (path != NULL && (ferror(f) || feof(f)
+                            || memcmp(magic, DATAQ_LOG_MAGIC, sizeof(magic)))) {
+    fclose(f);
+    ret = replay(path);
+  }
+  else {
+    if (path != NULL)
+      rewind(f);
+    ret = dump_log(f);
+    if (f != stdin)
+      fclose(f);
+  }
+  return ret < 0 ? -ret : 0;
+}
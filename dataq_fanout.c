@@ -0,0 +1,823 @@
+/* Fan-out: one acquisition republished to any number of subscribers
+ *
+ * The device takes a single client, so one process holds the connection and
+ * publishes each batch of codes, lossless, to destinations of two kinds:
+ *
+ *   udp:HOST:PORT[:TTL]  Datagrams to HOST, typically a multicast group
+ *                        (TTL 1 by default, the local network), or a single
+ *                        subscriber; [ADDR] for IPv6
+ *   shm:NAME             A ring of batches in POSIX shared memory, for
+ *                        subscribers on the same machine
+ *
+ * Neither ever waits on a subscriber.  Datagrams are sent without blocking,
+ * and dropped if the socket is full; each carries a sequence number, so
+ * subscribers can tell what they missed.  The ring is written regardless of
+ * its readers, each slot under a sequence count (a seqlock): a reader that
+ * falls more than a ring behind finds its slots overwritten, counts them as
+ * dropped and carries on from the oldest still there.
+ *
+ * A datagram is a struct dataq_fanout_msg, then the batch's codes through
+ * dataq_pack(), as many scans as keep it within DATAQ_FANOUT_MTU.  The
+ * acquisition's struct dataq_log_header goes out at the start and every
+ * DATAQ_FANOUT_HEADER_MS, so subscribers can join at any time; gaps go out as
+ * in logs.  A ring has the header at its start, then its slots, each a
+ * struct dataq_log_block and up to DATAQ_FANOUT_SCANS scans of codes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+#ifdef __linux__
+  #include <linux/futex.h>
+  #include <sys/syscall.h>
+#endif
+
+#include "dataq.h"
+#include "dataq_private.h"
+
+#define RING_VERSION 1
+#define MAX_DEST 256   // Longest destination spec
+
+// Start of a ring in shared memory
+struct ring {
+  char magic[4];
+  uint32_t version;
+  uint32_t n_slots;
+  uint32_t slot_scans;
+  uint32_t slot_bytes;
+  uint32_t pid;                  // The publisher's
+  _Atomic uint32_t closed;       // Set when the publisher finishes
+  _Atomic uint64_t head;         // Batches written
+  _Atomic uint32_t bell;         // Bumped with head, to wait on
+  struct dataq_log_header acq;
+} __attribute__((aligned(64)));
+
+struct slot {
+  _Atomic uint64_t seq;          // 2 * batch + 1 while written, + 2 once done
+  struct dataq_log_block blk;
+  uint16_t codes[];
+};
+
+struct dest {
+  int fd;                        // UDP socket, or -1 for a ring
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  struct ring *ring;
+  size_t ring_size;
+  char name[MAX_DEST];           // The ring's, to unlink
+};
+
+struct dataq_fanout {
+  struct dataq_log_header hdr;
+  int n_dests;
+  struct dest dests[DATAQ_FANOUT_DESTS];
+  uint32_t seq;                  // Next datagram's
+  struct timespec hdr_due;       // When to send the header again
+  struct dataq_fanout_stats stats;
+  uint8_t msg[DATAQ_FANOUT_MTU];
+  uint8_t packed[DATAQ_PACK_BOUND(DATAQ_FANOUT_SCANS, DATAQ_MAXCHAN)];
+};
+
+struct dataq_fanout_sub {
+  int fd;                        // UDP socket, or -1 for a ring
+  const struct ring *ring;
+  size_t ring_size;
+  uint64_t next;                 // Ring: next batch to read
+  uint32_t seq;                  // UDP: next datagram due...
+  int synced;                    // ...if one has been seen
+  int have_hdr;
+  struct dataq_log_header hdr;
+  unsigned long long dropped;
+  uint8_t buf[65536];
+};
+
+static int64_t tv_ns(const struct timeval *tv)
+{
+  return (int64_t) tv->tv_sec * 1000000000 + (int64_t) tv->tv_usec * 1000;
+}
+
+static size_t round_up(const size_t n, const size_t to)
+{
+  return (n + to - 1) / to * to;
+}
+
+static size_t slot_bytes(const int n_chans)
+{
+  return round_up(sizeof(struct slot) + DATAQ_FANOUT_SCANS * n_chans * sizeof(uint16_t), 64);
+}
+
+static struct slot *ring_slot(const struct ring *ring, const uint64_t batch)
+{
+  return (struct slot *) ((uint8_t *) ring + round_up(sizeof(*ring), 64)
+                          + (batch % ring->n_slots) * ring->slot_bytes);
+}
+
+static void ring_wake(struct ring *ring)
+{
+  // Readers map the ring read-only, so can't say whether any are waiting;
+  // a wake-up per batch is cheap enough
+  atomic_fetch_add_explicit(&ring->bell, 1, memory_order_release);
+#ifdef __linux__
+  syscall(SYS_futex, &ring->bell, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+#endif
+}
+
+// Wait up to timeout_ms for the bell to move on from bell
+static void ring_wait(const struct ring *ring, const uint32_t bell,
+                      const int timeout_ms)
+{
+#ifdef __linux__
+  const struct timespec ts = {
+    .tv_sec = timeout_ms / 1000,.tv_nsec = timeout_ms % 1000 * 1000000
+  };
+  syscall(SYS_futex, &ring->bell, FUTEX_WAIT, bell, timeout_ms < 0 ? NULL : &ts,
+          NULL, 0);
+#else
+  // Polling, a millisecond at a time
+  (void) bell;
+  const struct timespec ts = {.tv_sec = 0,.tv_nsec = 1000000 };
+  if (timeout_ms != 0)
+    nanosleep(&ts, NULL);
+#endif
+}
+
+// Whether the process publishing the ring is still there
+static int publisher_alive(const struct ring *ring)
+{
+  return ring->pid == 0 || kill(ring->pid, 0) == 0 || errno == EPERM;
+}
+
+// Split "udp:HOST:PORT[:TTL]" into its parts, in buf
+static int parse_udp(const char *spec, char *buf, const size_t size,
+                     const char **host, int *portno, int *ttl)
+{
+  snprintf(buf, size, "%s", spec);
+  char *p = buf, *end;
+  if (*p == '[') {
+    *host = ++p;
+    if ((p = strchr(p, ']')) == NULL)
+      return -EX_USAGE;
+    *p++ = '\0';
+  }
+  else {
+    *host = p;
+    p = strchr(p, ':');
+  }
+  if (p == NULL || *p != ':')
+    return -EX_USAGE;
+  *p++ = '\0';
+  *portno = strtol(p, &end, 10);
+  *ttl = 1;
+  if (*end == ':')
+    *ttl = strtol(end + 1, &end, 10);
+  if (*end != '\0' || **host == '\0' || *portno <= 0 || *portno > 65535
+      || *ttl < 0 || *ttl > 255)
+    return -EX_USAGE;
+  return EX_OK;
+}
+
+static int is_multicast(const struct sockaddr_storage *addr)
+{
+  if (addr->ss_family == AF_INET)
+    return IN_MULTICAST(ntohl(((const struct sockaddr_in *) addr)->sin_addr.s_addr));
+  if (addr->ss_family == AF_INET6)
+    return IN6_IS_ADDR_MULTICAST(&((const struct sockaddr_in6 *) addr)->sin6_addr);
+  return 0;
+}
+
+// Look up a UDP spec's address, and open a socket for it
+static int udp_open(const char *spec, struct sockaddr_storage *addr,
+                    socklen_t *len, int *ttl)
+{
+  char buf[MAX_DEST];
+  const char *host;
+  int portno, ret;
+  if ((ret = parse_udp(spec, buf, sizeof(buf), &host, &portno, ttl)) < 0) {
+    eprintf("Bad UDP destination %s, should be udp:HOST:PORT[:TTL]\n", spec);
+    return ret;
+  }
+  struct dataq_addrs addrs;
+  if ((ret = dataq_resolve(host, portno, &addrs)) < 0)
+    return ret;
+  memcpy(addr, &addrs.addr[0], addrs.len[0]);
+  *len = addrs.len[0];
+
+  int fd = socket(addr->ss_family, SOCK_DGRAM, 0);
+  if (fd < 0) {
+    eprintf("Error opening UDP socket: %s\n", strerror(errno));
+    return -EX_OSERR;
+  }
+  return fd;
+}
+
+// Set up to publish an acquisition, described by hdr, to the destinations
+// then added
+int dataq_fanout_open(struct dataq_fanout **fop, const struct dataq_log_header *hdr)
+{
+  if (hdr->n_chans < 1 || hdr->n_chans > DATAQ_MAXCHAN)
+    return -EX_DATAERR;
+  struct dataq_fanout *fo = calloc(1, sizeof(*fo));
+  if (fo == NULL)
+    return -EX_OSERR;
+  fo->hdr = *hdr;
+  fo->hdr.format = DATAQ_LOG_PACKED;
+  *fop = fo;
+  return EX_OK;
+}
+
+static int add_udp(struct dest *d, const char *spec)
+{
+  int ttl;
+  if ((d->fd = udp_open(spec, &d->addr, &d->addr_len, &ttl)) < 0)
+    return d->fd;
+  if (is_multicast(&d->addr)) {
+    const int loop = 1;
+    if (d->addr.ss_family == AF_INET) {
+      const unsigned char t = ttl, l = loop;
+      setsockopt(d->fd, IPPROTO_IP, IP_MULTICAST_TTL, &t, sizeof(t));
+      setsockopt(d->fd, IPPROTO_IP, IP_MULTICAST_LOOP, &l, sizeof(l));
+    }
+    else {
+      setsockopt(d->fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &ttl, sizeof(ttl));
+      setsockopt(d->fd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &loop, sizeof(loop));
+    }
+  }
+  if (fcntl(d->fd, F_SETFL, fcntl(d->fd, F_GETFL) | O_NONBLOCK) == -1) {
+    eprintf("Error setting UDP socket non-blocking: %s\n", strerror(errno));
+    return -EX_OSERR;
+  }
+  return EX_OK;
+}
+
+// Close and remove the ring already called name, unless its publisher is
+// still running
+static int retire_ring(const char *name)
+{
+  const int fd = shm_open(name, O_RDWR, 0);
+  struct stat st;
+  if (fd < 0)
+    return errno == ENOENT ? EX_OK : -EX_CANTCREAT;
+  if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(struct ring)) {
+    struct ring *ring = mmap(NULL, sizeof(*ring), PROT_READ | PROT_WRITE,
+                             MAP_SHARED, fd, 0);
+    if (ring != MAP_FAILED) {
+      if (!memcmp(ring->magic, DATAQ_FANOUT_MAGIC, sizeof(ring->magic))
+          && !atomic_load_explicit(&ring->closed, memory_order_acquire)
+          && ring->pid != 0 && publisher_alive(ring)) {
+        eprintf("Shared memory %s is in use by process %u\n", name, ring->pid);
+        munmap(ring, sizeof(*ring));
+        close(fd);
+        return -EX_CANTCREAT;
+      }
+      atomic_store_explicit(&ring->closed, 1, memory_order_release);
+      ring_wake(ring);
+      munmap(ring, sizeof(*ring));
+    }
+  }
+  close(fd);
+  if (shm_unlink(name) == -1 && errno != ENOENT) {
+    eprintf("Error removing shared memory %s: %s\n", name, strerror(errno));
+    return -EX_CANTCREAT;
+  }
+  return EX_OK;
+}
+
+static int add_ring(struct dataq_fanout *fo, struct dest *d, const char *name)
+{
+  d->fd = -1;
+  snprintf(d->name, sizeof(d->name), "%s%s", name[0] == '/' ? "" : "/", name);
+
+  // A fresh ring each time, retiring any old one so its readers see it closed
+  int fd, ret;
+  while ((fd = shm_open(d->name, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0
+         && errno == EEXIST)
+    if ((ret = retire_ring(d->name)) < 0)
+      return ret;
+  if (fd < 0) {
+    eprintf("Error creating shared memory %s: %s\n", d->name, strerror(errno));
+    return -EX_CANTCREAT;
+  }
+  const int n_chans = fo->hdr.n_chans;
+  d->ring_size = round_up(sizeof(struct ring), 64)
+                 + (size_t) DATAQ_FANOUT_SLOTS * slot_bytes(n_chans);
+  if (ftruncate(fd, d->ring_size) == -1
+      || (d->ring = mmap(NULL, d->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         fd, 0)) == MAP_FAILED) {
+    eprintf("Error mapping shared memory %s: %s\n", d->name, strerror(errno));
+    d->ring = NULL;
+    close(fd);
+    shm_unlink(d->name);
+    return -EX_OSERR;
+  }
+  close(fd);
+
+  struct ring *ring = d->ring;
+  ring->version = RING_VERSION;
+  ring->n_slots = DATAQ_FANOUT_SLOTS;
+  ring->slot_scans = DATAQ_FANOUT_SCANS;
+  ring->slot_bytes = slot_bytes(n_chans);
+  ring->pid = getpid();
+  ring->acq = fo->hdr;
+  ring->acq.format = DATAQ_LOG_CODES;
+  atomic_thread_fence(memory_order_release);
+  memcpy(ring->magic, DATAQ_FANOUT_MAGIC, sizeof(ring->magic));
+  return EX_OK;
+}
+
+static void send_msg(struct dataq_fanout *fo, const struct dataq_log_block *blk,
+                     const void *payload, const size_t len);
+
+// Add a destination, udp:HOST:PORT[:TTL] or shm:NAME
+int dataq_fanout_add(struct dataq_fanout *fo, const char *dest)
+{
+  if (fo->n_dests == DATAQ_FANOUT_DESTS)
+    return -EX_USAGE;
+  struct dest *d = &fo->dests[fo->n_dests];
+  int ret;
+  memset(d, 0, sizeof(*d));
+  if (!strncmp(dest, "udp:", 4))
+    ret = add_udp(d, dest + 4);
+  else if (!strncmp(dest, "shm:", 4) && dest[4] != '\0')
+    ret = add_ring(fo, d, dest + 4);
+  else {
+    eprintf("Bad destination %s, should be udp:HOST:PORT[:TTL] or shm:NAME\n", dest);
+    ret = -EX_USAGE;
+  }
+  if (ret < 0) {
+    if (d->fd >= 0)
+      close(d->fd);
+    return ret;
+  }
+  fo->n_dests++;
+
+  // Announce the acquisition straight away
+  clock_gettime(CLOCK_MONOTONIC, &fo->hdr_due);
+  return EX_OK;
+}
+
+// Send a datagram to every UDP destination, dropping it where there's no room
+static void send_msg(struct dataq_fanout *fo, const struct dataq_log_block *blk,
+                     const void *payload, const size_t len)
+{
+  struct dataq_fanout_msg *msg = (struct dataq_fanout_msg *) fo->msg;
+  memcpy(msg->magic, DATAQ_FANOUT_MAGIC, sizeof(msg->magic));
+  msg->seq = fo->seq++;
+  msg->blk = *blk;
+  memcpy(&fo->msg[sizeof(*msg)], payload, len);
+
+  int i;
+  for (i = 0; i < fo->n_dests; i++) {
+    const struct dest *d = &fo->dests[i];
+    if (d->fd < 0)
+      continue;
+    fo->stats.datagrams++;
+    if (sendto(d->fd, fo->msg, sizeof(*msg) + len, MSG_DONTWAIT,
+               (const struct sockaddr *) &d->addr, d->addr_len) < 0)
+      fo->stats.dropped++;
+  }
+}
+
+// Write a batch to every ring; n_scans at most DATAQ_FANOUT_SCANS
+static void ring_put(struct dataq_fanout *fo, const struct dataq_log_block *blk,
+                     const uint16_t codes[])
+{
+  int i;
+  for (i = 0; i < fo->n_dests; i++) {
+    struct ring *ring = fo->dests[i].ring;
+    if (ring == NULL)
+      continue;
+    const uint64_t batch = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    struct slot *sl = ring_slot(ring, batch);
+    atomic_store_explicit(&sl->seq, 2 * batch + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    sl->blk = *blk;
+    memcpy(sl->codes, codes, blk->n_scans * fo->hdr.n_chans * sizeof(uint16_t));
+    atomic_store_explicit(&sl->seq, 2 * batch + 2, memory_order_release);
+    atomic_store_explicit(&ring->head, batch + 1, memory_order_release);
+    ring_wake(ring);
+  }
+}
+
+static int has_udp(const struct dataq_fanout *fo)
+{
+  int i;
+  for (i = 0; i < fo->n_dests; i++)
+    if (fo->dests[i].fd >= 0)
+      return 1;
+  return 0;
+}
+
+// Send the header if it's due
+static void announce(struct dataq_fanout *fo)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (now.tv_sec < fo->hdr_due.tv_sec
+      || (now.tv_sec == fo->hdr_due.tv_sec && now.tv_nsec < fo->hdr_due.tv_nsec))
+    return;
+  const struct dataq_log_block blk = {.flags = DATAQ_FANOUT_HEADER };
+  send_msg(fo, &blk, &fo->hdr, sizeof(fo->hdr));
+  fo->hdr_due = now;
+  fo->hdr_due.tv_sec += DATAQ_FANOUT_HEADER_MS / 1000;
+  fo->hdr_due.tv_nsec += DATAQ_FANOUT_HEADER_MS % 1000 * 1000000;
+  if (fo->hdr_due.tv_nsec >= 1000000000) {
+    fo->hdr_due.tv_sec++;
+    fo->hdr_due.tv_nsec -= 1000000000;
+  }
+}
+
+// Scans s to s + n of a batch, as a block
+static struct dataq_log_block block(const struct dataq_log_header *hdr,
+                                    const struct timeval tv[], const int s,
+                                    const int n)
+{
+  const int64_t t0 = tv_ns(&tv[s]);
+  const struct dataq_log_block blk = {
+    .t_ns = t0,
+    .period_ns = n > 1 ? (double) (tv_ns(&tv[s + n - 1]) - t0) / (n - 1)
+                       : hdr->period * 1e9,
+    .n_scans = n,
+  };
+  return blk;
+}
+
+// Publish n_scans scans of codes[] (interleaved) with their timestamps tv[]
+// Sending none still re-announces the header when it's due, so call it at
+// least every DATAQ_FANOUT_HEADER_MS, as while the unit is away
+int dataq_fanout_send(struct dataq_fanout *fo, const uint16_t codes[],
+                      const struct timeval tv[], const int n_scans)
+{
+  const int n_chans = fo->hdr.n_chans;
+  const int udp = has_udp(fo);
+  int s, n;
+  if (udp)
+    announce(fo);
+
+  for (s = 0; s < n_scans; s += n) {
+    n = n_scans - s < DATAQ_FANOUT_SCANS ? n_scans - s : DATAQ_FANOUT_SCANS;
+    const uint16_t *first = &codes[(size_t) s * n_chans];
+    struct dataq_log_block blk = block(&fo->hdr, tv, s, n);
+    ring_put(fo, &blk, first);
+    if (!udp)
+      continue;
+
+    // As many as fit in a datagram, halving until they do
+    int k, m;
+    for (k = 0; k < n; k += m) {
+      size_t len;
+      m = n - k;
+      while ((len = dataq_pack(&first[(size_t) k * n_chans], m, n_chans, fo->packed))
+             > DATAQ_FANOUT_MTU - sizeof(struct dataq_fanout_msg) && m > 1)
+        m /= 2;
+      blk = block(&fo->hdr, tv, s + k, m);
+      send_msg(fo, &blk, fo->packed, len);
+    }
+  }
+  fo->stats.scans += n_scans;
+  return EX_OK;
+}
+
+// Publish a gap, as in a log
+int dataq_fanout_gap(struct dataq_fanout *fo, const struct dataq_gap *gap)
+{
+  const int64_t start = tv_ns(&gap->start);
+  const struct dataq_log_block blk = {
+    .t_ns = start,
+    .period_ns = tv_ns(&gap->end) - start,
+    .flags = DATAQ_LOG_GAP,
+  };
+  ring_put(fo, &blk, NULL);
+  if (has_udp(fo)) {
+    announce(fo);
+    send_msg(fo, &blk, NULL, 0);
+  }
+  return EX_OK;
+}
+
+void dataq_fanout_stats(const struct dataq_fanout *fo,
+                        struct dataq_fanout_stats *stats)
+{
+  *stats = fo->stats;
+}
+
+// Tell subscribers it's over, and remove the rings
+void dataq_fanout_close(struct dataq_fanout *fo)
+{
+  const struct dataq_log_block blk = {.flags = DATAQ_FANOUT_END };
+  if (has_udp(fo))
+    send_msg(fo, &blk, NULL, 0);
+
+  int i;
+  for (i = 0; i < fo->n_dests; i++) {
+    struct dest *d = &fo->dests[i];
+    if (d->fd >= 0)
+      close(d->fd);
+    if (d->ring != NULL) {
+      atomic_store_explicit(&d->ring->closed, 1, memory_order_release);
+      ring_wake(d->ring);
+      munmap(d->ring, d->ring_size);
+      shm_unlink(d->name);
+    }
+  }
+  free(fo);
+}
+
+static int sub_udp(struct dataq_fanout_sub *sub, const char *spec)
+{
+  struct sockaddr_storage addr;
+  socklen_t len;
+  int ttl;
+  if ((sub->fd = udp_open(spec, &addr, &len, &ttl)) < 0)
+    return sub->fd;
+
+  // Several subscribers on one machine share the port
+  const int on = 1;
+  setsockopt(sub->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+  setsockopt(sub->fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+#endif
+
+  // Bound to the group itself, or to any address for unicast
+  struct sockaddr_storage any = addr;
+  if (!is_multicast(&addr)) {
+    if (any.ss_family == AF_INET)
+      ((struct sockaddr_in *) &any)->sin_addr.s_addr = htonl(INADDR_ANY);
+    else
+      ((struct sockaddr_in6 *) &any)->sin6_addr = in6addr_any;
+  }
+  if (bind(sub->fd, (struct sockaddr *) &any, len) == -1) {
+    eprintf("Error binding UDP socket: %s\n", strerror(errno));
+    return -EX_OSERR;
+  }
+
+  int ret = 0;
+  if (is_multicast(&addr) && addr.ss_family == AF_INET) {
+    struct ip_mreq mreq = {
+      .imr_multiaddr = ((struct sockaddr_in *) &addr)->sin_addr,
+      .imr_interface.s_addr = htonl(INADDR_ANY),
+    };
+    ret = setsockopt(sub->fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+  }
+  else if (is_multicast(&addr)) {
+    struct ipv6_mreq mreq = {
+      .ipv6mr_multiaddr = ((struct sockaddr_in6 *) &addr)->sin6_addr,
+    };
+    ret = setsockopt(sub->fd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq, sizeof(mreq));
+  }
+  if (ret == -1) {
+    eprintf("Error joining multicast group: %s\n", strerror(errno));
+    return -EX_OSERR;
+  }
+  return EX_OK;
+}
+
+static int sub_ring(struct dataq_fanout_sub *sub, const char *name)
+{
+  char path[MAX_DEST];
+  snprintf(path, sizeof(path), "%s%s", name[0] == '/' ? "" : "/", name);
+  int fd = shm_open(path, O_RDONLY, 0);
+  if (fd < 0) {
+    eprintf("Error opening shared memory %s: %s\n", path, strerror(errno));
+    return -EX_NOINPUT;
+  }
+  struct stat sb;
+  if (fstat(fd, &sb) == -1 || sb.st_size < (off_t) sizeof(struct ring)) {
+    close(fd);
+    return -EX_DATAERR;
+  }
+  sub->ring_size = sb.st_size;
+
+  sub->ring = mmap(NULL, sub->ring_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (sub->ring == MAP_FAILED) {
+    sub->ring = NULL;
+    eprintf("Error mapping shared memory %s: %s\n", path, strerror(errno));
+    return -EX_OSERR;
+  }
+
+  const struct ring *ring = sub->ring;
+  if (memcmp(ring->magic, DATAQ_FANOUT_MAGIC, sizeof(ring->magic))
+      || ring->version != RING_VERSION || ring->acq.n_chans < 1
+      || ring->acq.n_chans > DATAQ_MAXCHAN || ring->n_slots == 0
+      || ring->slot_bytes < slot_bytes(ring->acq.n_chans)
+      || sub->ring_size < round_up(sizeof(*ring), 64)
+                          + (size_t) ring->n_slots * ring->slot_bytes) {
+    eprintf("%s isn't a dataq ring\n", path);
+    return -EX_DATAERR;
+  }
+  atomic_thread_fence(memory_order_acquire);
+  sub->hdr = ring->acq;
+  sub->have_hdr = 1;
+
+  // From now on
+  sub->next = atomic_load_explicit(&ring->head, memory_order_acquire);
+  return EX_OK;
+}
+
+// Subscribe to a publisher's udp:HOST:PORT or shm:NAME
+int dataq_fanout_subscribe(struct dataq_fanout_sub **subp, const char *src)
+{
+  struct dataq_fanout_sub *sub = calloc(1, sizeof(*sub));
+  if (sub == NULL)
+    return -EX_OSERR;
+  sub->fd = -1;
+  int ret;
+  if (!strncmp(src, "udp:", 4))
+    ret = sub_udp(sub, src + 4);
+  else if (!strncmp(src, "shm:", 4) && src[4] != '\0')
+    ret = sub_ring(sub, src + 4);
+  else {
+    eprintf("Bad source %s, should be udp:HOST:PORT or shm:NAME\n", src);
+    ret = -EX_USAGE;
+  }
+  if (ret < 0) {
+    dataq_fanout_unsubscribe(sub);
+    return ret;
+  }
+  *subp = sub;
+  return EX_OK;
+}
+
+// The acquisition's header, or NULL if none has arrived yet
+const struct dataq_log_header *dataq_fanout_header(const struct dataq_fanout_sub *sub)
+{
+  return sub->have_hdr ? &sub->hdr : NULL;
+}
+
+// Batches (or datagrams) missed so far
+unsigned long long dataq_fanout_dropped(const struct dataq_fanout_sub *sub)
+{
+  return sub->dropped;
+}
+
+// Read one batch from a ring, if there's one
+static int ring_get(struct dataq_fanout_sub *sub, struct dataq_log_block *blk,
+                    uint16_t codes[], const int max_scans)
+{
+  const struct ring *ring = sub->ring;
+  const int n_chans = ring->acq.n_chans;
+  for (;;) {
+    const uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (head == sub->next)
+      return 0;
+
+    // Too far behind: skip to what's safely still there
+    if (head - sub->next >= ring->n_slots) {
+      sub->dropped += head - sub->next - ring->n_slots + 1;
+      sub->next = head - ring->n_slots + 1;
+    }
+
+    const struct slot *sl = ring_slot(ring, sub->next);
+    const uint64_t seq = atomic_load_explicit(&sl->seq, memory_order_acquire);
+    if (seq != 2 * sub->next + 2) {
+      sub->dropped++;
+      sub->next++;
+      continue;
+    }
+    *blk = sl->blk;
+    const int n = blk->n_scans;
+    if (n > (int) ring->slot_scans || n > max_scans)
+      return -EX_DATAERR;
+    memcpy(codes, sl->codes, n * n_chans * sizeof(uint16_t));
+
+    // Overwritten while copying?
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&sl->seq, memory_order_relaxed) != seq) {
+      sub->dropped++;
+      sub->next++;
+      continue;
+    }
+    sub->next++;
+    return 1;
+  }
+}
+
+// Take a datagram, if it's good; returns 1 for a batch or gap, 0 otherwise
+static int udp_get(struct dataq_fanout_sub *sub, const ssize_t len,
+                   struct dataq_log_block *blk, uint16_t codes[],
+                   const int max_scans)
+{
+  const struct dataq_fanout_msg *msg = (const struct dataq_fanout_msg *) sub->buf;
+  if (len < (ssize_t) sizeof(*msg) || memcmp(msg->magic, DATAQ_FANOUT_MAGIC, sizeof(msg->magic)))
+    return 0;
+  if (sub->synced && msg->seq != sub->seq)
+    sub->dropped += (uint32_t) (msg->seq - sub->seq);
+  sub->seq = msg->seq + 1;
+  sub->synced = 1;
+  *blk = msg->blk;
+
+  const uint8_t *payload = &sub->buf[sizeof(*msg)];
+  const size_t n_bytes = len - sizeof(*msg);
+  if (blk->flags & DATAQ_FANOUT_HEADER) {
+    const struct dataq_log_header *hdr = (const struct dataq_log_header *) payload;
+    if (n_bytes >= sizeof(*hdr) && hdr->n_chans >= 1 && hdr->n_chans <= DATAQ_MAXCHAN) {
+      sub->hdr = *hdr;
+      sub->hdr.format = DATAQ_LOG_CODES;
+      sub->have_hdr = 1;
+    }
+    return 0;
+  }
+  if (blk->flags & (DATAQ_LOG_GAP | DATAQ_FANOUT_END))
+    return 1;
+
+  // Scans only make sense once the header says how many channels
+  if (!sub->have_hdr)
+    return 0;
+  if ((int) blk->n_scans > max_scans
+      || dataq_unpack(payload, n_bytes, blk->n_scans, sub->hdr.n_chans, codes) == 0) {
+    sub->dropped++;
+    return 0;
+  }
+  return 1;
+}
+
+// Wait up to timeout_ms (-1: forever) for the next batch of at most
+// max_scans (at least DATAQ_FANOUT_SCANS) into codes[], interleaved, with
+// its timing in blk
+// Returns the number of scans, or 0 on timeout or for a gap (blk->flags has
+// DATAQ_LOG_GAP), or -EX_UNAVAILABLE once the publisher has finished
+int dataq_fanout_recv(struct dataq_fanout_sub *sub, struct dataq_log_block *blk,
+                      uint16_t codes[], const int max_scans, const int timeout_ms)
+{
+  struct timespec now, deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += timeout_ms % 1000 * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  memset(blk, 0, sizeof(*blk));
+  for (;;) {
+    int wait_ms = timeout_ms;
+    if (timeout_ms > 0) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      wait_ms = (deadline.tv_sec - now.tv_sec) * 1000
+                + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+      if (wait_ms < 0)
+        wait_ms = 0;
+    }
+
+    int ret;
+    if (sub->ring != NULL) {
+      const struct ring *ring = sub->ring;
+      const uint32_t bell = atomic_load_explicit(&ring->bell, memory_order_acquire);
+      const int closed = atomic_load_explicit(&ring->closed, memory_order_acquire);
+      if ((ret = ring_get(sub, blk, codes, max_scans)) != 0)
+        return ret < 0 ? ret : (int) blk->n_scans;
+      if (closed || !publisher_alive(ring))
+        return -EX_UNAVAILABLE;
+      if (timeout_ms == 0)
+        return 0;
+      // A second at most, to notice a publisher that died without closing
+      ring_wait(ring, bell, wait_ms < 0 || wait_ms > 1000 ? 1000 : wait_ms);
+    }
+    else {
+      struct pollfd pfd = {.fd = sub->fd,.events = POLLIN };
+      if ((ret = poll(&pfd, 1, wait_ms)) < 0 && errno != EINTR) {
+        eprintf("Error waiting for datagrams: %s\n", strerror(errno));
+        return -EX_IOERR;
+      }
+      if (ret > 0) {
+        const ssize_t len = recv(sub->fd, sub->buf, sizeof(sub->buf), 0);
+        if (len > 0 && udp_get(sub, len, blk, codes, max_scans)) {
+          if (blk->flags & DATAQ_FANOUT_END)
+            return -EX_UNAVAILABLE;
+          return blk->n_scans;
+        }
+      }
+      else if (ret < 0)
+        return 0;  // Interrupted
+    }
+
+    if (timeout_ms >= 0) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (now.tv_sec > deadline.tv_sec
+          || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec))
+        return 0;
+    }
+  }
+}
+
+void dataq_fanout_unsubscribe(struct dataq_fanout_sub *sub)
+{
+  if (sub->fd >= 0)
+    close(sub->fd);
+  if (sub->ring != NULL)
+    munmap((void *) sub->ring, sub->ring_size);
+  free(sub);
+}
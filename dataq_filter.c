@@ -0,0 +1,246 @@
+/* Streaming digital filters, per channel, over batches of decoded scans
+ *
+ * Each channel gets its own chain of up to DATAQ_FILTER_STAGES stages: IIR
+ * biquads designed from a cutoff or centre frequency (low-pass, high-pass,
+ * and notch for mains hum, after the Audio EQ Cookbook), or FIR filters with
+ * given taps.  State carries over from one batch to the next, so a stream
+ * can be fed in pieces of any size as it arrives.
+ *
+ * Filtering runs over channel-major blocks (one contiguous column per
+ * channel), which suits it far better than interleaved scans: an FIR is a sum
+ * of shifted columns scaled by each tap, which the compiler vectorizes, and a
+ * biquad's recurrence runs down one column in registers.  Interleaved values
+ * are transposed through a block-sized scratch buffer, a cache-resident
+ * block at a time; dataq_filter_columns() takes columns as they are.
+ *
+ * Biquads keep their coefficients and state in double: at a kilohertz or more
+ * of sample rate, a notch a few hertz wide has poles too close to the unit
+ * circle for float.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <math.h>
+
+#include "dataq.h"
+#include "dataq_private.h"
+
+#define FILTER_BLOCK 512   // Scans per block
+#define Q_BUTTERWORTH 0.70710678
+#define Q_NOTCH 30.0
+
+struct stage {
+  enum dataq_filter_type type;
+  double b0, b1, b2, a1, a2;   // Biquad, normalized by a0
+  double z1, z2;               // Direct form II transposed state
+  float *taps;                 // FIR, reversed: newest sample's last
+  int n_taps;
+  float *hist;                 // n_taps - 1 samples of history, then a block
+};
+
+struct chan {
+  int n_stages;
+  struct stage stages[DATAQ_FILTER_STAGES];
+};
+
+struct dataq_filter {
+  int n_chans;
+  struct chan chans[DATAQ_MAXCHAN];
+  float *scratch;              // FILTER_BLOCK per channel, for transposing
+};
+
+static int design(struct stage *st, const struct dataq_filter_stage *spec,
+                  const double rate)
+{
+  st->type = spec->type;
+  if (spec->type == DATAQ_FILTER_FIR) {
+    const int n = spec->n_taps;
+    if (n < 1 || spec->taps == NULL)
+      return -EX_DATAERR;
+    st->n_taps = n;
+    st->taps = malloc(n * sizeof(float));
+    st->hist = calloc(n - 1 + FILTER_BLOCK, sizeof(float));
+    if (st->taps == NULL || st->hist == NULL)
+      return -EX_OSERR;
+    int k;
+    for (k = 0; k < n; k++)
+      st->taps[k] = spec->taps[n - 1 - k];
+    return EX_OK;
+  }
+
+  if (!(spec->freq > 0 && spec->freq < rate / 2)) {
+    eprintf("Filter frequency %g Hz out of range at %g Hz samples\n", spec->freq, rate);
+    return -EX_DATAERR;
+  }
+  const double q = spec->q > 0 ? spec->q
+                   : spec->type == DATAQ_FILTER_NOTCH ? Q_NOTCH : Q_BUTTERWORTH;
+  const double w0 = 2 * M_PI * spec->freq / rate;
+  const double cw = cos(w0), alpha = sin(w0) / (2 * q);
+  double b0, b1, b2;
+  switch (spec->type) {
+  case DATAQ_FILTER_LOWPASS:
+    b0 = b2 = (1 - cw) / 2;
+    b1 = 1 - cw;
+    break;
+  case DATAQ_FILTER_HIGHPASS:
+    b0 = b2 = (1 + cw) / 2;
+    b1 = -(1 + cw);
+    break;
+  case DATAQ_FILTER_NOTCH:
+    b0 = b2 = 1;
+    b1 = -2 * cw;
+    break;
+  default:
+    return -EX_DATAERR;
+  }
+  const double a0 = 1 + alpha;
+  st->b0 = b0 / a0;
+  st->b1 = b1 / a0;
+  st->b2 = b2 / a0;
+  st->a1 = -2 * cw / a0;
+  st->a2 = (1 - alpha) / a0;
+  return EX_OK;
+}
+
+// Set up filters for n_chans channels, as specs[] (one each, or NULL for none),
+// at rate scans per second
+int dataq_filter_open(struct dataq_filter **fp, const int n_chans,
+                      const struct dataq_filter_spec specs[], const double rate)
+{
+  if (n_chans < 1 || n_chans > DATAQ_MAXCHAN || !(rate > 0))
+    return -EX_DATAERR;
+  struct dataq_filter *f = calloc(1, sizeof(*f));
+  if (f == NULL)
+    return -EX_OSERR;
+  f->n_chans = n_chans;
+
+  int ret = EX_OK, c, i;
+  for (c = 0; c < n_chans && specs != NULL && ret == EX_OK; c++) {
+    struct chan *ch = &f->chans[c];
+    if (specs[c].n_stages < 0 || specs[c].n_stages > DATAQ_FILTER_STAGES) {
+      ret = -EX_DATAERR;
+      break;
+    }
+    for (i = 0; i < specs[c].n_stages && ret == EX_OK; i++)
+      if (specs[c].stages[i].type != DATAQ_FILTER_NONE)
+        ret = design(&ch->stages[ch->n_stages++], &specs[c].stages[i], rate);
+  }
+  if (ret == EX_OK && (f->scratch = malloc(n_chans * FILTER_BLOCK * sizeof(float))) == NULL)
+    ret = -EX_OSERR;
+  if (ret < 0) {
+    dataq_filter_close(f);
+    return ret;
+  }
+
+  *fp = f;
+  return EX_OK;
+}
+
+static void biquad(struct stage *st, float x[], const int n)
+{
+  const double b0 = st->b0, b1 = st->b1, b2 = st->b2, a1 = st->a1, a2 = st->a2;
+  double z1 = st->z1, z2 = st->z2;
+  int i;
+  for (i = 0; i < n; i++) {
+    const double in = x[i], out = b0 * in + z1;
+    z1 = b1 * in - a1 * out + z2;
+    z2 = b2 * in - a2 * out;
+    x[i] = out;
+  }
+  st->z1 = z1;
+  st->z2 = z2;
+}
+
+// n at most FILTER_BLOCK
+static void fir(struct stage *st, float x[], const int n)
+{
+  const int keep = st->n_taps - 1;
+  float *buf = st->hist;
+  memcpy(&buf[keep], x, n * sizeof(float));
+
+  // Oldest tap first, each a multiply-add of the whole block
+  float acc[FILTER_BLOCK] = { 0 };
+  int k, i;
+  for (k = 0; k < st->n_taps; k++) {
+    const float t = st->taps[k];
+    const float *src = &buf[k];
+    for (i = 0; i < n; i++)
+      acc[i] += t * src[i];
+  }
+  memcpy(x, acc, n * sizeof(float));
+  memmove(buf, &buf[n], keep * sizeof(float));
+}
+
+// Filter one channel's block of n <= FILTER_BLOCK samples, in place
+static void run_chan(struct chan *ch, float x[], const int n)
+{
+  int i;
+  for (i = 0; i < ch->n_stages; i++) {
+    struct stage *st = &ch->stages[i];
+    if (st->type == DATAQ_FILTER_FIR)
+      fir(st, x, n);
+    else
+      biquad(st, x, n);
+  }
+}
+
+// Filter n_scans scans of values[], interleaved, in place
+void dataq_filter_run(struct dataq_filter *f, float values[], const int n_scans)
+{
+  const int n_chans = f->n_chans;
+  int s, c, i;
+  for (s = 0; s < n_scans; s += FILTER_BLOCK) {
+    const int n = n_scans - s < FILTER_BLOCK ? n_scans - s : FILTER_BLOCK;
+    float *v = &values[(size_t) s * n_chans];
+    for (c = 0; c < n_chans; c++) {
+      struct chan *ch = &f->chans[c];
+      if (ch->n_stages == 0)
+        continue;
+      float *col = &f->scratch[c * FILTER_BLOCK];
+      for (i = 0; i < n; i++)
+        col[i] = v[i * n_chans + c];
+      run_chan(ch, col, n);
+      for (i = 0; i < n; i++)
+        v[i * n_chans + c] = col[i];
+    }
+  }
+}
+
+// Filter n_scans scans held by channel, cols[c] being channel c's, in place
+void dataq_filter_columns(struct dataq_filter *f, float *const cols[],
+                          const int n_scans)
+{
+  int s, c;
+  for (c = 0; c < f->n_chans; c++)
+    if (f->chans[c].n_stages > 0)
+      for (s = 0; s < n_scans; s += FILTER_BLOCK)
+        run_chan(&f->chans[c], &cols[c][s],
+                 n_scans - s < FILTER_BLOCK ? n_scans - s : FILTER_BLOCK);
+}
+
+// Forget the filters' state, e.g. after a gap
+void dataq_filter_reset(struct dataq_filter *f)
+{
+  int c, i;
+  for (c = 0; c < f->n_chans; c++)
+    for (i = 0; i < f->chans[c].n_stages; i++) {
+      struct stage *st = &f->chans[c].stages[i];
+      st->z1 = st->z2 = 0;
+      if (st->hist != NULL)
+        memset(st->hist, 0, (st->n_taps - 1) * sizeof(float));
+    }
+}
+
+void dataq_filter_close(struct dataq_filter *f)
+{
+  int c, i;
+  for (c = 0; c < f->n_chans; c++)
+    for (i = 0; i < f->chans[c].n_stages; i++) {
+      free(f->chans[c].stages[i].taps);
+      free(f->chans[c].stages[i].hist);
+    }
+  free(f->scratch);
+  free(f);
+}
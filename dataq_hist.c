@@ -0,0 +1,105 @@
+/* Latency histograms, after HdrHistogram
+ *
+ * Values are nanoseconds, counted in buckets whose width grows with their
+ * magnitude: below DATAQ_HIST_SUB each value has its own bucket, and above
+ * that each power of two is split into DATAQ_HIST_SUB equal steps.  So
+ * anything from a nanosecond to DATAQ_HIST_BITS bits' worth is kept to within
+ * about 6%, in a fixed few kilobytes, and recording is a couple of relaxed
+ * atomic adds, cheap enough for a receive thread while another thread reads.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "dataq.h"
+#include "dataq_private.h"
+
+#define SUB_BITS 4  // log2(DATAQ_HIST_SUB)
+
+static int bucket(const uint64_t v)
+{
+  if (v < DATAQ_HIST_SUB)
+    return v;
+  const int k = 63 - __builtin_clzll(v);  // >= SUB_BITS
+  if (k >= DATAQ_HIST_BITS)
+    return DATAQ_HIST_BUCKETS - 1;
+  const int sub = (v >> (k - SUB_BITS)) - DATAQ_HIST_SUB;
+  return DATAQ_HIST_SUB * (k - SUB_BITS + 1) + sub;
+}
+
+// The largest value that would go in bucket b
+static uint64_t bucket_max(const int b)
+{
+  if (b < DATAQ_HIST_SUB)
+    return b;
+  const int k = b / DATAQ_HIST_SUB + SUB_BITS - 1;
+  const uint64_t sub = b % DATAQ_HIST_SUB;
+  return ((DATAQ_HIST_SUB + sub + 1) << (k - SUB_BITS)) - 1;
+}
+
+void dataq_hist_record(struct dataq_hist_live *h, const int64_t ns)
+{
+  const uint64_t v = ns > 0 ? ns : 0;
+  atomic_fetch_add_explicit(&h->counts[bucket(v)], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->n, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->sum_ns, v, memory_order_relaxed);
+
+  unsigned long long max = atomic_load_explicit(&h->max_ns, memory_order_relaxed);
+  while (v > max
+         && !atomic_compare_exchange_weak_explicit(&h->max_ns, &max, v,
+                                                   memory_order_relaxed,
+                                                   memory_order_relaxed));
+}
+
+// Take a copy of what's been recorded so far
+// NOTE not a snapshot of one instant: n may be a little off the counts' total
+void dataq_hist_read(struct dataq_hist_live *h, struct dataq_hist *out)
+{
+  int b;
+  out->n = atomic_load_explicit(&h->n, memory_order_relaxed);
+  out->sum_ns = atomic_load_explicit(&h->sum_ns, memory_order_relaxed);
+  out->max_ns = atomic_load_explicit(&h->max_ns, memory_order_relaxed);
+  for (b = 0; b < DATAQ_HIST_BUCKETS; b++)
+    out->counts[b] = atomic_load_explicit(&h->counts[b], memory_order_relaxed);
+}
+
+// What was recorded between two reads of the same histogram, e.g. for
+// intervals; max_ns is that of now, the best that can be done
+void dataq_hist_diff(struct dataq_hist *out, const struct dataq_hist *now,
+                     const struct dataq_hist *before)
+{
+  int b;
+  out->n = 0;
+  for (b = 0; b < DATAQ_HIST_BUCKETS; b++) {
+    out->counts[b] = now->counts[b] - before->counts[b];
+    out->n += out->counts[b];
+  }
+  out->sum_ns = now->sum_ns - before->sum_ns;
+  out->max_ns = now->max_ns;
+}
+
+// The value pct percent of those recorded are at or below, in nanoseconds
+// (to within a bucket), or -1 if there are none
+long long dataq_hist_percentile(const struct dataq_hist *h, const double pct)
+{
+  unsigned long long total = 0, want, seen = 0;
+  int b;
+  for (b = 0; b < DATAQ_HIST_BUCKETS; b++)
+    total += h->counts[b];
+  if (total == 0)
+    return -1;
+
+  want = pct / 100 * total + 0.5;
+  if (want < 1)
+    want = 1;
+  for (b = 0; b < DATAQ_HIST_BUCKETS; b++) {
+    seen += h->counts[b];
+    if (seen >= want)
+      break;
+  }
+  if (b == DATAQ_HIST_BUCKETS)
+    b--;
+  const uint64_t v = bucket_max(b);
+  return (h->max_ns && v > h->max_ns) ? (long long) h->max_ns : (long long) v;
+}
@@ -0,0 +1,341 @@
+/* Binary log files
+ *
+ * A log is a struct dataq_log_header describing the acquisition (channels,
+ * scan list, timer settings and scaling), followed by blocks of scans.  Each
+ * block is a struct dataq_log_block giving the timestamp of its first scan and
+ * the spacing of the rest, followed by the scans themselves, interleaved by
+ * channel, either as 14-bit codes in uint16_t (half the size, convert later
+ * with the header's gain and offset) or as float in engineering units.  Or
+ * packed (DATAQ_LOG_PACKED): the block's codes through dataq_pack(), after a
+ * uint32_t giving how many bytes that took (about 60% of the codes themselves
+ * for the simulator's ramp).
+ *
+ * A block with the DATAQ_LOG_GAP flag holds no scans, but marks where some
+ * were lost (e.g. while reconnecting): from t_ns, for period_ns.
+ *
+ * Everything is written in host byte order, which is little-endian on every
+ * machine this has been used with (as is the device itself).
+ *
+ * Writers accumulate blocks in a large buffer and hand it to write() whole,
+ * extending the last block for as long as the scans' timestamps stay on its
+ * line (reconstructed timestamps are good to about a microsecond).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "dataq.h"
+#include "dataq_private.h"
+
+#define LOG_BUFSIZE (1 << 20)  // Bytes accumulated between write()s
+
+struct dataq_log {
+  int fd;
+  struct dataq_log_header hdr;
+  size_t sample_size;
+  uint8_t *buf;
+  size_t len;
+  uint16_t *stage;             // Packed logs: the open block's codes, unpacked
+  struct dataq_log_block blk;  // Block being added to...
+  size_t blk_at;               // ...and where it goes in buf[]
+};
+
+// Fill in a log header from the acquisition settings
+void dataq_log_header_init(struct dataq_log_header *hdr,
+                           const enum dataq_log_format format,
+                           const struct dataq_conv *conv,
+                           const int timerscaler, const int rate_divisor,
+                           const char *scanlist)
+{
+  memset(hdr, 0, sizeof(*hdr));
+  memcpy(hdr->magic, DATAQ_LOG_MAGIC, sizeof(hdr->magic));
+  hdr->version = DATAQ_LOG_VERSION;
+  hdr->format = format;
+  hdr->n_chans = conv->n_chans;
+  hdr->timerscaler = timerscaler;
+  hdr->rate_divisor = rate_divisor;
+  hdr->period = dataq_scan_period(timerscaler, rate_divisor, conv->n_chans);
+  snprintf(hdr->scanlist, sizeof(hdr->scanlist), "%s", scanlist);
+  memcpy(hdr->gain, conv->gain, sizeof(hdr->gain));
+  memcpy(hdr->offset, conv->offset, sizeof(hdr->offset));
+}
+
+static int packed(const struct dataq_log *log)
+{
+  return log->hdr.format == DATAQ_LOG_PACKED;
+}
+
+static size_t sample_size(const enum dataq_log_format format)
+{
+  return format == DATAQ_LOG_FLOAT ? sizeof(float) : sizeof(uint16_t);
+}
+
+// write() all of buf, carrying on after partial writes
+int dataq_write_all(int fd, const void *buf, size_t len)
+{
+  const uint8_t *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      eprintf("Error writing output\n");
+      return -EX_IOERR;
+    }
+    p += n;
+    len -= n;
+  }
+  return EX_OK;
+}
+
+// Start a log on fd (which stays the caller's to close), writing its header
+int dataq_log_open(struct dataq_log **logp, int fd,
+                   const struct dataq_log_header *hdr)
+{
+  if (hdr->format != DATAQ_LOG_CODES && hdr->format != DATAQ_LOG_FLOAT
+      && hdr->format != DATAQ_LOG_PACKED)
+    return -EX_DATAERR;  // Raw captures are written by dataq_capture()
+
+  struct dataq_log *log = calloc(1, sizeof(*log));
+  if (log == NULL)
+    return -EX_OSERR;
+  log->buf = malloc(LOG_BUFSIZE);
+  if (hdr->format == DATAQ_LOG_PACKED)
+    log->stage = malloc(DATAQ_LOG_MAXBLOCK * hdr->n_chans * sizeof(uint16_t));
+  if (log->buf == NULL || (hdr->format == DATAQ_LOG_PACKED && log->stage == NULL)) {
+    free(log->buf);
+    free(log);
+    return -EX_OSERR;
+  }
+  log->fd = fd;
+  log->hdr = *hdr;
+  log->sample_size = sample_size(hdr->format);
+
+  int ret = dataq_write_all(fd, hdr, sizeof(*hdr));
+  if (ret < 0) {
+    free(log->stage);
+    free(log->buf);
+    free(log);
+    return ret;
+  }
+
+  *logp = log;
+  return EX_OK;
+}
+
+// Finish off the open block, if any
+static void close_block(struct dataq_log *log)
+{
+  if (log->blk.n_scans > 0) {
+    memcpy(&log->buf[log->blk_at], &log->blk, sizeof(log->blk));
+    if (packed(log)) {
+      // Room for the most this could take was kept, see dataq_log_write()
+      const uint32_t n = dataq_pack(log->stage, log->blk.n_scans, log->hdr.n_chans,
+                                    &log->buf[log->len]);
+      memcpy(&log->buf[log->len - sizeof(n)], &n, sizeof(n));
+      log->len += n;
+    }
+  }
+  log->blk.n_scans = 0;
+}
+
+// Write out everything so far; the next scan will start a new block
+int dataq_log_flush(struct dataq_log *log)
+{
+  close_block(log);
+  int ret = dataq_write_all(log->fd, log->buf, log->len);
+  log->len = 0;
+  return ret;
+}
+
+static int64_t tv_ns(const struct timeval *tv)
+{
+  return (int64_t) tv->tv_sec * 1000000000 + (int64_t) tv->tv_usec * 1000;
+}
+
+// Append n_scans scans, from values[] or codes[] depending on the log format
+// (either might be NULL if it isn't wanted), with their timestamps tv[]
+// Consecutive scans share a block for as long as their timestamps stay within
+// a microsecond of a straight line, as from dataq_clock_stamp() (or with all
+// the scans of a recv() stamped the same)
+int dataq_log_write(struct dataq_log *log, const float values[],
+                    const uint16_t codes[], const struct timeval tv[],
+                    const int n_scans)
+{
+  const int n_chans = log->hdr.n_chans;
+  const size_t scan_size = n_chans * log->sample_size;
+  const uint8_t *src = (log->hdr.format == DATAQ_LOG_FLOAT)
+                       ? (const uint8_t *) values : (const uint8_t *) codes;
+  struct dataq_log_block *blk = &log->blk;
+  // Packed blocks are staged, then packed into buf[] when they're closed, so
+  // need room there for however large that turns out
+  const size_t extra = packed(log) ? sizeof(uint32_t) : 0;
+  int s;
+
+  for (s = 0; s < n_scans; s++) {
+    const int64_t t = tv_ns(&tv[s]);
+
+    // Does this scan carry on the open block?
+    const size_t room = packed(log) ? DATAQ_PACK_BOUND(blk->n_scans + 1, n_chans)
+                                    : scan_size;
+    int more = blk->n_scans > 0 && blk->n_scans < DATAQ_LOG_MAXBLOCK
+               && log->len + room <= LOG_BUFSIZE;
+    if (more && blk->n_scans > 1)
+      more = fabs(t - (blk->t_ns + blk->n_scans * blk->period_ns)) <= 1000;
+    if (more)
+      blk->period_ns = (double) (t - blk->t_ns) / blk->n_scans;
+
+    // If not, start a new one
+    if (!more) {
+      close_block(log);
+      const size_t first = packed(log) ? DATAQ_PACK_BOUND(1, n_chans) : scan_size;
+      if (log->len + sizeof(*blk) + extra + first > LOG_BUFSIZE) {
+        int ret = dataq_log_flush(log);
+        if (ret < 0)
+          return ret;
+      }
+      blk->t_ns = t;
+      blk->period_ns = 0;
+      log->blk_at = log->len;
+      log->len += sizeof(*blk) + extra;
+    }
+
+    if (packed(log))
+      memcpy(&log->stage[blk->n_scans * n_chans], &src[s * scan_size], scan_size);
+    else {
+      memcpy(&log->buf[log->len], &src[s * scan_size], scan_size);
+      log->len += scan_size;
+    }
+    blk->n_scans++;
+  }
+
+  return EX_OK;
+}
+
+// Note a gap in the scans, between the last one written and the next
+int dataq_log_gap(struct dataq_log *log, const struct dataq_gap *gap)
+{
+  close_block(log);
+  if (log->len + sizeof(log->blk) > LOG_BUFSIZE) {
+    int ret = dataq_log_flush(log);
+    if (ret < 0)
+      return ret;
+  }
+
+  const int64_t start = tv_ns(&gap->start);
+  const struct dataq_log_block blk = {
+    .t_ns = start,
+    .period_ns = tv_ns(&gap->end) - start,
+    .n_scans = 0,
+    .flags = DATAQ_LOG_GAP,
+  };
+  memcpy(&log->buf[log->len], &blk, sizeof(blk));
+  log->len += sizeof(blk);
+  return EX_OK;
+}
+
+// Flush what's buffered and free the log (but don't close its fd)
+int dataq_log_close(struct dataq_log *log)
+{
+  int ret = dataq_log_flush(log);
+  free(log->stage);
+  free(log->buf);
+  free(log);
+  return ret;
+}
+
+/*
+ *  Reading
+ */
+
+// Read and check a log header (or the header of a raw capture index)
+int dataq_log_read_header(FILE *f, struct dataq_log_header *hdr)
+{
+  if (fread(hdr, sizeof(*hdr), 1, f) != 1) {
+    eprintf("Error reading log header\n");
+    return -EX_IOERR;
+  }
+  if (memcmp(hdr->magic, DATAQ_LOG_MAGIC, sizeof(hdr->magic))) {
+    eprintf("Not a dataq log\n");
+    return -EX_DATAERR;
+  }
+  if (hdr->version != DATAQ_LOG_VERSION) {
+    eprintf("Unsupported log version %d\n", hdr->version);
+    return -EX_DATAERR;
+  }
+  if (hdr->n_chans < 1 || hdr->n_chans > DATAQ_MAXCHAN
+      || (hdr->format != DATAQ_LOG_CODES && hdr->format != DATAQ_LOG_FLOAT
+          && hdr->format != DATAQ_LOG_RAW && hdr->format != DATAQ_LOG_PACKED)) {
+    eprintf("Corrupt log header\n");
+    return -EX_DATAERR;
+  }
+  return EX_OK;
+}
+
+// Read the next block of scans, converted to engineering units if need be
+// values[] must hold DATAQ_LOG_MAXBLOCK * n_chans
+// Returns the number of scans, or 0 for a gap (blk->flags & DATAQ_LOG_GAP)
+// or at the end of the log (with blk->flags clear)
+int dataq_log_read_block(FILE *f, const struct dataq_log_header *hdr,
+                         struct dataq_log_block *blk, float values[])
+{
+  const int n_chans = hdr->n_chans;
+
+  if (hdr->format == DATAQ_LOG_RAW)
+    return -EX_DATAERR;
+  if (fread(blk, sizeof(*blk), 1, f) != 1) {
+    blk->flags = 0;
+    return feof(f) ? 0 : -EX_IOERR;
+  }
+  if (blk->flags & DATAQ_LOG_GAP)
+    return 0;
+  if (blk->n_scans > DATAQ_LOG_MAXBLOCK) {
+    eprintf("Corrupt log block\n");
+    return -EX_DATAERR;
+  }
+
+  const size_t n = blk->n_scans * n_chans;
+  if (hdr->format == DATAQ_LOG_FLOAT) {
+    if (fread(values, sizeof(float), n, f) != n)
+      return -EX_IOERR;
+    return blk->n_scans;
+  }
+
+  // Codes are read into the back half of values[], then expanded forwards
+  uint16_t *codes = (uint16_t *) &values[n] - n;
+  if (hdr->format == DATAQ_LOG_PACKED) {
+    uint32_t len;
+    if (fread(&len, sizeof(len), 1, f) != 1)
+      return -EX_IOERR;
+    if (len > DATAQ_PACK_BOUND(blk->n_scans, n_chans)) {
+      eprintf("Corrupt log block\n");
+      return -EX_DATAERR;
+    }
+    uint8_t *in = malloc(len);
+    if (in == NULL)
+      return -EX_OSERR;
+    int ret = EX_OK;
+    if (fread(in, 1, len, f) != len)
+      ret = -EX_IOERR;
+    else if (dataq_unpack(in, len, blk->n_scans, n_chans, codes) != len) {
+      eprintf("Corrupt log block\n");
+      ret = -EX_DATAERR;
+    }
+    free(in);
+    if (ret < 0)
+      return ret;
+  }
+  else if (fread(codes, sizeof(uint16_t), n, f) != n)
+    return -EX_IOERR;
+  size_t i;
+  for (i = 0; i < n; i++) {
+    const int c = i % n_chans;
+    values[i] = hdr->gain[c] * (((1.0 * codes[i]) / (1 << 13)) - 1) + hdr->offset[c];
+  }
+  return blk->n_scans;
+}
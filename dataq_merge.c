@@ -0,0 +1,263 @@
+/* Merging several devices' streams into one, aligned in time
+ *
+ * Each unit samples on its own crystal, so their scans never quite line up,
+ * and they arrive in separate batches at unrelated times.  Given timestamps
+ * from each device's sample clock (see dataq_clock.c), which already estimate
+ * each one's offset and drift against the system clock, the merge buffers
+ * every device's scans in a ring and walks them forward together: each scan
+ * of the reference device (the first) becomes one wide frame, holding every
+ * device's channels as sampled nearest that time.
+ *
+ * A frame is only made once every other device has a scan at or after its
+ * time, so the nearest one is known for sure; a device that goes away is
+ * filled in with NAN from then on rather than holding up the rest.  So is one
+ * with no scan near enough, within about one of its own scan periods: before
+ * it has started, and in its gaps.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <math.h>
+
+#include "dataq.h"
+#include "dataq_private.h"
+
+#define MERGE_BATCH 256  // Frames handed to the callback at once
+
+struct merge_dev {
+  int n_chans;
+  int column;            // Where its channels start in a frame
+  int gone;
+  size_t cap;            // Ring capacity in scans, a power of two
+  size_t head, tail;     // Free-running
+  float *values;         // cap * n_chans
+  int64_t *t_ns;         // cap
+  int64_t spacing_ns;    // Between its scans, roughly, or 0 if not yet known
+};
+
+struct dataq_merge {
+  int n_devs;
+  int width;             // Channels in a frame
+  struct merge_dev *devs;
+  dataq_merge_fn fn;
+  void *arg;
+  unsigned long long dropped;
+  float *frames;         // MERGE_BATCH * width
+  struct timeval tv[MERGE_BATCH];
+};
+
+static int64_t tv_ns(const struct timeval *tv)
+{
+  return (int64_t) tv->tv_sec * 1000000000 + (int64_t) tv->tv_usec * 1000;
+}
+
+// Set up to merge n_devs devices with n_chans[] channels each, buffering up to
+// ring_scans scans per device (rounded up to a power of two) to cover how far
+// they can get ahead of one another, and handing frames to fn, with arg
+int dataq_merge_open(struct dataq_merge **mp, const int n_devs,
+                     const int n_chans[], const int ring_scans,
+                     dataq_merge_fn fn, void *arg)
+{
+  if (n_devs < 1 || ring_scans < 1)
+    return -EX_DATAERR;
+
+  struct dataq_merge *m = calloc(1, sizeof(*m));
+  if (m == NULL)
+    return -EX_OSERR;
+  m->n_devs = n_devs;
+  m->fn = fn;
+  m->arg = arg;
+
+  if ((m->devs = calloc(n_devs, sizeof(*m->devs))) == NULL)
+    goto fail;
+  int d;
+  for (d = 0; d < n_devs; d++) {
+    struct merge_dev *dev = &m->devs[d];
+    if (n_chans[d] < 1 || n_chans[d] > DATAQ_MAXCHAN) {
+      dataq_merge_close(m);
+      return -EX_DATAERR;
+    }
+    dev->n_chans = n_chans[d];
+    dev->column = m->width;
+    m->width += n_chans[d];
+    for (dev->cap = 1; dev->cap < (size_t) ring_scans; dev->cap <<= 1);
+    dev->values = malloc(dev->cap * dev->n_chans * sizeof(float));
+    dev->t_ns = malloc(dev->cap * sizeof(int64_t));
+    if (dev->values == NULL || dev->t_ns == NULL)
+      goto fail;
+  }
+  if ((m->frames = malloc(MERGE_BATCH * m->width * sizeof(float))) == NULL)
+    goto fail;
+
+  *mp = m;
+  return EX_OK;
+
+fail:
+  dataq_merge_close(m);
+  return -EX_OSERR;
+}
+
+static int64_t scan_ns(const struct merge_dev *dev, size_t k)
+{
+  return dev->t_ns[k & (dev->cap - 1)];
+}
+
+static const float *scan_values(const struct merge_dev *dev, size_t k)
+{
+  return &dev->values[(k & (dev->cap - 1)) * dev->n_chans];
+}
+
+// Can a frame be made at time t?  Only if every device still with us has a
+// scan at or after it
+static int ready(const struct dataq_merge *m, int64_t t)
+{
+  int d;
+  for (d = 1; d < m->n_devs; d++) {
+    const struct merge_dev *dev = &m->devs[d];
+    if (!dev->gone && (dev->tail == dev->head || scan_ns(dev, dev->tail - 1) < t))
+      return 0;
+  }
+  return 1;
+}
+
+// Fill in a device's part of a frame with NAN, for no data
+static void missing(float frame[], const struct merge_dev *dev)
+{
+  int c;
+  for (c = 0; c < dev->n_chans; c++)
+    frame[dev->column + c] = NAN;
+}
+
+// Hand over the frames made so far
+static int emit(struct dataq_merge *m, int *n_frames)
+{
+  int ret = 0;
+  if (*n_frames > 0)
+    ret = m->fn(m->arg, m->frames, m->width, m->tv, *n_frames);
+  *n_frames = 0;
+  return ret;
+}
+
+// Make as many frames as the buffered scans allow
+static int merge(struct dataq_merge *m)
+{
+  struct merge_dev *ref = &m->devs[0];
+  int n_frames = 0;
+
+  while (ref->head != ref->tail) {
+    const int64_t t = scan_ns(ref, ref->head);
+    if (!ready(m, t))
+      break;
+
+    float *frame = &m->frames[n_frames * m->width];
+    memcpy(frame, scan_values(ref, ref->head), ref->n_chans * sizeof(float));
+
+    int d;
+    for (d = 1; d < m->n_devs; d++) {
+      struct merge_dev *dev = &m->devs[d];
+      if (dev->gone && (dev->head == dev->tail || scan_ns(dev, dev->tail - 1) < t)) {
+        // Gone, and nothing left of it by now
+        missing(frame, dev);
+        continue;
+      }
+
+      // Move up to the last scan at or before t, then take whichever of it
+      // and the next is nearer, if either's near enough
+      while (dev->head + 1 != dev->tail && scan_ns(dev, dev->head + 1) <= t)
+        dev->head++;
+      size_t k = dev->head;
+      if (scan_ns(dev, k) > t) {
+        missing(frame, dev);  // Not started yet
+        continue;
+      }
+      if (k + 1 != dev->tail
+          && llabs(scan_ns(dev, k + 1) - t) < llabs(scan_ns(dev, k) - t))
+        k++;
+      const int64_t near = dev->spacing_ns ? dev->spacing_ns : ref->spacing_ns;
+      if (near && llabs(scan_ns(dev, k) - t) > near)
+        missing(frame, dev);  // In a gap
+      else
+        memcpy(&frame[dev->column], scan_values(dev, k), dev->n_chans * sizeof(float));
+    }
+
+    m->tv[n_frames].tv_sec = t / 1000000000;
+    m->tv[n_frames].tv_usec = (t % 1000000000) / 1000;
+    ref->head++;
+
+    if (++n_frames == MERGE_BATCH) {
+      int ret = emit(m, &n_frames);
+      if (ret != 0)
+        return ret;
+    }
+  }
+  return emit(m, &n_frames);
+}
+
+// Add a batch of scans from device dev, making whatever frames can now be made
+// Has the same form as dataq_multi_fn, so may be given to dataq_multi_open()
+// directly, with the merge as arg; likewise n_scans < 0 means dev has gone
+// Returns the frame callback's nonzero return, or else 0
+int dataq_merge_push(void *arg, int dev, const float values[],
+                     const uint16_t codes[], const struct timeval tv[],
+                     int n_scans)
+{
+  (void) codes;  // Frames are of values only
+  struct dataq_merge *m = arg;
+  if (dev < 0 || dev >= m->n_devs)
+    return 0;
+  struct merge_dev *md = &m->devs[dev];
+
+  if (n_scans < 0) {
+    md->gone = 1;
+    if (dev == 0) {
+      eprintf("Reference device has gone, no more merged frames\n");
+      return n_scans;
+    }
+    return merge(m);
+  }
+
+  int s;
+  for (s = 0; s < n_scans; s++) {
+    // If the others are so far behind that the ring fills, lose the oldest
+    if (md->tail - md->head == md->cap) {
+      md->head++;
+      m->dropped++;
+    }
+    const size_t slot = md->tail & (md->cap - 1);
+    memcpy(&md->values[slot * md->n_chans], &values[s * md->n_chans],
+           md->n_chans * sizeof(float));
+    md->t_ns[slot] = tv_ns(&tv[s]);
+
+    // Track the spacing, settling on the usual one rather than any gap's
+    if (md->tail != md->head) {
+      const int64_t d = md->t_ns[slot] - scan_ns(md, md->tail - 1);
+      if (d > 0 && (md->spacing_ns == 0 || d < 2 * md->spacing_ns))
+        md->spacing_ns = md->spacing_ns ? (7 * md->spacing_ns + d) / 8 : d;
+    }
+    md->tail++;
+  }
+
+  return merge(m);
+}
+
+// Scans lost because a device got more than ring_scans ahead of the others
+unsigned long long dataq_merge_dropped(const struct dataq_merge *m)
+{
+  return m->dropped;
+}
+
+void dataq_merge_close(struct dataq_merge *m)
+{
+  if (m->devs != NULL) {
+    int d;
+    for (d = 0; d < m->n_devs; d++) {
+      free(m->devs[d].values);
+      free(m->devs[d].t_ns);
+    }
+  }
+  free(m->devs);
+  free(m->frames);
+  free(m);
+}
@@ -0,0 +1,377 @@
+/* Multi-device acquisition: many units served by one thread
+ *
+ * A test stand has several DI-718Bs streaming at once.  Rather than a thread
+ * or process per unit, each one's socket is made non-blocking and they are all
+ * watched from a single event loop (epoll on Linux, kqueue on the BSDs and
+ * macOS), which hands each device's decoded scans to a callback as they come.
+ *
+ * Each device has its own struct dataq_rx, so partial scans and resyncs are
+ * tracked per device exactly as with dataq_recv_batch() on its own, and its
+ * own sample clock for timestamps.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+  #include <sys/epoll.h>
+  #define HAVE_EPOLL 1
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+  #include <sys/event.h>
+  #define HAVE_KQUEUE 1
+#else
+  #error "No epoll or kqueue on this platform"
+#endif
+
+#include "dataq.h"
+#include "dataq_private.h"
+
+#define TIMEOUT_MS 1000  // Complain if no device has sent anything for this long
+#define MAX_EVENTS 64    // Ready devices handled per wakeup
+
+struct multi_dev {
+  int sockfd;
+  struct dataq_rx rx;
+  struct dataq_clock clock;
+  long long skipped;     // rx.skipped already accounted to the clock
+  double period;         // Seconds between scans
+  float values[DATAQ_RXBUF];
+  struct timeval tv[DATAQ_RXBUF];
+};
+
+struct dataq_multi {
+  int pollfd;                  // epoll or kqueue
+  struct dataq_stop stop;
+  struct dataq_session_opts opts;
+  dataq_multi_fn fn;
+  void *arg;
+  struct multi_dev **devs;     // NULL once a device has gone
+  int n_devs;
+  int n_live;
+};
+
+/*
+ *  Event loop backends
+ *
+ *  Each watched fd is registered with a pointer that comes back when it's
+ *  ready: the device, or NULL for the stop handle.
+ */
+
+static int poller_create(void)
+{
+#ifdef HAVE_EPOLL
+  return epoll_create1(EPOLL_CLOEXEC);
+#else
+  int fd = kqueue();
+  if (fd >= 0)
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  return fd;
+#endif
+}
+
+static int poller_add(int pollfd, int fd, void *ptr)
+{
+#ifdef HAVE_EPOLL
+  struct epoll_event ev = {.events = EPOLLIN,.data.ptr = ptr };
+  return epoll_ctl(pollfd, EPOLL_CTL_ADD, fd, &ev);
+#else
+  struct kevent ev;
+  EV_SET(&ev, fd, EVFILT_READ, EV_ADD, 0, 0, ptr);
+  return kevent(pollfd, &ev, 1, NULL, 0, NULL);
+#endif
+}
+
+static void poller_del(int pollfd, int fd)
+{
+#ifdef HAVE_EPOLL
+  struct epoll_event ev = { 0 };
+  epoll_ctl(pollfd, EPOLL_CTL_DEL, fd, &ev);
+#else
+  struct kevent ev;
+  EV_SET(&ev, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+  kevent(pollfd, &ev, 1, NULL, 0, NULL);
+#endif
+}
+
+// Wait for up to max fds to be ready, filling in their pointers
+// Returns how many, 0 on timeout, or -1 with errno set
+static int poller_wait(int pollfd, void *ready[], int max, int timeout_ms)
+{
+  int n, i;
+#ifdef HAVE_EPOLL
+  struct epoll_event evs[MAX_EVENTS];
+  if (max > MAX_EVENTS)
+    max = MAX_EVENTS;
+  n = epoll_wait(pollfd, evs, max, timeout_ms);
+  for (i = 0; i < n; i++)
+    ready[i] = evs[i].data.ptr;
+#else
+  struct kevent evs[MAX_EVENTS];
+  const struct timespec ts = {
+    .tv_sec = timeout_ms / 1000,.tv_nsec = (timeout_ms % 1000) * 1000000L
+  };
+  if (max > MAX_EVENTS)
+    max = MAX_EVENTS;
+  n = kevent(pollfd, NULL, 0, evs, max, &ts);
+  for (i = 0; i < n; i++)
+    ready[i] = evs[i].udata;
+#endif
+  return n;
+}
+
+/*
+ *  Devices
+ */
+
+// Create a manager that will hand each device's scans to fn, with arg
+// opts may be NULL for defaults; opts->timestamps and opts->sock apply to
+// every device
+int dataq_multi_open(struct dataq_multi **mp,
+                     const struct dataq_session_opts *opts,
+                     dataq_multi_fn fn, void *arg)
+{
+  struct dataq_multi *m = calloc(1, sizeof(*m));
+  if (m == NULL)
+    return -EX_OSERR;
+  if (opts != NULL)
+    m->opts = *opts;
+  m->fn = fn;
+  m->arg = arg;
+
+  int ret;
+  if ((m->pollfd = poller_create()) < 0) {
+    eprintf("Error creating event loop\n");
+    free(m);
+    return -EX_OSERR;
+  }
+  if ((ret = dataq_stop_init(&m->stop)) < 0) {
+    close(m->pollfd);
+    free(m);
+    return ret;
+  }
+  if (poller_add(m->pollfd, m->stop.fds[0], NULL) < 0) {
+    eprintf("Error adding to event loop\n");
+    dataq_stop_close(&m->stop);
+    close(m->pollfd);
+    free(m);
+    return -EX_OSERR;
+  }
+
+  *mp = m;
+  return EX_OK;
+}
+
+// Disconnect a device and forget about it
+static void drop_dev(struct dataq_multi *m, const int d)
+{
+  struct multi_dev *dev = m->devs[d];
+  poller_del(m->pollfd, dev->sockfd);
+  dataq_close_period(dev->sockfd, dev->period);
+  free(dev);
+  m->devs[d] = NULL;
+  m->n_live--;
+}
+
+// Take on a device that's already connected and streaming, e.g. from
+// dataq_connect(), which from now on is the manager's to close
+// NOTE conv is used in place, so must outlive the manager
+// On success, returns the device's number (counting from 0), as given to fn
+int dataq_multi_attach(struct dataq_multi *m, int sockfd,
+                       const int timerscaler, const int rate_divisor,
+                       const struct dataq_conv *conv)
+{
+  struct multi_dev **devs = realloc(m->devs, (m->n_devs + 1) * sizeof(*devs));
+  if (devs == NULL)
+    return -EX_OSERR;
+  m->devs = devs;
+
+  struct multi_dev *dev = malloc(sizeof(*dev));
+  if (dev == NULL)
+    return -EX_OSERR;
+
+  dev->sockfd = sockfd;
+  fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+  dataq_rx_init(&dev->rx, sockfd, conv);
+  dev->rx.nonblock = 1;
+  dev->rx.timestamping = m->opts.sock.timestamping;
+  dev->skipped = 0;
+  dev->period = dataq_scan_period(timerscaler, rate_divisor, conv->n_chans);
+  if (m->opts.timestamps != DATAQ_TS_ARRIVAL)
+    dataq_clock_init(&dev->clock, m->opts.timestamps == DATAQ_TS_MONOTONIC
+                                  ? CLOCK_MONOTONIC : CLOCK_REALTIME,
+                     dev->period);
+
+  if (poller_add(m->pollfd, sockfd, dev) < 0) {
+    eprintf("Error adding to event loop\n");
+    free(dev);
+    return -EX_OSERR;
+  }
+
+  m->devs[m->n_devs] = dev;
+  m->n_live++;
+  return m->n_devs++;
+}
+
+// Connect to a device and start it streaming, as dataq_connect_opts() with
+// the manager's opts.sock
+// NOTE conv is used in place, so must outlive the manager
+// On success, returns the device's number (counting from 0), as given to fn
+int dataq_multi_add(struct dataq_multi *m, const char *hostname,
+                    const uint16_t portno, const int timerscaler,
+                    const int rate_divisor, const char *scanlist,
+                    const struct dataq_conv *conv)
+{
+  int sockfd = dataq_connect_opts(hostname, portno, timerscaler, rate_divisor,
+                                  scanlist, conv->n_chans, &m->opts.sock);
+  if (sockfd < 0)
+    return sockfd;
+
+  int ret = dataq_multi_attach(m, sockfd, timerscaler, rate_divisor, conv);
+  if (ret < 0)
+    dataq_close_period(sockfd, dataq_scan_period(timerscaler, rate_divisor,
+                                                 conv->n_chans));
+  return ret;
+}
+
+// Connect to n_devs devices at once (see dataq_connect_many()), all with the
+// same settings, numbering them in the order given
+// If any fails, none are added, and returns the first failure
+// On success, returns the first one's number
+int dataq_multi_add_many(struct dataq_multi *m, const int n_devs,
+                         const char *const hostnames[], const uint16_t portno,
+                         const int timerscaler, const int rate_divisor,
+                         const char *scanlist, const struct dataq_conv *conv)
+{
+  if (n_devs < 1)
+    return -EX_DATAERR;
+  int *sockfds = malloc(n_devs * sizeof(*sockfds));
+  if (sockfds == NULL)
+    return -EX_OSERR;
+  int d;
+  for (d = 0; d < n_devs; d++)
+    sockfds[d] = -1;  // In case none are even tried
+  int ret = dataq_connect_many(sockfds, n_devs, hostnames, portno, timerscaler,
+                               rate_divisor, scanlist, conv->n_chans,
+                               &m->opts.sock);
+
+  const double period = dataq_scan_period(timerscaler, rate_divisor, conv->n_chans);
+  const int first = m->n_devs;
+  for (d = 0; d < n_devs && ret >= 0; d++)
+    if ((ret = dataq_multi_attach(m, sockfds[d], timerscaler, rate_divisor, conv)) < 0)
+      dataq_close_period(sockfds[d], period);
+  if (ret >= 0) {
+    free(sockfds);
+    return first;
+  }
+
+  // Undo the lot
+  for (; d < n_devs; d++)
+    if (sockfds[d] >= 0)
+      dataq_close_period(sockfds[d], period);
+  free(sockfds);
+  while (m->n_devs > first) {
+    m->n_devs--;
+    drop_dev(m, m->n_devs);
+  }
+  return ret;
+}
+
+// Take in what one ready device has, passing it to the callback
+// Returns the callback's nonzero return, or else 0
+static int service(struct dataq_multi *m, const int d)
+{
+  struct multi_dev *dev = m->devs[d];
+  const int n_chans = dev->rx.n_chans;
+  const int scan_bytes = 2 * n_chans;
+
+  struct timeval tv;
+  int ret = dataq_recv_batch(&dev->rx, dev->values, DATAQ_RXBUF / n_chans, &tv);
+  if (ret == -EX_TEMPFAIL)
+    return 0;  // Only part of a scan so far
+  if (ret < 0) {
+    eprintf("Lost device %d\n", d);
+    drop_dev(m, d);
+    return m->fn(m->arg, d, NULL, NULL, NULL, ret);
+  }
+
+  if (m->opts.timestamps == DATAQ_TS_ARRIVAL) {
+    int i;
+    for (i = 0; i < ret; i++)
+      dev->tv[i] = tv;
+  }
+  else {
+    if (dev->rx.skipped != dev->skipped) {
+      long long lost = dev->rx.skipped - dev->skipped;
+      dataq_clock_skip(&dev->clock, (lost + scan_bytes / 2) / scan_bytes);
+      dev->skipped = dev->rx.skipped;
+    }
+    dataq_clock_stamp(&dev->clock, ret, dev->tv);
+  }
+
+  return m->fn(m->arg, d, dev->values, dev->rx.codes, dev->tv, ret);
+}
+
+// Serve all the devices until dataq_multi_stop(), the callback returns
+// nonzero, or every device has gone
+// Returns EX_OK, the callback's nonzero return, or a negated EX_ code
+int dataq_multi_run(struct dataq_multi *m)
+{
+  while (m->n_live > 0) {
+    void *ready[MAX_EVENTS];
+    int n = poller_wait(m->pollfd, ready, MAX_EVENTS, TIMEOUT_MS);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      eprintf("Error waiting for devices\n");
+      return -EX_IOERR;
+    }
+    if (n == 0)
+      eprintf("Timeout reading from devices\n");
+
+    int i;
+    for (i = 0; i < n; i++) {
+      if (ready[i] == NULL) {
+        dprintf("Stopped\n");
+        return EX_OK;
+      }
+
+      // Find which device it is, unless it's gone since the wakeup
+      struct multi_dev *dev = ready[i];
+      int d;
+      for (d = 0; d < m->n_devs && m->devs[d] != dev; d++);
+      if (d == m->n_devs)
+        continue;
+
+      int ret = service(m, d);
+      if (ret != 0)
+        return ret;
+    }
+  }
+  return EX_OK;
+}
+
+// Make dataq_multi_run() return
+// NOTE async-signal-safe, so may be called from a signal handler
+void dataq_multi_stop(struct dataq_multi *m)
+{
+  dataq_stop_signal(&m->stop);
+}
+
+// Disconnect all the devices and free the manager
+void dataq_multi_close(struct dataq_multi *m)
+{
+  int d;
+  for (d = 0; d < m->n_devs; d++)
+    if (m->devs[d] != NULL)
+      drop_dev(m, d);
+  free(m->devs);
+  dataq_stop_close(&m->stop);
+  close(m->pollfd);
+  free(m);
+}
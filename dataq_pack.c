@@ -0,0 +1,160 @@
+/* Lossless packing of blocks of 14-bit codes: per-channel deltas, bit-packed
+ *
+ * Neighbouring samples on a channel are usually close, so each channel of a
+ * block is stored as its first code, then the differences from one scan to
+ * the next, zigzag-encoded (small magnitudes of either sign become small
+ * unsigned numbers) and packed, in groups of PACK_GROUP, at just the width
+ * the largest in the group needs:
+ *
+ *   for each channel:  uint16_t first
+ *     for each group:  uint8_t width, then up to PACK_GROUP values of width
+ *                      bits, least significant first, padded to a whole byte
+ *
+ * A quiet channel packs to a few bits a sample, a flat one to none at all,
+ * and a step or spike only widens its own group; at worst (full-scale noise)
+ * it takes 15 bits, never more than the codes themselves plus a little.
+ * Blocks stand alone, so a damaged or missing block costs only its own scans,
+ * and any block can be unpacked without the rest.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+#include "dataq.h"
+#include "dataq_private.h"
+
+#define PACK_GROUP 128   // Deltas sharing a width
+
+static inline uint16_t zigzag(const int d)
+{
+  return (d << 1) ^ (d >> 31);
+}
+
+static inline int unzigzag(const uint16_t z)
+{
+  return (z >> 1) ^ -(z & 1);
+}
+
+// Pack n_scans scans of codes[] (interleaved, n_chans per scan) into out[],
+// which must hold DATAQ_PACK_BOUND(n_scans, n_chans) bytes
+// Returns the number of bytes used
+size_t dataq_pack(const uint16_t codes[], const int n_scans, const int n_chans,
+                  uint8_t out[])
+{
+  uint8_t *p = out;
+  int s0, c;
+
+  // In pieces of at most a log block
+  for (s0 = 0; s0 < n_scans; s0 += DATAQ_LOG_MAXBLOCK) {
+    const int n = n_scans - s0 < DATAQ_LOG_MAXBLOCK ? n_scans - s0 : DATAQ_LOG_MAXBLOCK;
+    for (c = 0; c < n_chans; c++) {
+      const uint16_t *src = &codes[(size_t) s0 * n_chans + c];
+      p[0] = src[0] & 0xFF;
+      p[1] = src[0] >> 8;
+      p += 2;
+
+      int g;
+      for (g = 1; g < n; g += PACK_GROUP) {
+        const int m = n - g < PACK_GROUP ? n - g : PACK_GROUP;
+        uint16_t deltas[PACK_GROUP], any = 0;
+        int i;
+        for (i = 0; i < m; i++) {
+          const int k = (g + i) * n_chans;
+          deltas[i] = zigzag(src[k] - src[k - n_chans]);
+          any |= deltas[i];
+        }
+        const int width = any ? 32 - __builtin_clz(any) : 0;
+        *p++ = width;
+        if (width == 0)
+          continue;
+
+        uint64_t bits = 0;
+        int n_bits = 0;
+        for (i = 0; i < m; i++) {
+          bits |= (uint64_t) deltas[i] << n_bits;
+          n_bits += width;
+          if (n_bits >= 32) {
+            p[0] = bits;
+            p[1] = bits >> 8;
+            p[2] = bits >> 16;
+            p[3] = bits >> 24;
+            p += 4;
+            bits >>= 32;
+            n_bits -= 32;
+          }
+        }
+        for (; n_bits > 0; n_bits -= 8) {
+          *p++ = bits;
+          bits >>= 8;
+        }
+      }
+    }
+  }
+  return p - out;
+}
+
+// Unpack n_scans scans of n_chans channels from the len bytes at in[] into
+// codes[], interleaved
+// Returns the number of bytes used, or 0 if in[] is short or malformed, codes
+// outside 14 bits included
+size_t dataq_unpack(const uint8_t in[], const size_t len, const int n_scans,
+                    const int n_chans, uint16_t codes[])
+{
+  const uint8_t *p = in, *end = in + len;
+  int s0, c;
+
+  for (s0 = 0; s0 < n_scans; s0 += DATAQ_LOG_MAXBLOCK) {
+    const int n = n_scans - s0 < DATAQ_LOG_MAXBLOCK ? n_scans - s0 : DATAQ_LOG_MAXBLOCK;
+    for (c = 0; c < n_chans; c++) {
+      if (end - p < 2)
+        return 0;
+      uint16_t *dst = &codes[(size_t) s0 * n_chans + c];
+      int v = p[0] | (p[1] << 8);
+      p += 2;
+      if (v >= DATAQ_CODES)
+        return 0;
+      dst[0] = v;
+
+      int g;
+      for (g = 1; g < n; g += PACK_GROUP) {
+        const int m = n - g < PACK_GROUP ? n - g : PACK_GROUP;
+        if (p == end)
+          return 0;
+        const int width = *p++;
+        const size_t n_bytes = ((size_t) m * width + 7) / 8;
+        if (width > 16 || (size_t) (end - p) < n_bytes)
+          return 0;
+
+        int i;
+        if (width == 0) {
+          for (i = 0; i < m; i++)
+            dst[(g + i) * n_chans] = v;
+          continue;
+        }
+
+        const uint32_t mask = (1u << width) - 1;
+        uint64_t bits = 0;
+        int n_bits = 0;
+        const uint8_t *q = p;
+        unsigned seen = 0;  // Any bits outside 14 of any code, negative too
+        for (i = 0; i < m; i++) {
+          while (n_bits < width) {
+            bits |= (uint64_t) *q++ << n_bits;
+            n_bits += 8;
+          }
+          v += unzigzag(bits & mask);
+          seen |= v;
+          dst[(g + i) * n_chans] = v;
+          bits >>= width;
+          n_bits -= width;
+        }
+        if (seen & ~(DATAQ_CODES - 1u))
+          return 0;
+        p += n_bytes;
+      }
+    }
+  }
+  return p - in;
+}
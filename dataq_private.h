@@ -0,0 +1,62 @@
+#ifndef __DATAQ_PRIVATE_H__
+#define __DATAQ_PRIVATE_H__
+
+// Internal helpers shared between the library's source files
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+// Error message printing
+#ifdef EPRINT
+  #define eprintf(...) fprintf(stderr, __VA_ARGS__)
+#else
+  #define eprintf(...) ((void)0)
+#endif
+
+// Debug message printing
+#ifdef DPRINT
+  #define dprintf(...) fprintf(stderr, __VA_ARGS__)
+#else
+  #define dprintf(...) ((void)0)
+#endif
+
+int dataq_write_all(int fd, const void *buf, size_t len);
+
+// Receive primitives behind dataq_recv_batch(), see dataq.c
+struct dataq_stop;
+int dataq_recv_data(int sockfd, void *buf, size_t len, int flags,
+                    const struct dataq_stop *stop, struct timeval *kts);
+
+int dataq_find_sync(const uint8_t bytes[], const int len, const int n_chans);
+
+struct dataq_rx;
+int dataq_rx_parse(struct dataq_rx *rx, float values[], float *const cols[],
+                   const int limit);
+
+// A device's addresses, in the order to try them, see dataq_resolve.c
+#define DATAQ_MAXADDRS 8
+struct dataq_addrs {
+  int n;
+  struct sockaddr_storage addr[DATAQ_MAXADDRS];
+  socklen_t len[DATAQ_MAXADDRS];
+};
+
+int dataq_resolve(const char *hostname, const uint16_t portno,
+                  struct dataq_addrs *addrs);
+
+void dataq_resolve_forget(const char *hostname, const uint16_t portno);
+
+// A struct dataq_hist being recorded into, see dataq_hist.c
+struct dataq_hist_live {
+  _Atomic unsigned long long n;
+  _Atomic unsigned long long sum_ns;
+  _Atomic unsigned long long max_ns;
+  _Atomic unsigned long long counts[DATAQ_HIST_BUCKETS];
+};
+
+void dataq_hist_record(struct dataq_hist_live *h, const int64_t ns);
+
+void dataq_hist_read(struct dataq_hist_live *h, struct dataq_hist *out);
+
+#endif // __DATAQ_PRIVATE_H__
@@ -0,0 +1,540 @@
+/* Replay of recorded streams through the decoder, as fast as it will go
+ *
+ * Two kinds of recording are understood, told apart by their first bytes:
+ *
+ *  - Raw captures from dataq_capture(): the device's bytes as they came, with
+ *    an index alongside (FILE.idx) holding the acquisition's header and
+ *    arrival times by offset.  Without the index there are no timestamps,
+ *    and the channel count has to be given.
+ *
+ *  - pcap files of the TCP session, e.g. from tcpdump or Wireshark (pcapng
+ *    needs converting first: editcap -F pcap).  The device's side of the
+ *    first connection from its port is put back together in sequence order,
+ *    the echoed commands at its start are read for the settings (how many
+ *    channels, scan list and timer), and the sample words after S3 replayed,
+ *    each batch stamped with the capture time of the packet it ended in.
+ *
+ * Either way the file is mapped rather than read, and its bytes are copied
+ * from the mapping into the struct dataq_rx a buffer at a time, to go
+ * through the same parsing as dataq_recv_batch().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dataq.h"
+#include "dataq_private.h"
+
+#define PCAP_MAGIC 0xA1B2C3D4      // Microsecond timestamps
+#define PCAP_MAGIC_NS 0xA1B23C4D   // Nanosecond timestamps
+#define PCAPNG_MAGIC 0x0A0D0D0A
+#define PCAP_HEADER 24
+#define PCAP_RECORD 16
+
+// Link types
+#define LINK_NULL 0                // BSD loopback
+#define LINK_ETHERNET 1
+#define LINK_RAW 101
+#define LINK_SLL 113               // Linux "any" device
+#define LINK_SLL2 276
+
+enum source { SRC_RAW, SRC_PCAP };
+
+struct dataq_replay {
+  enum source source;
+  struct dataq_log_header hdr;
+  const uint8_t *map;
+  size_t size;
+  size_t pos;                // Next byte of the file to take
+
+  // Raw: arrival times by offset
+  struct dataq_index_record *index;
+  size_t n_index, next_index;
+
+  // pcap: the packet being taken from, and the device's side of the session
+  int swapped, nanosecs, link;
+  uint16_t portno;
+  const uint8_t *seg;        // Payload not yet taken...
+  size_t seg_len;
+  int64_t seg_ns;            // ...and its capture time
+  int have_conn;
+  uint8_t conn[36];          // Addresses and client port, to pick one session
+  size_t conn_len;
+  uint32_t next_seq;
+  int streaming;             // Past the S3 echo
+  char cmds[512];            // Echoes so far, before that
+  size_t cmds_len;
+
+  int64_t last_ns;           // Time of the latest byte taken
+};
+
+static uint32_t get32(const uint8_t *p, const int swapped)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return swapped ? __builtin_bswap32(v) : v;
+}
+
+static uint16_t be16(const uint8_t *p)
+{
+  return (p[0] << 8) | p[1];
+}
+
+static uint32_t be32(const uint8_t *p)
+{
+  return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static const void *map_file(const char *path, size_t *size)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    *size = st.st_size;
+  }
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+  madvise(map, *size, MADV_SEQUENTIAL);
+  return map;
+}
+
+/*
+ *  Raw captures
+ */
+
+static int open_raw(struct dataq_replay *r, const char *path)
+{
+  char index[PATH_MAX];
+  snprintf(index, sizeof(index), "%s.idx", path);
+  FILE *f = fopen(index, "rb");
+  if (f == NULL) {
+    dprintf("No index %s, so no timestamps\n", index);
+    return EX_OK;
+  }
+
+  int ret = dataq_log_read_header(f, &r->hdr);
+  if (ret == EX_OK && r->hdr.format != DATAQ_LOG_RAW)
+    ret = -EX_DATAERR;
+  size_t cap = 0;
+  struct dataq_index_record rec;
+  while (ret == EX_OK && fread(&rec, sizeof(rec), 1, f) == 1) {
+    if (r->n_index == cap) {
+      cap = cap ? 2 * cap : 1024;
+      struct dataq_index_record *index = realloc(r->index, cap * sizeof(*index));
+      if (index == NULL) {
+        ret = -EX_OSERR;
+        break;
+      }
+      r->index = index;
+    }
+    r->index[r->n_index++] = rec;
+  }
+  fclose(f);
+  return ret;
+}
+
+// Copy up to len bytes of the capture to buf
+static size_t take_raw(struct dataq_replay *r, uint8_t *buf, size_t len)
+{
+  if (len > r->size - r->pos)
+    len = r->size - r->pos;
+  memcpy(buf, r->map + r->pos, len);
+  r->pos += len;
+
+  // The first index record at or past here says when we'd got this far
+  while (r->next_index < r->n_index && r->index[r->next_index].offset < r->pos)
+    r->next_index++;
+  if (r->next_index < r->n_index)
+    r->last_ns = r->index[r->next_index].t_ns;
+  return len;
+}
+
+/*
+ *  pcap
+ */
+
+// Settings from the echo of a command, as start_device() sent them
+static void echoed(struct dataq_replay *r, const char *cmd, const size_t len)
+{
+  char arg[256];
+  snprintf(arg, sizeof(arg), "%.*s", (int) len - 1, cmd + 1);
+  switch (cmd[0]) {
+  case 'X':
+    r->hdr.timerscaler = strtol(arg, NULL, 16);
+    break;
+  case 'M':
+    r->hdr.rate_divisor = strtol(arg, NULL, 16);
+    break;
+  case 'L':
+    snprintf(r->hdr.scanlist, sizeof(r->hdr.scanlist), "%.*s",
+             (int) sizeof(r->hdr.scanlist) - 1, arg + 2);
+    break;
+  case 'C':
+    r->hdr.n_chans = strtol(arg, NULL, 16);
+    break;
+  }
+}
+
+// Read the echoed commands at the start of the session, up to S3
+// The echoes run together, so are split by their known lengths, the scan list
+// running up to the next command
+// Returns how many bytes of seg are echoes (all of them if S3 isn't here yet)
+// If there's no S3 by the time cmds[] is full, the rest is taken as scans
+static size_t parse_echoes(struct dataq_replay *r, const uint8_t *seg, size_t len)
+{
+  size_t i;
+  int s3 = 0;
+  for (i = 0; i < len && r->cmds_len < sizeof(r->cmds) && !s3; i++) {
+    r->cmds[r->cmds_len++] = seg[i];
+    s3 = r->cmds_len >= 2 && !memcmp(&r->cmds[r->cmds_len - 2], "S3", 2);
+  }
+  if (!s3) {
+    if (r->cmds_len < sizeof(r->cmds))
+      return len;
+    eprintf("No S3 echo in the first %zu bytes, taking what follows as scans\n",
+            sizeof(r->cmds));
+  }
+
+  const char *c = r->cmds, *end = r->cmds + r->cmds_len;
+  while (c < end) {
+    size_t n;
+    switch (*c) {
+    case 'X':
+    case 'C':
+      n = 3;
+      break;
+    case 'M':
+      n = 5;
+      break;
+    case 'L':
+      for (n = 3; c + n < end && !strchr("XMCS", c[n]); n += 4);
+      break;
+    default:
+      n = 2;
+    }
+    if (c + n > end)
+      break;
+    echoed(r, c, n);
+    c += n;
+  }
+
+  r->streaming = 1;
+  r->hdr.period = dataq_scan_period(r->hdr.timerscaler, r->hdr.rate_divisor,
+                                    r->hdr.n_chans);
+  dprintf("Replaying %d channels, scan list %s\n", r->hdr.n_chans, r->hdr.scanlist);
+  return i;
+}
+
+// Find the TCP payload from the device in a captured frame, if it's in order
+// Returns its length, with *payload set
+static size_t tcp_payload(struct dataq_replay *r, const uint8_t *p, size_t len,
+                          const uint8_t **payload)
+{
+  // Link layer
+  int ethertype = 0;
+  switch (r->link) {
+  case LINK_ETHERNET:
+    if (len < 14)
+      return 0;
+    ethertype = be16(p + 12);
+    p += 14, len -= 14;
+    if (ethertype == 0x8100 && len >= 4) {  // VLAN tag
+      ethertype = be16(p + 2);
+      p += 4, len -= 4;
+    }
+    break;
+  case LINK_SLL:
+    if (len < 16)
+      return 0;
+    ethertype = be16(p + 14);
+    p += 16, len -= 16;
+    break;
+  case LINK_SLL2:
+    if (len < 20)
+      return 0;
+    ethertype = be16(p);
+    p += 20, len -= 20;
+    break;
+  case LINK_NULL:
+    if (len < 4)
+      return 0;
+    p += 4, len -= 4;
+    /* FALLTHROUGH */
+  case LINK_RAW:
+    if (len < 1)
+      return 0;
+    ethertype = (p[0] >> 4) == 6 ? 0x86DD : 0x0800;
+    break;
+  }
+
+  // Network layer: the addresses, less the client's port, identify a session
+  size_t ip_len, addr_len;
+  const uint8_t *addrs;
+  if (ethertype == 0x0800) {
+    if (len < 20 || p[9] != 6)
+      return 0;
+    ip_len = (p[0] & 0x0F) * 4;
+    size_t total = be16(p + 2);
+    if (total < len)
+      len = total;  // Ignore any padding
+    addrs = p + 12;
+    addr_len = 8;
+  }
+  else if (ethertype == 0x86DD) {
+    if (len < 40 || p[6] != 6)
+      return 0;  // Extension headers aren't looked through
+    ip_len = 40;
+    if (40 + (size_t) be16(p + 4) < len)
+      len = 40 + be16(p + 4);
+    addrs = p + 8;
+    addr_len = 32;
+  }
+  else
+    return 0;
+  if (len < ip_len + 20)
+    return 0;
+  const uint8_t *tcp = p + ip_len;
+  if (be16(tcp) != r->portno)
+    return 0;
+
+  uint8_t conn[36];
+  memcpy(conn, addrs, addr_len);
+  memcpy(conn + addr_len, tcp + 2, 2);
+  const uint32_t seq = be32(tcp + 4);
+  const size_t tcp_len = (tcp[12] >> 4) * 4;
+  if (len < ip_len + tcp_len)
+    return 0;
+  const uint8_t *data = tcp + tcp_len;
+  size_t n = len - ip_len - tcp_len;
+  if (tcp[13] & 0x02) {
+    // SYN: a new session, only of interest if it's the first
+    if (!r->have_conn) {
+      r->have_conn = 1;
+      memcpy(r->conn, conn, addr_len + 2);
+      r->conn_len = addr_len + 2;
+      r->next_seq = seq + 1;
+    }
+    return 0;
+  }
+  if (n == 0)
+    return 0;
+
+  // Stick to one session; if its start wasn't captured, take it from here
+  if (!r->have_conn) {
+    r->have_conn = 1;
+    memcpy(r->conn, conn, addr_len + 2);
+    r->conn_len = addr_len + 2;
+    r->next_seq = seq;
+    r->streaming = 1;  // Too late for the echoes
+    dprintf("Capture starts mid-session, at TCP sequence %u\n", seq);
+  }
+  if (r->conn_len != addr_len + 2 || memcmp(r->conn, conn, r->conn_len))
+    return 0;
+
+  // Skip what's been seen already (retransmissions); jump over what's missing
+  const int32_t ahead = seq - r->next_seq;
+  if (ahead < 0) {
+    if ((size_t) -ahead >= n)
+      return 0;
+    data += -ahead;
+    n -= -ahead;
+  }
+  else if (ahead > 0)
+    eprintf("%d bytes missing from capture\n", ahead);
+  r->next_seq = seq + (ahead < 0 ? -ahead : 0) + n;
+
+  *payload = data;
+  return n;
+}
+
+// Move on to the next packet with sample bytes in it
+// Returns 0 at the end of the capture
+static int next_segment(struct dataq_replay *r)
+{
+  while (r->pos + PCAP_RECORD <= r->size) {
+    const uint8_t *rec = r->map + r->pos;
+    const uint32_t incl = get32(rec + 8, r->swapped);
+    const uint32_t orig = get32(rec + 12, r->swapped);
+    if (r->pos + PCAP_RECORD + incl > r->size)
+      break;
+    r->pos += PCAP_RECORD + incl;
+    if (incl < orig)
+      eprintf("Packet truncated in capture (snap length too short?)\n");
+
+    const uint8_t *payload;
+    size_t n = tcp_payload(r, rec + PCAP_RECORD, incl, &payload);
+    if (n == 0)
+      continue;
+    r->seg_ns = (int64_t) get32(rec, r->swapped) * 1000000000
+                + (int64_t) get32(rec + 4, r->swapped) * (r->nanosecs ? 1 : 1000);
+
+    if (!r->streaming) {
+      size_t echo = parse_echoes(r, payload, n);
+      payload += echo;
+      n -= echo;
+    }
+    if (n > 0) {
+      r->seg = payload;
+      r->seg_len = n;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static size_t take_pcap(struct dataq_replay *r, uint8_t *buf, size_t len)
+{
+  size_t got = 0;
+  while (got < len) {
+    if (r->seg_len == 0 && !next_segment(r))
+      break;
+    size_t n = r->seg_len < len - got ? r->seg_len : len - got;
+    memcpy(buf + got, r->seg, n);
+    r->seg += n;
+    r->seg_len -= n;
+    r->last_ns = r->seg_ns;
+    got += n;
+  }
+  return got;
+}
+
+static int open_pcap(struct dataq_replay *r, const uint16_t portno)
+{
+  if (r->size < PCAP_HEADER)
+    return -EX_DATAERR;
+  const uint32_t magic = get32(r->map, 0);
+  r->swapped = (magic == __builtin_bswap32(PCAP_MAGIC)
+                || magic == __builtin_bswap32(PCAP_MAGIC_NS));
+  r->nanosecs = (magic == PCAP_MAGIC_NS || magic == __builtin_bswap32(PCAP_MAGIC_NS));
+  r->link = get32(r->map + 20, r->swapped) & 0xFFFF;
+  if (r->link != LINK_NULL && r->link != LINK_ETHERNET && r->link != LINK_RAW
+      && r->link != LINK_SLL && r->link != LINK_SLL2) {
+    eprintf("Unsupported link type %d in capture\n", r->link);
+    return -EX_DATAERR;
+  }
+  r->portno = portno;
+  r->pos = PCAP_HEADER;
+
+  // Get through the echoes, for the settings
+  memcpy(r->hdr.magic, DATAQ_LOG_MAGIC, sizeof(r->hdr.magic));
+  r->hdr.version = DATAQ_LOG_VERSION;
+  r->hdr.format = DATAQ_LOG_RAW;
+  if (!next_segment(r)) {
+    eprintf("No stream from port %d in capture\n", portno);
+    return -EX_DATAERR;
+  }
+  return EX_OK;
+}
+
+/*
+ *  Replay
+ */
+
+// Open a recording at path for replay: a raw capture, or a pcap of the TCP
+// session with the device on portno
+int dataq_replay_open(struct dataq_replay **rp, const char *path,
+                      const uint16_t portno)
+{
+  struct dataq_replay *r = calloc(1, sizeof(*r));
+  if (r == NULL)
+    return -EX_OSERR;
+  if ((r->map = map_file(path, &r->size)) == NULL) {
+    eprintf("Can't read %s: %s\n", path, strerror(errno));
+    free(r);
+    return -EX_NOINPUT;
+  }
+
+  int ret;
+  const uint32_t magic = r->size >= 4 ? get32(r->map, 0) : 0;
+  if (magic == PCAPNG_MAGIC) {
+    eprintf("%s is pcapng; convert it with 'editcap -F pcap'\n", path);
+    ret = -EX_DATAERR;
+  }
+  else if (magic == PCAP_MAGIC || magic == PCAP_MAGIC_NS
+           || magic == __builtin_bswap32(PCAP_MAGIC)
+           || magic == __builtin_bswap32(PCAP_MAGIC_NS)) {
+    r->source = SRC_PCAP;
+    ret = open_pcap(r, portno);
+  }
+  else {
+    r->source = SRC_RAW;
+    ret = open_raw(r, path);
+  }
+
+  if (ret < 0) {
+    dataq_replay_close(r);
+    return ret;
+  }
+  *rp = r;
+  return EX_OK;
+}
+
+// What the recording says about the acquisition, as far as it knows
+// (n_chans is 0 for a raw capture without its index)
+const struct dataq_log_header *dataq_replay_header(const struct dataq_replay *r)
+{
+  return &r->hdr;
+}
+
+// Parse the next batch of up to max_scans scans from the recording, as
+// dataq_recv_batch() would have as they arrived, using rx (set up with
+// dataq_rx_init() with sockfd -1, and a conv of choice)
+// If tv != NULL, sets it to when the batch's last byte arrived, if known
+// Returns the number of scans, or 0 at the end
+int dataq_replay_recv(struct dataq_replay *r, struct dataq_rx *rx,
+                      float values[], const int max_scans, struct timeval *tv)
+{
+  uint8_t *bytes = (uint8_t *) rx->buf;
+  const int scan_bytes = 2 * rx->n_chans;
+
+  if (rx->n_chans < 1 || rx->n_chans > DATAQ_MAXCHAN || max_scans < 1)
+    return -EX_DATAERR;
+
+  int limit = sizeof(rx->buf) / scan_bytes;
+  if (limit > max_scans)
+    limit = max_scans;
+  const int want = limit * scan_bytes;
+
+  int s;
+  while ((s = dataq_rx_parse(rx, values, NULL, limit)) == 0) {
+    size_t n = (r->source == SRC_PCAP) ? take_pcap(r, bytes + rx->len, want - rx->len)
+                                       : take_raw(r, bytes + rx->len, want - rx->len);
+    if (n == 0)
+      return 0;
+    rx->len += n;
+  }
+
+  if (tv != NULL) {
+    tv->tv_sec = r->last_ns / 1000000000;
+    tv->tv_usec = r->last_ns % 1000000000 / 1000;
+  }
+  return s;
+}
+
+// Bytes of the recording gone through so far, and in all
+void dataq_replay_progress(const struct dataq_replay *r, long long *done,
+                           long long *size)
+{
+  *done = r->pos;
+  *size = r->size;
+}
+
+void dataq_replay_close(struct dataq_replay *r)
+{
+  munmap((void *) r->map, r->size);
+  free(r->index);
+  free(r);
+}
@@ -0,0 +1,205 @@
+/* Looking up devices' addresses, with a cache
+ *
+ * dataq_connect() is called again on every reconnect, and from several
+ * threads at once by dataq_connect_many(), so lookups go through the
+ * reentrant getaddrinfo() and their results are kept: only the first lookup
+ * of a host waits on a resolver.  Past the TTL, or once none of its addresses
+ * answer, the last good answer is still used while a thread of its own looks
+ * the host up again, so a reconnect never waits on a slow or missing
+ * resolver, and a failed refresh leaves the old answer in place.  Numeric
+ * addresses (IPv4 or IPv6) are taken as they are, without asking a resolver.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include "dataq.h"
+#include "dataq_private.h"
+
+#define CACHE_SIZE 32   // Hosts remembered
+#define CACHE_TTL 300   // Seconds before looking a host up again...
+#define RETRY_SECS 10   // ...or after a failed refresh
+
+struct cache_entry {
+  char hostname[256];
+  uint16_t portno;
+  time_t expires;       // 0 if unused
+  int refreshing;       // A lookup's under way
+  struct dataq_addrs addrs;
+};
+
+static struct cache_entry cache[CACHE_SIZE];
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static time_t now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+// Find a host in the cache; call with cache_lock held
+static struct cache_entry *lookup(const char *hostname, const uint16_t portno)
+{
+  int i;
+  for (i = 0; i < CACHE_SIZE; i++)
+    if (cache[i].expires && cache[i].portno == portno
+        && !strcmp(cache[i].hostname, hostname))
+      return &cache[i];
+  return NULL;
+}
+
+static int getaddrs(const char *hostname, const uint16_t portno, int flags,
+                    struct dataq_addrs *addrs)
+{
+  const struct addrinfo hints = {
+    .ai_family = AF_UNSPEC,.ai_socktype = SOCK_STREAM,.ai_flags = flags
+  };
+  struct addrinfo *res, *ai;
+  char port[8];
+  snprintf(port, sizeof(port), "%u", portno);
+
+  int err = getaddrinfo(hostname, port, &hints, &res);
+  if (err != 0)
+    return err;
+
+  addrs->n = 0;
+  for (ai = res; ai != NULL && addrs->n < DATAQ_MAXADDRS; ai = ai->ai_next) {
+    memcpy(&addrs->addr[addrs->n], ai->ai_addr, ai->ai_addrlen);
+    addrs->len[addrs->n] = ai->ai_addrlen;
+    addrs->n++;
+  }
+  freeaddrinfo(res);
+  return addrs->n > 0 ? 0 : EAI_NONAME;
+}
+
+// A cached host being looked up again
+struct refresh {
+  char hostname[256];
+  uint16_t portno;
+};
+
+static void *refresh_thread(void *arg)
+{
+  struct refresh *r = arg;
+  struct dataq_addrs addrs;
+  const int err = getaddrs(r->hostname, r->portno, 0, &addrs);
+
+  pthread_mutex_lock(&cache_lock);
+  struct cache_entry *e = lookup(r->hostname, r->portno);
+  if (e != NULL) {
+    if (err == 0)
+      e->addrs = addrs;
+    else
+      dprintf("DNS lookup for %s failed (%s), using the last answer\n",
+              r->hostname, gai_strerror(err));
+    e->expires = now() + (err == 0 ? CACHE_TTL : RETRY_SECS);
+    e->refreshing = 0;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  free(r);
+  return NULL;
+}
+
+// Start looking e up again, unless that's already in hand; call with
+// cache_lock held
+static void refresh(struct cache_entry *e)
+{
+  if (e->refreshing)
+    return;
+  struct refresh *r = malloc(sizeof(*r));
+  if (r == NULL)
+    return;
+  memcpy(r->hostname, e->hostname, sizeof(r->hostname));
+  r->portno = e->portno;
+
+  pthread_attr_t attr;
+  pthread_t thread;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&thread, &attr, refresh_thread, r) == 0)
+    e->refreshing = 1;
+  else
+    free(r);
+  pthread_attr_destroy(&attr);
+}
+
+// Look up a device's addresses, from the cache if they're there, refreshing
+// them in the background if they're stale
+int dataq_resolve(const char *hostname, const uint16_t portno,
+                  struct dataq_addrs *addrs)
+{
+  // Numeric addresses need no resolver, nor caching
+  if (getaddrs(hostname, portno, AI_NUMERICHOST, addrs) == 0)
+    return EX_OK;
+
+  pthread_mutex_lock(&cache_lock);
+  struct cache_entry *e = lookup(hostname, portno);
+  if (e != NULL) {
+    if (e->expires <= now())
+      refresh(e);
+    *addrs = e->addrs;
+    pthread_mutex_unlock(&cache_lock);
+    return EX_OK;
+  }
+  pthread_mutex_unlock(&cache_lock);
+
+  // Not holding the lock while the resolver takes its time
+  int err = getaddrs(hostname, portno, 0, addrs);
+
+  pthread_mutex_lock(&cache_lock);
+  e = lookup(hostname, portno);
+  if (err != 0) {
+    if (e != NULL) {
+      dprintf("DNS lookup for %s failed (%s), using the last answer\n",
+              hostname, gai_strerror(err));
+      *addrs = e->addrs;
+      err = 0;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    if (err != 0) {
+      eprintf("DNS lookup for %s failed (%s), is it plugged in?\n",
+              hostname, gai_strerror(err));
+      return -EX_NOHOST;
+    }
+    return EX_OK;
+  }
+
+  // Remember it, in place of the entry due to expire soonest (but not one
+  // still being refreshed, whose thread would otherwise update the wrong host)
+  if (e == NULL && strlen(hostname) < sizeof(e->hostname)) {
+    int i;
+    e = NULL;
+    for (i = 0; i < CACHE_SIZE; i++)
+      if (!cache[i].refreshing && (e == NULL || cache[i].expires < e->expires))
+        e = &cache[i];
+    if (e != NULL) {
+      snprintf(e->hostname, sizeof(e->hostname), "%s", hostname);
+      e->portno = portno;
+    }
+  }
+  if (e != NULL) {
+    e->addrs = *addrs;
+    e->expires = now() + CACHE_TTL;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return EX_OK;
+}
+
+// Look a host up again soon, e.g. since none of its addresses answered, but
+// keep its addresses until then in case they're still right
+void dataq_resolve_forget(const char *hostname, const uint16_t portno)
+{
+  pthread_mutex_lock(&cache_lock);
+  struct cache_entry *e = lookup(hostname, portno);
+  if (e != NULL)
+    refresh(e);
+  pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,671 @@
+/* Acquisition sessions: a receive thread per device feeding a ring of scans
+ *
+ * The receive thread does nothing but drain the socket through
+ * dataq_recv_batch() into a preallocated single-producer/single-consumer ring,
+ * so a slow consumer never makes the device's buffer back up behind TCP flow
+ * control.  If the ring fills, the thread keeps draining and counts the scans
+ * it had to drop as overruns.
+ *
+ * The ring indices are free-running counters updated with acquire/release
+ * atomics; the mutex and condition variable are only used to put a consumer
+ * to sleep when the ring is empty, and only touched by the producer when a
+ * consumer is actually waiting.
+ *
+ * With opts.reconnect, losing the device (or hearing nothing from it for
+ * opts.stall_ms) doesn't end the session: the thread connects again with the
+ * same settings, backing off between attempts, and queues a gap record at
+ * that point in the ring so the consumer knows what's missing.
+ *
+ * With opts.filter, the thread also filters each batch's values as it comes,
+ * so the consumer gets them ready to use (codes stay as received).
+ *
+ * For closed-loop use, opts.rt bounds the latency from wire to consumer: the
+ * thread can be pinned to a CPU of its own and run SCHED_FIFO, so nothing
+ * else runs in its place, and the process locked into memory (mlockall()
+ * faults in every buffer up front, and whatever is mapped later), so it never
+ * waits on a page fault.  With rt.busy_poll it spins on the socket instead of
+ * sleeping in poll(), saving the wake-up at the cost of a whole CPU; the 1 s
+ * receive timeout is kept by the clock instead, and stops are checked every
+ * SPIN_CHECK spins.
+ *
+ * Counters and latency histograms are updated with relaxed atomics, so any
+ * thread can sample them while the session runs: how long scans wait in the
+ * ring between arriving and being popped, and how far each batch's arrival
+ * strays from when the sample rate says it should have come.
+ */
+
+#define _GNU_SOURCE  // pthread_attr_setaffinity_np()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "dataq.h"
+#include "dataq_private.h"
+
+#define STALL_MS 3000       // Default opts.stall_ms
+#define BACKOFF_MIN_MS 100  // First wait between reconnect attempts...
+#define BACKOFF_MAX_MS 5000 // ...doubling up to this
+#define MAX_GAPS 64         // Gap records queued for the consumer
+#define SPIN_CHECK 1024     // Busy-polling: spins between checks for a stop
+#define RT_STACK (256 * 1024)  // Receive thread's stack, when locked in memory
+
+struct dataq_session {
+  int sockfd;
+  int n_chans;
+
+  // Connection settings, for reconnecting
+  char *hostname;
+  uint16_t portno;
+  int timerscaler, rate_divisor;
+  char *scanlist;
+  const struct dataq_conv *conv;
+
+  struct dataq_stop stop;
+  struct dataq_rx *rx;
+  pthread_t thread;
+  struct dataq_session_opts opts;
+  struct dataq_clock clock;
+  struct dataq_filter *filter;
+
+  // Ring of decoded scans, capacity a power of two
+  size_t cap;
+  float *values;             // cap * n_chans
+  uint16_t *codes;           // cap * n_chans, as values[] before conversion
+  struct timeval *tv;        // cap
+  int64_t *arrived;          // cap, CLOCK_MONOTONIC ns of the recv()
+  float *scratch;            // Somewhere to receive into when the ring is full
+  struct timeval *scratch_tv;
+  _Atomic size_t head;       // Next scan to pop, written by consumer
+  _Atomic size_t tail;       // Next scan to push, written by producer
+
+  // Gaps, each before the scan numbered at[], in a ring of their own
+  struct dataq_gap gaps[MAX_GAPS];
+  size_t gap_at[MAX_GAPS];
+  _Atomic size_t gap_head;
+  _Atomic size_t gap_tail;
+
+  // Sleeping consumers
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  atomic_int waiting;
+  atomic_int done;           // Receive thread has finished
+  int error;                 // Why it finished
+
+  // Statistics
+  _Atomic unsigned long long scans;
+  _Atomic unsigned long long overruns;
+  _Atomic unsigned long long resyncs;
+  _Atomic unsigned long long skipped;
+  _Atomic unsigned long long reconnects;
+  _Atomic unsigned long long lost;
+  _Atomic unsigned long long batches;
+  _Atomic unsigned long long timeouts;
+  _Atomic unsigned long long recvs;
+  _Atomic unsigned long long partials;
+  long long base_resyncs;    // Counts from connections before rx's current one,
+  long long base_skipped;    // which dataq_rx_init() starts again from zero
+  long long base_recvs;
+  long long base_partials;
+  struct dataq_hist_live deliver;  // Arrival to pop, of the oldest scan popped
+  struct dataq_hist_live jitter;   // Batch arrival vs. the nominal rate
+};
+
+static int64_t mono_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Wake the consumer
+static void wake(struct dataq_session *sess)
+{
+  pthread_mutex_lock(&sess->lock);
+  pthread_cond_broadcast(&sess->cond);
+  pthread_mutex_unlock(&sess->lock);
+}
+
+static void session_free(struct dataq_session *sess)
+{
+  pthread_cond_destroy(&sess->cond);
+  pthread_mutex_destroy(&sess->lock);
+  if (sess->filter != NULL)
+    dataq_filter_close(sess->filter);
+  free(sess->rx);
+  free(sess->scratch_tv);
+  free(sess->scratch);
+  free(sess->tv);
+  free(sess->arrived);
+  free(sess->codes);
+  free(sess->values);
+  free(sess->scanlist);
+  free(sess->hostname);
+  free(sess);
+}
+
+static double session_period(const struct dataq_session *sess)
+{
+  return dataq_scan_period(sess->timerscaler, sess->rate_divisor, sess->n_chans);
+}
+
+static void start_clock(struct dataq_session *sess)
+{
+  if (sess->opts.timestamps != DATAQ_TS_ARRIVAL)
+    dataq_clock_init(&sess->clock, sess->opts.timestamps == DATAQ_TS_MONOTONIC
+                                   ? CLOCK_MONOTONIC : CLOCK_REALTIME,
+                     session_period(sess));
+}
+
+// Wait for ms, or less if stopped
+// Returns nonzero if stopped
+static int backoff(struct dataq_session *sess, const int ms)
+{
+  struct pollfd pfd = {.fd = sess->stop.fds[0],.events = POLLIN };
+  return poll(&pfd, 1, ms) > 0;
+}
+
+// Drop the connection and make a new one, trying until it works or the
+// session is stopped
+// Returns EX_OK once reconnected, or -EX_UNAVAILABLE if stopped
+static int reconnect(struct dataq_session *sess)
+{
+  int ms = BACKOFF_MIN_MS;
+
+  dataq_close_period(sess->sockfd, session_period(sess));
+  sess->sockfd = -1;
+  while (!dataq_stop_pending(&sess->stop)) {
+    int sockfd = dataq_connect_opts(sess->hostname, sess->portno,
+                                    sess->timerscaler, sess->rate_divisor,
+                                    sess->scanlist, sess->n_chans,
+                                    &sess->opts.sock);
+    if (sockfd >= 0) {
+      sess->sockfd = sockfd;
+      sess->base_resyncs += sess->rx->resyncs;
+      sess->base_skipped += sess->rx->skipped;
+      sess->base_recvs += sess->rx->recvs;
+      sess->base_partials += sess->rx->partials;
+      dataq_rx_init(sess->rx, sockfd, sess->conv);
+      sess->rx->stop = &sess->stop;
+      sess->rx->timestamping = sess->opts.sock.timestamping;
+      sess->rx->nonblock = sess->opts.rt.busy_poll;
+      return EX_OK;
+    }
+
+    eprintf("Reconnect failed, trying again in %d ms\n", ms);
+    if (backoff(sess, ms))
+      break;
+    ms *= 2;
+    if (ms > BACKOFF_MAX_MS)
+      ms = BACKOFF_MAX_MS;
+  }
+  return -EX_UNAVAILABLE;
+}
+
+// Queue a gap to come before the scan numbered at
+static void push_gap(struct dataq_session *sess, const size_t at,
+                     const struct timeval *start, const struct timeval *end)
+{
+  const double period = session_period(sess);
+  const double secs = (end->tv_sec - start->tv_sec)
+                      + (end->tv_usec - start->tv_usec) * 1e-6;
+  long long lost = llround(secs / period) - 1;
+  if (lost < 0)
+    lost = 0;
+  atomic_fetch_add(&sess->lost, lost);
+  eprintf("Gap of %.3f s, ~%lld scans lost\n", secs, lost);
+
+  size_t tail = atomic_load_explicit(&sess->gap_tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&sess->gap_head, memory_order_acquire);
+  if (tail - head == MAX_GAPS) {
+    eprintf("Too many gaps queued, not recording this one\n");
+    return;
+  }
+  struct dataq_gap *gap = &sess->gaps[tail % MAX_GAPS];
+  gap->start = *start;
+  gap->end = *end;
+  gap->lost = lost;
+  sess->gap_at[tail % MAX_GAPS] = at;
+  atomic_store_explicit(&sess->gap_tail, tail + 1, memory_order_release);
+}
+
+static void *rx_thread(void *arg)
+{
+  struct dataq_session *sess = arg;
+  const int n_chans = sess->n_chans;
+  const int scan_bytes = 2 * n_chans;
+  const int scratch_scans = DATAQ_RXBUF / n_chans;
+  const int stall_ms = sess->opts.stall_ms > 0 ? sess->opts.stall_ms : STALL_MS;
+  int64_t stalled = 0;         // ms without data so far
+  int gap = 0;                 // Reconnected, and yet to record the gap
+  struct timeval last = { 0 }; // Timestamp of the latest scan
+  long long skipped = 0;
+  const double period_ns = 1e9 * dataq_scan_period(sess->timerscaler,
+                                                   sess->rate_divisor, n_chans);
+  int64_t prev_ns = 0;         // When the previous batch arrived
+  int64_t quiet_ns = mono_ns(); // Busy-polling: since when nothing's come...
+  unsigned spins = 0;          // ...and how many recv()s that's taken
+  int ret;
+
+  for (;;) {
+    size_t tail = atomic_load_explicit(&sess->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&sess->head, memory_order_acquire);
+    size_t space = sess->cap - (tail - head);
+    size_t slot = tail & (sess->cap - 1);
+
+    // Receive straight into the ring, up to where it wraps
+    float *dst = &sess->values[slot * n_chans];
+    size_t max_scans = sess->cap - slot;
+    if (max_scans > space)
+      max_scans = space;
+    if (space == 0) {
+      dst = sess->scratch;
+      max_scans = scratch_scans;
+    }
+
+    struct timeval tv;
+    ret = dataq_recv_batch(sess->rx, dst, max_scans, &tv);
+    const int64_t now_ns = mono_ns();
+    if (ret == -EX_TEMPFAIL && sess->opts.rt.busy_poll) {
+      if (++spins % SPIN_CHECK == 0 && dataq_stop_pending(&sess->stop)) {
+        dprintf("Receive stopped\n");
+        ret = -EX_UNAVAILABLE;
+        break;
+      }
+      if (now_ns - quiet_ns < 1000000000)
+        continue;  // Not yet as long as a blocking receive would wait
+      quiet_ns = now_ns;
+    }
+    if (ret == -EX_TEMPFAIL)
+      atomic_fetch_add_explicit(&sess->timeouts, 1, memory_order_relaxed);
+    if (ret == -EX_TEMPFAIL && !(sess->opts.reconnect && (stalled += 1000) >= stall_ms))
+      continue;  // Nothing for a while, but keep listening
+    if (ret < 0 && sess->opts.reconnect && !dataq_stop_pending(&sess->stop)) {
+      eprintf("Lost device, reconnecting\n");
+      if (reconnect(sess) < 0)
+        break;
+      atomic_fetch_add(&sess->reconnects, 1);
+      start_clock(sess);
+      if (sess->filter != NULL)
+        dataq_filter_reset(sess->filter);
+      skipped = 0;
+      stalled = 0;
+      prev_ns = 0;
+      quiet_ns = mono_ns();
+      gap = 1;
+      continue;
+    }
+    if (ret < 0)
+      break;
+    stalled = 0;
+    quiet_ns = now_ns;
+    if (sess->filter != NULL)
+      dataq_filter_run(sess->filter, dst, ret);
+
+    atomic_fetch_add(&sess->scans, ret);
+    atomic_fetch_add_explicit(&sess->batches, 1, memory_order_relaxed);
+    atomic_store(&sess->resyncs, sess->base_resyncs + sess->rx->resyncs);
+    atomic_store(&sess->skipped, sess->base_skipped + sess->rx->skipped);
+    atomic_store_explicit(&sess->recvs, sess->base_recvs + sess->rx->recvs,
+                          memory_order_relaxed);
+    atomic_store_explicit(&sess->partials, sess->base_partials + sess->rx->partials,
+                          memory_order_relaxed);
+    if (prev_ns)
+      dataq_hist_record(&sess->jitter, llabs(now_ns - prev_ns - llround(ret * period_ns)));
+    prev_ns = now_ns;
+
+    // Timestamp, leaving room on the sample clock for any scans lost to resync
+    struct timeval *stamps = (space == 0) ? sess->scratch_tv : &sess->tv[slot];
+    if (sess->opts.timestamps == DATAQ_TS_ARRIVAL) {
+      int i;
+      for (i = 0; i < ret; i++)
+        stamps[i] = tv;
+    }
+    else {
+      if (sess->rx->skipped != skipped) {
+        long long lost = sess->rx->skipped - skipped;
+        dataq_clock_skip(&sess->clock, (lost + scan_bytes / 2) / scan_bytes);
+        skipped = sess->rx->skipped;
+      }
+      dataq_clock_stamp(&sess->clock, ret, stamps);
+    }
+
+    // First scans since reconnecting: now we know how long the gap was,
+    // unless there were none before it to measure from
+    if (gap && (last.tv_sec || last.tv_usec))
+      push_gap(sess, tail, &last, &stamps[0]);
+    gap = 0;
+    last = stamps[ret - 1];
+
+    if (space == 0) {
+      atomic_fetch_add(&sess->overruns, ret);
+      continue;
+    }
+    memcpy(&sess->codes[slot * n_chans], sess->rx->codes,
+           ret * n_chans * sizeof(uint16_t));
+    int i;
+    for (i = 0; i < ret; i++)
+      sess->arrived[slot + i] = now_ns;
+
+    // NOTE seq_cst, paired with the consumer setting waiting then checking tail
+    atomic_store(&sess->tail, tail + ret);
+    if (atomic_load(&sess->waiting))
+      wake(sess);
+  }
+
+  if (dataq_stop_pending(&sess->stop))
+    dprintf("Session stopped\n");
+  sess->error = ret;
+  atomic_store(&sess->done, 1);
+  wake(sess);
+  return NULL;
+}
+
+// Set up attr for the receive thread as rt asks
+static int rt_attr(pthread_attr_t *attr, const struct dataq_rt_opts *rt)
+{
+  if (rt->pin) {
+#ifdef __linux__
+    if (rt->cpu < 0 || rt->cpu >= CPU_SETSIZE) {
+      eprintf("No CPU %d to run the receive thread on\n", rt->cpu);
+      return -EX_DATAERR;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(rt->cpu, &set);
+    pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+#else
+    eprintf("Can't pin threads to CPUs here\n");
+    return -EX_UNAVAILABLE;
+#endif
+  }
+  if (rt->fifo_prio) {
+    if (rt->fifo_prio < sched_get_priority_min(SCHED_FIFO)
+        || rt->fifo_prio > sched_get_priority_max(SCHED_FIFO)) {
+      eprintf("SCHED_FIFO priority %d is outside %d to %d\n", rt->fifo_prio,
+              sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO));
+      return -EX_DATAERR;
+    }
+    const struct sched_param param = {.sched_priority = rt->fifo_prio };
+    pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(attr, SCHED_FIFO);
+    pthread_attr_setschedparam(attr, &param);
+  }
+
+  // Locked stacks are all resident, so not the usual megabytes
+  if (rt->lock)
+    pthread_attr_setstacksize(attr, RT_STACK);
+  return EX_OK;
+}
+
+// Connect to a device and start a receive thread, buffering up to ring_scans
+// scans (rounded up to a power of two) for dataq_session_pop()
+// opts may be NULL for defaults
+// NOTE conv is used in place, so must outlive the session
+int dataq_session_open(struct dataq_session **sessp, const char *hostname,
+                       const uint16_t portno, const int timerscaler,
+                       const int rate_divisor, const char *scanlist,
+                       const struct dataq_conv *conv, const int ring_scans,
+                       const struct dataq_session_opts *opts)
+{
+  const int n_chans = conv->n_chans;
+  if (ring_scans < 1)
+    return -EX_DATAERR;
+
+  struct dataq_session *sess = calloc(1, sizeof(*sess));
+  if (sess == NULL)
+    return -EX_OSERR;
+
+  sess->n_chans = n_chans;
+  sess->hostname = strdup(hostname);
+  sess->portno = portno;
+  sess->timerscaler = timerscaler;
+  sess->rate_divisor = rate_divisor;
+  sess->scanlist = strdup(scanlist);
+  sess->conv = conv;
+  if (opts != NULL)
+    sess->opts = *opts;
+  start_clock(sess);
+  for (sess->cap = 1; sess->cap < (size_t) ring_scans; sess->cap <<= 1);
+  sess->values = malloc(sess->cap * n_chans * sizeof(float));
+  sess->codes = malloc(sess->cap * n_chans * sizeof(uint16_t));
+  sess->tv = malloc(sess->cap * sizeof(struct timeval));
+  sess->arrived = malloc(sess->cap * sizeof(int64_t));
+  sess->scratch = malloc(DATAQ_RXBUF * sizeof(float));
+  sess->scratch_tv = malloc(DATAQ_RXBUF * sizeof(struct timeval));
+  sess->rx = malloc(sizeof(*sess->rx));
+  pthread_mutex_init(&sess->lock, NULL);
+  pthread_cond_init(&sess->cond, NULL);
+
+  int ret = -EX_OSERR;
+  if (sess->values == NULL || sess->codes == NULL || sess->tv == NULL
+      || sess->arrived == NULL
+      || sess->scratch == NULL || sess->scratch_tv == NULL || sess->rx == NULL
+      || sess->hostname == NULL || sess->scanlist == NULL)
+    goto fail;
+
+  // The real-time options are checked before anything is done about them
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  if ((ret = rt_attr(&attr, &sess->opts.rt)) < 0)
+    goto fail_attr;
+  if (sess->opts.filter != NULL
+      && (ret = dataq_filter_open(&sess->filter, n_chans, sess->opts.filter,
+                                  1 / dataq_scan_period(timerscaler, rate_divisor,
+                                                        n_chans))) < 0)
+    goto fail_attr;
+  if ((ret = dataq_stop_init(&sess->stop)) < 0)
+    goto fail_attr;
+  sess->opts.sock.stop = &sess->stop;  // So reconnecting stops promptly too
+
+  sess->sockfd = dataq_connect_opts(hostname, portno, timerscaler, rate_divisor,
+                                    scanlist, n_chans, &sess->opts.sock);
+  if (sess->sockfd < 0) {
+    ret = sess->sockfd;
+    dataq_stop_close(&sess->stop);
+    goto fail_attr;
+  }
+  dataq_rx_init(sess->rx, sess->sockfd, conv);
+  sess->rx->stop = &sess->stop;
+  sess->rx->timestamping = sess->opts.sock.timestamping;
+  sess->rx->nonblock = sess->opts.rt.busy_poll;
+
+  if (sess->opts.rt.busy_poll && sess->opts.rt.fifo_prio && !sess->opts.rt.pin)
+    eprintf("Busy-polling at SCHED_FIFO without a CPU of its own may starve the rest\n");
+
+  // Everything's allocated, so locking faults it all in now, the thread's
+  // stack too as it starts
+  // NOTE for the whole process, and left so after the session
+  if (sess->opts.rt.lock && mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+    eprintf("Error locking memory: %s (see ulimit -l)\n", strerror(errno));
+    ret = -EX_NOPERM;
+    goto fail_thread;
+  }
+  int err = pthread_create(&sess->thread, &attr, rx_thread, sess);
+  if (err != 0) {
+    if (err == EPERM)
+      eprintf("Not allowed real-time scheduling (see ulimit -r)\n");
+    else if (err == EINVAL && sess->opts.rt.pin)
+      eprintf("Can't run the receive thread on CPU %d\n", sess->opts.rt.cpu);
+    else
+      eprintf("Error starting receive thread: %s\n", strerror(err));
+    ret = err == EPERM ? -EX_NOPERM : err == EINVAL ? -EX_DATAERR : -EX_OSERR;
+    if (sess->opts.rt.lock)
+      munlockall();
+    goto fail_thread;
+  }
+  pthread_attr_destroy(&attr);
+
+  *sessp = sess;
+  return EX_OK;
+
+fail_thread:
+  dataq_close_period(sess->sockfd, session_period(sess));
+  dataq_stop_close(&sess->stop);
+fail_attr:
+  pthread_attr_destroy(&attr);
+fail:
+  session_free(sess);
+  return ret;
+}
+
+// Take up to max_scans scans from the ring, oldest first, into values[]
+// (interleaved, as dataq_recv_batch()), codes[] (the same, unconverted) and
+// tv[]; any of them may be NULL
+// Waits up to timeout_ms for at least one scan: 0 to poll, -1 forever
+// Stops short of a gap, returning 0 straight away if one is next; call
+// dataq_session_gap() after each pop to see
+// Returns the number of scans, 0 on timeout, or once the ring is empty and the
+// receive thread has finished, the error it finished with
+int dataq_session_pop(struct dataq_session *sess, float values[],
+                      uint16_t codes[], struct timeval tv[],
+                      const int max_scans, const int timeout_ms)
+{
+  size_t head = atomic_load_explicit(&sess->head, memory_order_relaxed);
+
+  // Scans after the next gap have to wait until it's been taken
+  size_t gap_head = atomic_load_explicit(&sess->gap_head, memory_order_relaxed);
+  int have_gap = gap_head != atomic_load_explicit(&sess->gap_tail, memory_order_acquire);
+  const size_t gap_at = have_gap ? sess->gap_at[gap_head % MAX_GAPS] : 0;
+  if (have_gap && gap_at == head)
+    return 0;
+
+  size_t tail = atomic_load_explicit(&sess->tail, memory_order_acquire);
+
+  if (tail == head && timeout_ms != 0) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&sess->lock);
+    atomic_store(&sess->waiting, 1);
+    while ((tail = atomic_load(&sess->tail)) == head && !atomic_load(&sess->done)) {
+      if (timeout_ms < 0)
+        pthread_cond_wait(&sess->cond, &sess->lock);
+      else if (pthread_cond_timedwait(&sess->cond, &sess->lock, &deadline) == ETIMEDOUT)
+        break;
+    }
+    atomic_store(&sess->waiting, 0);
+    pthread_mutex_unlock(&sess->lock);
+  }
+
+  // Anything pushed just before the thread finished still counts
+  if (tail == head) {
+    if (!atomic_load(&sess->done))
+      return 0;
+    tail = atomic_load(&sess->tail);
+    if (tail == head)
+      return sess->error;
+  }
+
+  size_t n = tail - head;
+  if (n > (size_t) max_scans)
+    n = max_scans;
+  dataq_hist_record(&sess->deliver, mono_ns() - sess->arrived[head & (sess->cap - 1)]);
+
+  // A gap queued while we waited can only come after what we'd already seen
+  if (!have_gap) {
+    gap_head = atomic_load_explicit(&sess->gap_head, memory_order_relaxed);
+    have_gap = gap_head != atomic_load_explicit(&sess->gap_tail, memory_order_acquire);
+  }
+  if (have_gap && sess->gap_at[gap_head % MAX_GAPS] - head < n)
+    n = sess->gap_at[gap_head % MAX_GAPS] - head;
+
+  // Copy out in up to two pieces, either side of the wrap
+  size_t i = 0;
+  while (i < n) {
+    size_t slot = (head + i) & (sess->cap - 1);
+    size_t run = sess->cap - slot;
+    if (run > n - i)
+      run = n - i;
+    if (values != NULL)
+      memcpy(&values[i * sess->n_chans], &sess->values[slot * sess->n_chans],
+             run * sess->n_chans * sizeof(float));
+    if (codes != NULL)
+      memcpy(&codes[i * sess->n_chans], &sess->codes[slot * sess->n_chans],
+             run * sess->n_chans * sizeof(uint16_t));
+    if (tv != NULL)
+      memcpy(&tv[i], &sess->tv[slot], run * sizeof(struct timeval));
+    i += run;
+  }
+
+  atomic_store_explicit(&sess->head, head + n, memory_order_release);
+  return n;
+}
+
+// Take the gap at this point in the stream, if there is one
+// Returns 1 with *gap filled in, or 0 if none is due yet
+int dataq_session_gap(struct dataq_session *sess, struct dataq_gap *gap)
+{
+  const size_t head = atomic_load_explicit(&sess->head, memory_order_relaxed);
+  const size_t gap_head = atomic_load_explicit(&sess->gap_head, memory_order_relaxed);
+  if (gap_head == atomic_load_explicit(&sess->gap_tail, memory_order_acquire)
+      || sess->gap_at[gap_head % MAX_GAPS] != head)
+    return 0;
+
+  *gap = sess->gaps[gap_head % MAX_GAPS];
+  atomic_store_explicit(&sess->gap_head, gap_head + 1, memory_order_release);
+  return 1;
+}
+
+// Ask the receive thread to finish; dataq_session_pop() will then return
+// what's left in the ring, followed by -EX_UNAVAILABLE
+// NOTE async-signal-safe, so may be called from a signal handler
+void dataq_session_stop(struct dataq_session *sess)
+{
+  dataq_stop_signal(&sess->stop);
+}
+
+// Sample the session's counters; may be called from any thread
+void dataq_session_stats(struct dataq_session *sess,
+                         struct dataq_session_stats *stats)
+{
+  stats->scans = atomic_load(&sess->scans);
+  stats->overruns = atomic_load(&sess->overruns);
+  stats->resyncs = atomic_load(&sess->resyncs);
+  stats->skipped = atomic_load(&sess->skipped);
+  stats->reconnects = atomic_load(&sess->reconnects);
+  stats->lost = atomic_load(&sess->lost);
+  stats->batches = atomic_load(&sess->batches);
+  stats->timeouts = atomic_load(&sess->timeouts);
+  stats->recvs = atomic_load(&sess->recvs);
+  stats->partials = atomic_load(&sess->partials);
+}
+
+// Sample the session's latency histograms (either may be NULL); may be called
+// from any thread
+// deliver: how long the oldest scan of each pop had been waiting since its
+// recv(); jitter: how far each batch's arrival was from the nominal rate
+void dataq_session_latency(struct dataq_session *sess,
+                           struct dataq_hist *deliver, struct dataq_hist *jitter)
+{
+  if (deliver != NULL)
+    dataq_hist_read(&sess->deliver, deliver);
+  if (jitter != NULL)
+    dataq_hist_read(&sess->jitter, jitter);
+}
+
+// Stop the receive thread, disconnect from the device, and free the session
+void dataq_session_close(struct dataq_session *sess)
+{
+  dataq_stop_signal(&sess->stop);
+  pthread_join(sess->thread, NULL);
+  if (sess->sockfd >= 0)
+    dataq_close_period(sess->sockfd, session_period(sess));
+  dataq_stop_close(&sess->stop);
+
+  session_free(sess);
+}
@@ -0,0 +1,338 @@
+/* Simulated DI-718B, for testing and benchmarking without hardware
+ *
+ * Speaks the same protocol as the device as far as this library uses it:
+ * commands arrive with a leading null and are echoed back without it (T0
+ * excepted), C sets how many channels are scanned, and S3 starts a stream of
+ * sample words with the sync flags set as the real thing does (bit 8 always,
+ * bit 0 on all but the first channel of each scan), until T0.
+ *
+ * The samples are a ramp, different per channel.  The stream can be paced at
+ * any rate, including far beyond what the device's 14400 Hz clock allows, or
+ * as fast as the connection will take it; and a glitch (one dropped byte) can
+ * be injected to exercise resynchronization.
+ *
+ * dataq_sim_serve() runs the device side of one connection, e.g. one end of a
+ * socketpair(); built with USE_MAIN, this is also a server on a TCP port.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "dataq.h"
+#include "dataq_private.h"
+#include "dataq_sim.h"
+
+#define BLOCK_SCANS 1024   // Scans of samples generated up front
+#define PACE_MS 1          // How often to send, when paced
+
+static int64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Encode a 14-bit code as the device sends it, for channel c of a scan
+static uint16_t word(const int c, const uint16_t code)
+{
+  return ((code & 0x3F80) << 2) | ((code & 0x007F) << 1) | (c ? 0x0101 : 0x0100);
+}
+
+struct sim {
+  int fd;
+  struct dataq_sim_opts opts;
+  int timerscaler, rate_divisor, n_chans;
+  int streaming;
+  double rate;            // Scans/s while streaming, 0 for flat out
+  uint8_t *block;         // BLOCK_SCANS scans, sent round and round
+  size_t block_bytes;
+  uint64_t pos;           // Bytes of the stream so far, glitch included
+  int glitched;
+  int64_t t0;             // When S3 came
+};
+
+// Start streaming, with the samples for the current channel count
+static int start(struct sim *sim)
+{
+  const int n_chans = sim->n_chans;
+  sim->block_bytes = (size_t) BLOCK_SCANS * n_chans * 2;
+  uint16_t *words = realloc(sim->block, sim->block_bytes);
+  if (words == NULL)
+    return -EX_OSERR;
+  sim->block = (uint8_t *) words;
+
+  int k, c;
+  for (k = 0; k < BLOCK_SCANS; k++)
+    for (c = 0; c < n_chans; c++)
+      words[k * n_chans + c] = word(c, (k * 37 + c * 1000) & 0x3FFF);
+
+  sim->rate = sim->opts.rate >= 0 ? sim->opts.rate
+              : 1 / dataq_scan_period(sim->timerscaler, sim->rate_divisor, n_chans);
+  sim->pos = 0;
+  sim->glitched = 0;
+  sim->t0 = now_ns();
+  sim->streaming = 1;
+  return EX_OK;
+}
+
+// Act on (and echo) the command in cmd[0..len)
+static int command(struct sim *sim, const char *cmd, const size_t len)
+{
+  char arg[256];
+  snprintf(arg, sizeof(arg), "%.*s", (int) len - 1, cmd + 1);
+
+  switch (cmd[0]) {
+  case 'T':
+    sim->streaming = 0;
+    return EX_OK;  // T0 isn't echoed
+  case 'X':
+    sim->timerscaler = strtol(arg, NULL, 16);
+    break;
+  case 'M':
+    sim->rate_divisor = strtol(arg, NULL, 16);
+    break;
+  case 'C':
+    sim->n_chans = strtol(arg, NULL, 16);
+    if (sim->n_chans < 1 || sim->n_chans > DATAQ_MAXCHAN)
+      sim->n_chans = 1;
+    break;
+  }
+
+  if (send(sim->fd, cmd, len, MSG_NOSIGNAL) != (ssize_t) len)
+    return -EX_IOERR;
+  return cmd[0] == 'S' ? start(sim) : EX_OK;
+}
+
+// Length of the command at the head of in[], or 0 if it's not all here yet
+// Most have a fixed length; a scan list runs to the next null, or failing that
+// to the end of what's come so far (a command always arrives in one write)
+static size_t command_len(const char *in, const size_t len)
+{
+  const char *end = memchr(in, '\0', len);
+  const size_t avail = end ? (size_t) (end - in) : len;
+  size_t want;
+
+  switch (in[0]) {
+  case 'X':
+  case 'C':
+    want = 3;
+    break;
+  case 'M':
+    want = 5;
+    break;
+  case 'S':
+  case 'T':
+    want = 2;
+    break;
+  default:
+    want = avail;
+  }
+  return (avail >= want && want > 0) ? want : 0;
+}
+
+// Take in what's arrived, acting on each whole command
+static int receive(struct sim *sim, char in[], size_t *in_len, const size_t size)
+{
+  ssize_t n = recv(sim->fd, in + *in_len, size - *in_len, MSG_DONTWAIT);
+  if (n == 0)
+    return -EX_UNAVAILABLE;
+  if (n < 0)
+    return (errno == EAGAIN || errno == EINTR) ? EX_OK : -EX_IOERR;
+  *in_len += n;
+
+  size_t at = 0;
+  for (;;) {
+    while (at < *in_len && in[at] == '\0')
+      at++;
+    if (at == *in_len)
+      break;
+    const size_t len = command_len(&in[at], *in_len - at);
+    if (len == 0)
+      break;
+    int ret = command(sim, &in[at], len);
+    if (ret < 0)
+      return ret;
+    at += len;
+  }
+
+  *in_len -= at;
+  memmove(in, in + at, *in_len);
+  if (*in_len == size)
+    *in_len = 0;  // Garbage; forget it
+  return EX_OK;
+}
+
+// How many more bytes of the stream are due by now
+static size_t due(const struct sim *sim)
+{
+  if (sim->rate == 0)
+    return sim->block_bytes;
+  const int scan_bytes = 2 * sim->n_chans;
+  const uint64_t want = (uint64_t) ((now_ns() - sim->t0) * 1e-9 * sim->rate) * scan_bytes;
+  return want > sim->pos ? want - sim->pos : 0;
+}
+
+// Send what's due, without waiting
+static int transmit(struct sim *sim)
+{
+  const uint64_t glitch_at = sim->opts.glitch * 2 * sim->n_chans;
+  size_t n = due(sim);
+
+  while (n > 0) {
+    if (sim->opts.glitch && !sim->glitched && sim->pos >= glitch_at) {
+      sim->pos++;  // That byte goes missing
+      sim->glitched = 1;
+      n--;
+      continue;
+    }
+    const size_t at = sim->pos % sim->block_bytes;
+    size_t len = sim->block_bytes - at;
+    if (len > n)
+      len = n;
+    if (sim->opts.glitch && !sim->glitched && glitch_at > sim->pos
+        && len > glitch_at - sim->pos)
+      len = glitch_at - sim->pos;
+
+    ssize_t m = send(sim->fd, sim->block + at, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (m < 0 && (errno == EAGAIN || errno == EINTR))
+      break;
+    if (m <= 0)
+      return -EX_IOERR;
+    sim->pos += m;
+    n -= m;
+  }
+  return EX_OK;
+}
+
+// Be the device on the other end of fd until it's closed
+// Returns EX_OK once it is, or a negated EX_ code on error
+int dataq_sim_serve(int fd, const struct dataq_sim_opts *opts)
+{
+  struct sim sim = {.fd = fd,.n_chans = 1 };
+  if (opts != NULL)
+    sim.opts = *opts;
+  char in[512];
+  size_t in_len = 0;
+  int ret = EX_OK;
+
+  while (ret >= 0) {
+    size_t n = sim.streaming ? due(&sim) : 0;
+    struct pollfd pfd = {.fd = fd,.events = POLLIN | (n ? POLLOUT : 0) };
+    if (poll(&pfd, 1, sim.streaming && !n ? PACE_MS : -1) < 0 && errno != EINTR) {
+      ret = -EX_OSERR;
+      break;
+    }
+    if (pfd.revents & POLLIN)
+      ret = receive(&sim, in, &in_len, sizeof(in));
+    else if (pfd.revents & (POLLERR | POLLHUP))
+      ret = -EX_UNAVAILABLE;
+    if (ret >= 0 && sim.streaming && (pfd.revents & POLLOUT))
+      ret = transmit(&sim);
+  }
+
+  free(sim.block);
+  return ret == -EX_UNAVAILABLE ? EX_OK : ret;
+}
+
+/*
+ *  Main program (included optionally)
+ */
+
+#ifdef USE_MAIN
+
+#include <getopt.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+static struct dataq_sim_opts sim_opts = {.rate = -1 };
+
+static void *client_thread(void *arg)
+{
+  int fd = (int) (intptr_t) arg;
+  dataq_sim_serve(fd, &sim_opts);
+  close(fd);
+  dprintf("Client gone\n");
+  return NULL;
+}
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr,
+          "Simulated DATAQ DI-718B, for testing without hardware\n"
+          "Usage:\n"
+          "    %s [OPTIONS]\n"
+          "Options:\n"
+          "    -p, --port PORT      Listen on PORT (default 10001)\n"
+          "    -r, --rate HZ        Scans per second, or 0 for as fast as possible\n"
+          "                         (default: as the real device would)\n"
+          "    -g, --glitch SCANS   Drop a byte after SCANS scans\n",
+          argv0);
+  exit(EX_USAGE);
+}
+
+int main(int argc, char **argv)
+{
+  static const struct option longopts[] = {
+    { "port", required_argument, NULL, 'p' },
+    { "rate", required_argument, NULL, 'r' },
+    { "glitch", required_argument, NULL, 'g' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
+  int port = 10001;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "p:r:g:h", longopts, NULL)) != -1) {
+    switch (opt) {
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'r':
+      sim_opts.rate = atof(optarg);
+      break;
+    case 'g':
+      sim_opts.glitch = atoll(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc || port <= 0 || port > 65535 || sim_opts.rate < -1)
+    usage(argv[0]);
+
+  int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+  const int on = 1;
+  setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  struct sockaddr_in addr = {.sin_family = AF_INET,.sin_port = htons(port) };
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(sockfd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+      || listen(sockfd, 8) == -1) {
+    eprintf("Can't listen on port %d: %s\n", port, strerror(errno));
+    exit(EX_UNAVAILABLE);
+  }
+
+  // The real device only takes one client; this takes any number
+  for (;;) {
+    int fd = accept(sockfd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR)
+        continue;
+      eprintf("Error accepting: %s\n", strerror(errno));
+      exit(EX_OSERR);
+    }
+    dprintf("Client connected\n");
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, client_thread, (void *) (intptr_t) fd) != 0)
+      close(fd);
+    else
+      pthread_detach(thread);
+  }
+}
+
+#endif // USE_MAIN
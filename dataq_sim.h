@@ -0,0 +1,15 @@
+#ifndef __DATAQ_SIM_H__
+#define __DATAQ_SIM_H__
+
+// Simulated DI-718B, for testing and benchmarking without hardware, see
+// dataq_sim.c
+
+struct dataq_sim_opts {
+  double rate;           // Scans/s: > 0 as given, 0 as fast as possible,
+                         // < 0 as the device would from its X, M and C
+  long long glitch;      // Drop a byte after this many scans (0 for never)
+};
+
+int dataq_sim_serve(int fd, const struct dataq_sim_opts *opts);
+
+#endif // __DATAQ_SIM_H__
@@ -0,0 +1,391 @@
+/* Chunked column stores: long acquisitions in a file that can be queried
+ *
+ * A store is a fixed-size struct dataq_store_header (page 0), an index with
+ * room for max_chunks entries, and then the chunks themselves.  Each chunk
+ * holds chunk_scans scans as 14-bit codes, stored by column: all of channel
+ * 0's samples, then all of channel 1's, and so on, each column starting on a
+ * 128-byte boundary.  Its index entry gives the chunk's timestamps (a line,
+ * as in a log block), how many scans it holds, and each channel's smallest
+ * and largest code, so that a time range can be found with a binary search
+ * and an overview drawn from the index alone, without touching the samples.
+ *
+ * A chunk is normally full, but is cut short where the timestamps leave their
+ * line or scans were lost (the next chunk then has DATAQ_STORE_GAP set, and
+ * the gap's times and scans lost, several gaps in a row taken together).
+ *
+ * The writer maps the chunk being filled, preallocating the file ahead of it
+ * in large extents so the filesystem can keep it contiguous; the index is
+ * mapped throughout, and sparse until used.  Readers map the whole file,
+ * and can open it while it is still being written: n_chunks and each chunk's
+ * n_scans are only advanced once the samples they cover are in place.
+ *
+ * As with logs, everything is in host byte order.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dataq.h"
+#include "dataq_private.h"
+
+#define HEADER_BYTES 4096          // Room for the header, before the index
+#define EXTENT_BYTES (64 << 20)    // Preallocated at a time
+#define COLUMN_ALIGN 64            // Scans: 128 bytes of codes
+
+struct dataq_store {
+  int fd;
+  int writing;
+  uint8_t *map;                    // Header and index, or (reading) everything
+  size_t map_len;
+  struct dataq_store_header *hdr;
+  struct dataq_store_chunk *index;
+  size_t chunk_bytes;
+
+  // Writing
+  uint8_t *chunk_map;              // Mapping of the chunk being filled...
+  size_t chunk_map_len;
+  uint16_t *chunk;                 // ...and the chunk within it
+  int filling;                     // The last chunk takes more scans
+  uint32_t flags;                  // For the next chunk...
+  struct dataq_gap gap;            // ...and the gap before it, with DATAQ_STORE_GAP
+  uint64_t allocated;              // File size so far
+};
+
+static int64_t tv_ns(const struct timeval *tv)
+{
+  return (int64_t) tv->tv_sec * 1000000000 + (int64_t) tv->tv_usec * 1000;
+}
+
+static uint64_t round_up(const uint64_t n, const uint64_t to)
+{
+  return (n + to - 1) / to * to;
+}
+
+/*
+ *  Writing
+ */
+
+// Create a store at path for the acquisition described by hdr (whose format
+// is ignored: a store always holds codes), with chunk_scans scans per chunk
+// (a multiple of 64) and room for max_chunks; 0 for either gives the default
+int dataq_store_create(struct dataq_store **stp, const char *path,
+                       const struct dataq_log_header *hdr,
+                       const int chunk_scans, const long long max_chunks)
+{
+  const uint32_t rows = chunk_scans ? chunk_scans : DATAQ_STORE_SCANS;
+  const uint64_t n_max = max_chunks ? max_chunks : DATAQ_STORE_CHUNKS;
+  if (rows % COLUMN_ALIGN || rows > (1 << 24) || n_max > UINT32_MAX
+      || hdr->n_chans < 1 || hdr->n_chans > DATAQ_MAXCHAN)
+    return -EX_DATAERR;
+
+  struct dataq_store *st = calloc(1, sizeof(*st));
+  if (st == NULL)
+    return -EX_OSERR;
+  st->writing = 1;
+  st->chunk_bytes = (size_t) rows * hdr->n_chans * sizeof(uint16_t);
+  const uint64_t data_at = round_up(HEADER_BYTES + n_max * sizeof(struct dataq_store_chunk),
+                                    sysconf(_SC_PAGESIZE));
+
+  if ((st->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+    eprintf("Error creating %s: %s\n", path, strerror(errno));
+    free(st);
+    return -EX_CANTCREAT;
+  }
+  if (ftruncate(st->fd, data_at) == -1
+      || (st->map = mmap(NULL, data_at, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         st->fd, 0)) == MAP_FAILED) {
+    eprintf("Error mapping %s: %s\n", path, strerror(errno));
+    close(st->fd);
+    free(st);
+    return -EX_IOERR;
+  }
+  st->map_len = st->allocated = data_at;
+  st->hdr = (struct dataq_store_header *) st->map;
+  st->index = (struct dataq_store_chunk *) (st->map + HEADER_BYTES);
+
+  memcpy(st->hdr->magic, DATAQ_STORE_MAGIC, sizeof(st->hdr->magic));
+  st->hdr->version = DATAQ_STORE_VERSION;
+  st->hdr->chunk_scans = rows;
+  st->hdr->max_chunks = n_max;
+  st->hdr->n_chunks = 0;
+  st->hdr->index_at = HEADER_BYTES;
+  st->hdr->data_at = data_at;
+  st->hdr->acq = *hdr;
+  st->hdr->acq.format = DATAQ_LOG_CODES;
+
+  *stp = st;
+  return EX_OK;
+}
+
+// Make sure the file reaches end, preallocating a good way past it
+static int allocate(struct dataq_store *st, const uint64_t end)
+{
+  if (end <= st->allocated)
+    return EX_OK;
+  const uint64_t size = round_up(end, st->chunk_bytes > EXTENT_BYTES ? st->chunk_bytes : EXTENT_BYTES);
+#ifdef __linux__
+  // Where fallocate() isn't supported, ftruncate() leaves it sparse instead
+  int err = posix_fallocate(st->fd, st->allocated, size - st->allocated);
+  if (err != 0 && err != EOPNOTSUPP && err != EINVAL) {
+    eprintf("Error extending store: %s\n", strerror(err));
+    return -EX_IOERR;
+  }
+  if (err == 0) {
+    st->allocated = size;
+    return EX_OK;
+  }
+#endif
+  if (ftruncate(st->fd, size) == -1) {
+    eprintf("Error extending store: %s\n", strerror(errno));
+    return -EX_IOERR;
+  }
+  st->allocated = size;
+  return EX_OK;
+}
+
+// Start a new chunk, at time t
+static int start_chunk(struct dataq_store *st, const int64_t t)
+{
+  const uint64_t k = st->hdr->n_chunks;
+  if (k == st->hdr->max_chunks) {
+    eprintf("Store full, after %llu chunks\n", (unsigned long long) k);
+    return -EX_CANTCREAT;
+  }
+
+  // Map just this chunk (from the page it starts in)
+  const uint64_t at = st->hdr->data_at + k * st->chunk_bytes;
+  int ret = allocate(st, at + st->chunk_bytes);
+  if (ret < 0)
+    return ret;
+  if (st->chunk_map != NULL)
+    munmap(st->chunk_map, st->chunk_map_len);
+  const uint64_t page = sysconf(_SC_PAGESIZE);
+  const uint64_t map_at = at / page * page;
+  st->chunk_map_len = at - map_at + st->chunk_bytes;
+  st->chunk_map = mmap(NULL, st->chunk_map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       st->fd, map_at);
+  if (st->chunk_map == MAP_FAILED) {
+    st->chunk_map = NULL;
+    eprintf("Error mapping store: %s\n", strerror(errno));
+    return -EX_IOERR;
+  }
+  st->chunk = (uint16_t *) (st->chunk_map + (at - map_at));
+
+  struct dataq_store_chunk *ch = &st->index[k];
+  memset(ch, 0, sizeof(*ch));
+  ch->t_ns = t;
+  ch->flags = st->flags;
+  if (st->flags & DATAQ_STORE_GAP) {
+    ch->gap_start_ns = tv_ns(&st->gap.start);
+    ch->gap_end_ns = tv_ns(&st->gap.end);
+    ch->gap_lost = st->gap.lost;
+  }
+  memset(ch->min, 0xFF, sizeof(ch->min));
+  st->flags = 0;
+  st->filling = 1;
+  __atomic_store_n(&st->hdr->n_chunks, k + 1, __ATOMIC_RELEASE);
+  return EX_OK;
+}
+
+// Append n_scans scans of codes[], interleaved as received, with their
+// timestamps tv[], transposing them into the chunks' columns
+// Scans share a chunk for as long as their timestamps stay within a
+// microsecond of a straight line, as in dataq_log_write()
+int dataq_store_write(struct dataq_store *st, const uint16_t codes[],
+                      const struct timeval tv[], const int n_scans)
+{
+  const int n_chans = st->hdr->acq.n_chans;
+  const uint32_t rows = st->hdr->chunk_scans;
+  int s = 0;
+
+  while (s < n_scans) {
+    struct dataq_store_chunk *ch = st->filling ? &st->index[st->hdr->n_chunks - 1] : NULL;
+    if (ch == NULL || ch->n_scans == rows) {
+      int ret = start_chunk(st, tv_ns(&tv[s]));
+      if (ret < 0)
+        return ret;
+      ch = &st->index[st->hdr->n_chunks - 1];
+    }
+
+    // How many of the scans carry on this chunk's line
+    const uint32_t n0 = ch->n_scans;
+    uint32_t n = n0;
+    double period_ns = ch->period_ns;
+    int k;
+    for (k = s; k < n_scans && n < rows; k++, n++) {
+      const int64_t t = tv_ns(&tv[k]);
+      if (n > 1 && fabs(t - (ch->t_ns + n * period_ns)) > 1000)
+        break;
+      if (n > 0)
+        period_ns = (double) (t - ch->t_ns) / n;
+    }
+    if (n == n0) {
+      st->filling = 0;  // Off the line: on to a new chunk
+      continue;
+    }
+
+    // Transpose them in, a column at a time
+    const int run = n - n0;
+    int c, i;
+    for (c = 0; c < n_chans; c++) {
+      uint16_t *col = &st->chunk[(size_t) c * rows + n0];
+      const uint16_t *src = &codes[(size_t) s * n_chans + c];
+      uint16_t lo = ch->min[c], hi = ch->max[c];
+      for (i = 0; i < run; i++) {
+        const uint16_t v = src[(size_t) i * n_chans];
+        col[i] = v;
+        lo = v < lo ? v : lo;
+        hi = v > hi ? v : hi;
+      }
+      ch->min[c] = lo;
+      ch->max[c] = hi;
+    }
+    ch->period_ns = period_ns;
+    __atomic_store_n(&ch->n_scans, n, __ATOMIC_RELEASE);
+    s += run;
+  }
+  return EX_OK;
+}
+
+// Note a gap in the scans, between the last one written and the next
+int dataq_store_gap(struct dataq_store *st, const struct dataq_gap *gap)
+{
+  st->filling = 0;
+  if (st->flags & DATAQ_STORE_GAP) {
+    st->gap.end = gap->end;
+    st->gap.lost += gap->lost;
+  }
+  else
+    st->gap = *gap;
+  st->flags |= DATAQ_STORE_GAP;
+  return EX_OK;
+}
+
+/*
+ *  Reading
+ */
+
+// Open the store at path to read, possibly while it's still being written
+int dataq_store_open(struct dataq_store **stp, const char *path)
+{
+  struct dataq_store *st = calloc(1, sizeof(*st));
+  if (st == NULL)
+    return -EX_OSERR;
+  if ((st->fd = open(path, O_RDONLY)) < 0) {
+    eprintf("Can't open %s: %s\n", path, strerror(errno));
+    free(st);
+    return -EX_NOINPUT;
+  }
+
+  struct dataq_store_header hdr;
+  struct stat sb;
+  int ret = -EX_DATAERR;
+  if (pread(st->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+      || memcmp(hdr.magic, DATAQ_STORE_MAGIC, sizeof(hdr.magic))) {
+    eprintf("%s isn't a dataq store\n", path);
+    goto fail;
+  }
+  if (hdr.version != DATAQ_STORE_VERSION) {
+    eprintf("Unsupported store version %u\n", hdr.version);
+    goto fail;
+  }
+  if (hdr.acq.n_chans < 1 || hdr.acq.n_chans > DATAQ_MAXCHAN || hdr.chunk_scans == 0
+      || fstat(st->fd, &sb) == -1 || (uint64_t) sb.st_size < hdr.data_at)
+    goto fail;
+
+  st->map_len = sb.st_size;
+  st->map = mmap(NULL, st->map_len, PROT_READ, MAP_SHARED, st->fd, 0);
+  if (st->map == MAP_FAILED) {
+    eprintf("Error mapping %s: %s\n", path, strerror(errno));
+    ret = -EX_IOERR;
+    goto fail;
+  }
+  st->hdr = (struct dataq_store_header *) st->map;
+  st->index = (struct dataq_store_chunk *) (st->map + hdr.index_at);
+  st->chunk_bytes = (size_t) hdr.chunk_scans * hdr.acq.n_chans * sizeof(uint16_t);
+  *stp = st;
+  return EX_OK;
+
+fail:
+  close(st->fd);
+  free(st);
+  return ret;
+}
+
+const struct dataq_store_header *dataq_store_header(const struct dataq_store *st)
+{
+  return st->hdr;
+}
+
+// How many chunks there are to read (or, writing, have been started)
+long long dataq_store_chunks(const struct dataq_store *st)
+{
+  uint64_t n = __atomic_load_n(&st->hdr->n_chunks, __ATOMIC_ACQUIRE);
+  if (!st->writing) {
+    // Only what was there when it was opened
+    const uint64_t room = (st->map_len - st->hdr->data_at) / st->chunk_bytes;
+    if (n > room)
+      n = room;
+  }
+  return n;
+}
+
+const struct dataq_store_chunk *dataq_store_index(const struct dataq_store *st,
+                                                  const long long chunk)
+{
+  return &st->index[chunk];
+}
+
+// A chunk's samples for one channel; index entry's n_scans of them are valid
+const uint16_t *dataq_store_column(const struct dataq_store *st,
+                                   const long long chunk, const int chan)
+{
+  if (st->writing)
+    return NULL;
+  return (const uint16_t *) (st->map + st->hdr->data_at + chunk * st->chunk_bytes)
+         + (size_t) chan * st->hdr->chunk_scans;
+}
+
+// The first chunk with scans at or after t_ns, or dataq_store_chunks() if none
+long long dataq_store_find(const struct dataq_store *st, const int64_t t_ns)
+{
+  long long lo = 0, hi = dataq_store_chunks(st);
+  while (lo < hi) {
+    const long long mid = lo + (hi - lo) / 2;
+    const struct dataq_store_chunk *ch = &st->index[mid];
+    const uint32_t n = __atomic_load_n(&ch->n_scans, __ATOMIC_ACQUIRE);
+    const int64_t last = ch->t_ns + llround((n ? n - 1 : 0) * ch->period_ns);
+    if (last < t_ns)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Finish with a store; when writing, trim the preallocation off the end
+int dataq_store_close(struct dataq_store *st)
+{
+  int ret = EX_OK;
+  if (st->writing) {
+    if (st->chunk_map != NULL)
+      munmap(st->chunk_map, st->chunk_map_len);
+    const uint64_t end = st->hdr->data_at + st->hdr->n_chunks * st->chunk_bytes;
+    if (msync(st->map, st->map_len, MS_SYNC) == -1 || ftruncate(st->fd, end) == -1) {
+      eprintf("Error finishing store: %s\n", strerror(errno));
+      ret = -EX_IOERR;
+    }
+  }
+  munmap(st->map, st->map_len);
+  close(st->fd);
+  free(st);
+  return ret;
+}
@@ -0,0 +1,308 @@
+/* Zero-copy receive: scans lent out in place from a pool of buffers
+ *
+ * dataq_recv_batch() receives into its struct dataq_rx and then copies out to
+ * the caller's values[].  Here the library instead owns a pool of large,
+ * cache-line aligned buffers: each is received into directly, decoded in place
+ * (the 14-bit codes overwrite the words they came from, unless the words are
+ * wanted too), converted alongside if asked, and lent to a callback as a
+ * read-only struct dataq_view.
+ *
+ * The callback can keep a buffer beyond its return with dataq_view_hold(), and
+ * give it back later, from any thread, with dataq_view_release(); receiving
+ * carries on meanwhile in the pool's other buffers.  If nothing is held, the
+ * same buffer is used over and over, so it stays in cache.
+ *
+ * The only bytes ever copied are a trailing partial scan (or what follows a
+ * bad one), moved to the start of the next buffer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "dataq.h"
+#include "dataq_private.h"
+
+#define ALIGN 64          // Buffer alignment, a cache line
+#define WAIT_MS 100       // How often to check for a stop while the pool's empty
+#define WARN_MS 1000      // Complain if the pool has been empty this long
+
+struct stream_buf {
+  uint16_t *words;       // As received
+  uint16_t *codes;       // Decoded; the same as words unless opts.raw
+  float *values;         // If opts.values
+  atomic_int refs;       // Held by the callback (or until it returns)
+};
+
+struct dataq_stream {
+  int sockfd;
+  int n_chans;
+  const struct dataq_conv *conv;
+  struct dataq_stream_opts opts;
+  struct dataq_stop stop;
+
+  struct stream_buf *bufs;
+  pthread_mutex_t lock;  // Guards free[], and...
+  pthread_cond_t freed;  // ...signalled when a buffer goes back in it
+  int *free;
+  int n_free;
+
+  int cur;               // Buffer being received into...
+  int len;               // ...and how many bytes it has
+  int hunting;           // As struct dataq_rx
+  long long hunted;
+};
+
+static size_t round_up(size_t n)
+{
+  return (n + ALIGN - 1) & ~(size_t) (ALIGN - 1);
+}
+
+// Set up to receive from a connected, streaming socket (which stays the
+// caller's to close) into a pool of buffers, as opts (may be NULL for defaults)
+// NOTE conv is used in place, so must outlive the stream
+int dataq_stream_open(struct dataq_stream **sp, int sockfd,
+                      const struct dataq_conv *conv,
+                      const struct dataq_stream_opts *opts)
+{
+  struct dataq_stream *s = calloc(1, sizeof(*s));
+  if (s == NULL)
+    return -EX_OSERR;
+  if (opts != NULL)
+    s->opts = *opts;
+  if (s->opts.n_bufs < 1)
+    s->opts.n_bufs = DATAQ_STREAM_BUFS;
+  if (s->opts.buf_scans < 1)
+    s->opts.buf_scans = DATAQ_STREAM_SCANS;
+  s->sockfd = sockfd;
+  s->n_chans = conv->n_chans;
+  s->conv = conv;
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->freed, NULL);
+
+  int ret;
+  if ((ret = dataq_stop_init(&s->stop)) < 0) {
+    free(s);
+    return ret;
+  }
+
+  // Each buffer is one allocation: words, then codes and values if wanted
+  const size_t n_words = (size_t) s->opts.buf_scans * s->n_chans;
+  const size_t words_size = round_up(n_words * sizeof(uint16_t));
+  const size_t size = words_size + (s->opts.raw ? words_size : 0)
+                      + (s->opts.values ? round_up(n_words * sizeof(float)) : 0);
+  s->bufs = calloc(s->opts.n_bufs, sizeof(*s->bufs));
+  s->free = malloc(s->opts.n_bufs * sizeof(*s->free));
+  if (s->bufs == NULL || s->free == NULL) {
+    dataq_stream_close(s);
+    return -EX_OSERR;
+  }
+  int i;
+  for (i = 0; i < s->opts.n_bufs; i++) {
+    struct stream_buf *b = &s->bufs[i];
+    void *p;
+    if (posix_memalign(&p, ALIGN, size) != 0) {
+      dataq_stream_close(s);
+      return -EX_OSERR;
+    }
+    b->words = p;
+    b->codes = s->opts.raw ? (uint16_t *) ((uint8_t *) p + words_size) : b->words;
+    if (s->opts.values)
+      b->values = (float *) ((uint8_t *) p + (s->opts.raw ? 2 : 1) * words_size);
+    atomic_init(&b->refs, 0);
+  }
+
+  // The first buffer is taken to receive into; the rest are free
+  s->cur = 0;
+  for (i = s->opts.n_bufs - 1; i > 0; i--)
+    s->free[s->n_free++] = i;
+
+  *sp = s;
+  return EX_OK;
+}
+
+// Take a free buffer, waiting for one to be released if need be
+// Returns its number, or -1 if stopped first
+static int take_buf(struct dataq_stream *s)
+{
+  int waited = 0, b = -1;
+
+  pthread_mutex_lock(&s->lock);
+  while (s->n_free == 0 && !dataq_stop_pending(&s->stop)) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += WAIT_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&s->freed, &s->lock, &deadline);
+    if ((waited += WAIT_MS) == WARN_MS)
+      eprintf("All %d stream buffers held, waiting for one back\n", s->opts.n_bufs);
+  }
+  if (s->n_free > 0)
+    b = s->free[--s->n_free];
+  pthread_mutex_unlock(&s->lock);
+  return b;
+}
+
+// Keep a view's buffer out of the pool after the callback returns, until
+// dataq_view_release()
+void dataq_view_hold(struct dataq_stream *s, const struct dataq_view *view)
+{
+  atomic_fetch_add(&s->bufs[view->buf].refs, 1);
+}
+
+// Give back a view's buffer, once for each dataq_view_hold()
+// May be called from any thread
+void dataq_view_release(struct dataq_stream *s, const struct dataq_view *view)
+{
+  if (atomic_fetch_sub(&s->bufs[view->buf].refs, 1) != 1)
+    return;
+
+  pthread_mutex_lock(&s->lock);
+  s->free[s->n_free++] = view->buf;
+  pthread_cond_signal(&s->freed);
+  pthread_mutex_unlock(&s->lock);
+}
+
+// Put back words that were decoded in place, from..to, as they were received
+// (their sync flags having been good)
+static void undecode(uint16_t words[], size_t from, const size_t to,
+                     const int n_chans)
+{
+  for (; from < to; from++) {
+    const uint16_t code = words[from];
+    words[from] = ((code & 0x3F80) << 2) | ((code & 0x007F) << 1)
+                  | ((from % n_chans) ? 0x0101 : 0x0100);
+  }
+}
+
+// Skip past a bad scan at the head of the current buffer, as dataq_recv_batch()
+static void hunt(struct dataq_stream *s, const size_t good)
+{
+  const int scan_bytes = 2 * s->n_chans;
+  uint8_t *bytes = (uint8_t *) s->bufs[s->cur].words;
+
+  if (!s->hunting) {
+    eprintf("LSB mismatch @ %d: %04X, resynchronizing\n",
+            (int) good, s->bufs[s->cur].words[good]);
+    s->hunting = 1;
+    s->hunted = 0;
+  }
+  int o = dataq_find_sync(bytes, s->len, s->n_chans);
+  if (o < 0)
+    o = s->len - scan_bytes + 1;  // Keep what could be the start of a scan
+  s->len -= o;
+  memmove(bytes, bytes + o, s->len);
+  s->hunted += o;
+}
+
+// Receive and decode scans, lending each batch of them to fn, with arg, until
+// dataq_stream_stop(), the callback returns nonzero, or the device goes away
+// Returns EX_OK if stopped, the callback's nonzero return, or a negated EX_ code
+int dataq_stream_run(struct dataq_stream *s, dataq_view_fn fn, void *arg)
+{
+  const int n_chans = s->n_chans;
+  const int scan_bytes = 2 * n_chans;
+  const int cap = s->opts.buf_scans * scan_bytes;
+
+  for (;;) {
+    struct stream_buf *b = &s->bufs[s->cur];
+    uint8_t *bytes = (uint8_t *) b->words;
+    struct timeval kts = { 0 };
+
+    // Receive until there is at least one whole scan; take whatever else is ready
+    while (s->len < scan_bytes) {
+      int n = dataq_recv_data(s->sockfd, bytes + s->len, cap - s->len, 0,
+                              &s->stop, s->opts.timestamping ? &kts : NULL);
+      if (n == -EX_TEMPFAIL)
+        continue;
+      if (n < 0)
+        return dataq_stop_pending(&s->stop) ? EX_OK : n;
+      s->len += n;
+    }
+
+    // Check and unpack whole scans, stopping short of a bad one; anything
+    // decoded in place past the last whole good scan is put back for later
+    const size_t n_words = (size_t) (s->len / scan_bytes) * n_chans;
+    const size_t good = dataq_decode(b->words, b->codes, n_words / n_chans, n_chans);
+    const int n_scans = good / n_chans;
+    if (good < n_words && b->codes == b->words)
+      undecode(b->words, (size_t) n_scans * n_chans, good, n_chans);
+    if (n_scans == 0) {
+      hunt(s, good);
+      continue;
+    }
+    if (s->hunting) {
+      s->hunting = 0;
+      eprintf("Resynchronized after skipping %lld bytes (~%lld scans)\n",
+              s->hunted, (s->hunted + scan_bytes / 2) / scan_bytes);
+    }
+
+    struct dataq_view view = {
+      .words = s->opts.raw ? b->words : NULL,
+      .codes = b->codes,
+      .values = b->values,
+      .n_scans = n_scans,
+      .n_chans = n_chans,
+      .buf = s->cur,
+    };
+    if (s->opts.timestamping && kts.tv_sec)
+      view.tv = kts;
+    else
+      gettimeofday(&view.tv, NULL);
+
+    if (b->values != NULL) {
+      int i;
+      for (i = 0; i < n_scans * n_chans; i += n_chans) {
+        int c;
+        for (c = 0; c < n_chans; c++)
+          b->values[i + c] = s->conv->lut[c][b->codes[i + c]];
+      }
+    }
+
+    atomic_store(&b->refs, 1);
+    int ret = fn(arg, &view);
+    dataq_view_release(s, &view);
+
+    // Carry the leftovers over to the next buffer (this one again, unless held)
+    const int used = n_scans * scan_bytes;
+    const int next = take_buf(s);
+    if (next < 0)
+      return ret != 0 ? ret : EX_OK;
+    memmove(s->bufs[next].words, bytes + used, s->len - used);
+    s->len -= used;
+    s->cur = next;
+    if (ret != 0)
+      return ret;
+  }
+}
+
+// Make dataq_stream_run() return
+// NOTE async-signal-safe, so may be called from a signal handler
+void dataq_stream_stop(struct dataq_stream *s)
+{
+  dataq_stop_signal(&s->stop);
+}
+
+// Free the stream and its buffers, which must all have been released
+void dataq_stream_close(struct dataq_stream *s)
+{
+  if (s->bufs != NULL) {
+    int i;
+    for (i = 0; i < s->opts.n_bufs; i++)
+      free(s->bufs[i].words);
+  }
+  free(s->bufs);
+  free(s->free);
+  pthread_mutex_destroy(&s->lock);
+  pthread_cond_destroy(&s->freed);
+  dataq_stop_close(&s->stop);
+  free(s);
+}